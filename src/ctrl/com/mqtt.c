@@ -5,33 +5,44 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <mosquitto.h>
 
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
 #include "mqtt.h"
+#include "mqtt_priv.h"
+#include "mqtt_trie.h"
 #include "../logger.h"
+#include "../../stringhelp.h"
 
-struct mqtt_handle
-{
-  struct mosquitto * mosq;
-  struct mqtt_config * cfg;
-};
+LOG_CHANNEL(log_ch_mqtt, "mqtt");
 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
-void on_connect(struct mosquitto * mosq, void * userdata, int mid)
+void on_connect(struct mosquitto * mosq, void * userdata, int rc, int flags, const mosquitto_property * props)
 {
   struct mqtt_handle * hnd = (struct mqtt_handle *) userdata;
+  char reason[MQTT_REASON_LEN];
+
+  if (rc != 0)
+  {
+    mqtt_conn_down(hnd, mqtt_v5_reason(hnd->cfg->v5 ? mosquitto_reason_string(rc) : mosquitto_connack_string(rc), props, reason, sizeof(reason)));
+    return;
+  }
   LG_INFO("MQTT - Connection to broker established.");
+  mqtt_v5_connected(hnd, props);
+  mqtt_conn_up(hnd);
   if (hnd->cfg->subs) {
     struct mqtt_sub * sub = hnd->cfg->subs;
     while (sub && sub->topic) {
       switch (mosquitto_subscribe(mosq, NULL, sub->topic, hnd->cfg->qos)) {
-        case MOSQ_ERR_INVAL:           LG_ERROR("Could not subscribe %s - invalid params.", sub->topic);   break;
-        case MOSQ_ERR_NOMEM:           LG_ERROR("Could not subscribe %s - out of memory.", sub->topic);    break;
-        case MOSQ_ERR_NO_CONN:         LG_ERROR("Could not subscribe %s - no connection.", sub->topic);    break;
-        case MOSQ_ERR_MALFORMED_UTF8:  LG_ERROR("Could not subscribe %s - no valid utf-8.", sub->topic);   break;
-        case MOSQ_ERR_OVERSIZE_PACKET: LG_ERROR("Could not subscribe %s - oversized packet.", sub->topic); break;
-        case MOSQ_ERR_SUCCESS:         LG_INFO("Subscribed '%s'.", sub->topic);                            break;
+        case MOSQ_ERR_INVAL:           LG_ERROR_RL("Could not subscribe %s - invalid params.", sub->topic);   break;
+        case MOSQ_ERR_NOMEM:           LG_ERROR_RL("Could not subscribe %s - out of memory.", sub->topic);    break;
+        case MOSQ_ERR_NO_CONN:         LG_ERROR_RL("Could not subscribe %s - no connection.", sub->topic);    break;
+        case MOSQ_ERR_MALFORMED_UTF8:  LG_ERROR_RL("Could not subscribe %s - no valid utf-8.", sub->topic);   break;
+        case MOSQ_ERR_OVERSIZE_PACKET: LG_ERROR_RL("Could not subscribe %s - oversized packet.", sub->topic); break;
+        case MOSQ_ERR_SUCCESS:         LG_INFO("Subscribed '%s'.", sub->topic);                               break;
         default:                       break;
       }
       ++sub;
@@ -40,138 +51,269 @@ void on_connect(struct mosquitto * mosq, void * userdata, int mid)
 
 }
 
-void on_publish(struct mosquitto *mosq, void * userdata, int mid)
+void on_publish(struct mosquitto *mosq, void * userdata, int mid, int rc, const mosquitto_property * props)
 {
+  char reason[MQTT_REASON_LEN];
+
+  if (rc >= MQTT_REASON_ERROR)  /* v5 PUBACK/PUBREC of a QoS 1/2 message */
+    LG_ERROR_RL("MQTT - Broker refused message %d: %s.", mid, mqtt_v5_reason(mosquitto_reason_string(rc), props, reason, sizeof(reason)));
 //  LG_DEBUG("MQTT - Value published.");
 }
 
-void on_message(struct mosquitto *mosq, void * userdata, const struct mosquitto_message * msg) {
+struct mqtt_message_ref
+{
+  const char * topic;
+  const char * payload;
+};
+
+static void mqtt_dispatch_sub(const struct mqtt_sub * sub, void * ctx)
+{
+  const struct mqtt_message_ref * msg = ctx;
+  if (sub->cb)
+    sub->cb(msg->topic, msg->payload);
+}
+
+void mqtt_dispatch(struct mqtt_handle * hnd, const char * topic, const char * payload)
+{
+  struct mqtt_message_ref msg = { topic, payload };
+  uint64_t start = stat_now_ns();
+
+  if (mqtt_trie_match(hnd->subs, topic, mqtt_dispatch_sub, &msg) == 0)
+    LG_DEBUG("No subscription matches topic %s.", topic);
+  else
+    mqtt_stats_callback(hnd, stat_now_ns() - start);
+}
+
+void on_message(struct mosquitto *mosq, void * userdata, const struct mosquitto_message * msg, const mosquitto_property * props) {
   struct mqtt_handle * hnd = (struct mqtt_handle *) userdata;
-  LG_DEBUG("Received message on topic %s (id:%d): %s.", msg->topic, msg->mid, (char *) msg->payload);
-  for (struct mqtt_sub * sub = hnd->cfg->subs; sub && sub->topic; ++sub) {
-    if (strncmp(msg->topic, sub->topic, 256) == 0 && sub->cb) {
-      sub->cb(msg->topic, (char *) msg->payload);
-      break;
-    }
+  struct mosquitto_message plain;
+
+  mqtt_stats_received(hnd, (size_t) msg->payloadlen);
+  if (mqtt_zip_packed(msg))
+  {
+    if (!mqtt_zip_unpack(hnd, msg, &plain))
+      return;
+    msg = &plain;
   }
+  LG_DEBUG("Received message on topic %s (id:%d): %s.", msg->topic, msg->mid, (char *) msg->payload);
+  if (!mqtt_threads_push(hnd, msg))
+    mqtt_dispatch(hnd, msg->topic, (char *) msg->payload);
 }
 
-void on_disconnect(struct mosquitto *mosq, void *userdata, int mid)
+void on_disconnect(struct mosquitto *mosq, void *userdata, int rc, const mosquitto_property * props)
 {
-  LG_ERROR("MQTT - Connection to broker disconnected!");
+  struct mqtt_handle * hnd = (struct mqtt_handle *) userdata;
+  char reason[MQTT_REASON_LEN];
+  const char * text = "disconnected";
+
+  if (rc >= MQTT_REASON_ERROR && hnd->cfg->v5)  /* DISCONNECT of the broker */
+    text = mqtt_v5_reason(mosquitto_reason_string(rc), props, reason, sizeof(reason));
+  else if (rc)
+    text = mosquitto_strerror(rc);
+  if (!hnd->closing)
+    LG_ERROR_RL("MQTT - Connection to broker disconnected (%s)!", text);
+  mqtt_conn_down(hnd, text);
 }
 
 #pragma GCC diagnostic warning "-Wunused-parameter"
 
 
-enum mqtt_retval mqtt_init(struct mqtt_handle ** hnd, struct mqtt_config * cfg)
+uint64_t mqtt_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static int mqtt_create(struct mqtt_handle ** hnd, struct mqtt_config * cfg, size_t spool_bytes)
 {
   int result;
 
+  LG_DEBUG("Initializing connection to MQTT broker.");
+
+  *hnd = calloc(sizeof(struct mqtt_handle), 1);
   if (*hnd == NULL)
   {
-    LG_DEBUG("Initializing connection to MQTT broker.");
+    LG_CRITICAL("Could not allocate resources for MQTT Connection!");
+    goto init_mqtt_fail;
+  }
 
-    *hnd = calloc(sizeof(struct mqtt_handle), 1);
-    if (*hnd == NULL)
+  (*hnd)->cfg = cfg;
+  (*hnd)->ev_fd = -1;
+  if (!mqtt_stats_init(*hnd))
+  {
+    LG_CRITICAL("Could not allocate resources for MQTT stats!");
+    goto init_mqtt_fail;
+  }
+  mqtt_conn_init(*hnd);
+  if (!mqtt_batch_init(*hnd))
+  {
+    LG_CRITICAL("Could not allocate resources for MQTT batching!");
+    goto init_mqtt_fail;
+  }
+  if (!mqtt_cache_init(*hnd))
+  {
+    LG_CRITICAL("Could not allocate resources for MQTT change-only publishing!");
+    goto init_mqtt_fail;
+  }
+  if (!mqtt_spool_init(*hnd, spool_bytes))
+  {
+    LG_CRITICAL("Could not set up the MQTT spool!");
+    goto init_mqtt_fail;
+  }
+  if (cfg->subs)
+  {
+    (*hnd)->subs = mqtt_trie_build(cfg->subs);
+    if ((*hnd)->subs == NULL)
     {
-      LG_CRITICAL("Could not allocate resources for MQTT Connection!");
+      LG_CRITICAL("Could not allocate resources for MQTT subscriptions!");
       goto init_mqtt_fail;
     }
+  }
 
-    (*hnd)->cfg = cfg;
-    mosquitto_lib_init();
-    LG_DEBUG("MQTT library initialized.");
+  mosquitto_lib_init();
+  LG_DEBUG("MQTT library initialized.");
 
-    (*hnd)->mosq = mosquitto_new((*hnd)->cfg->client_id, TRUE, *hnd);
-    if ((*hnd)->mosq == NULL)
-    {
-      LG_CRITICAL("MQTT - Could not instantiate a broker socket.");
-      goto init_mqtt_fail;
-    }
-    LG_DEBUG("MQTT broker socket instantiated.");
+  (*hnd)->mosq = mosquitto_new((*hnd)->cfg->client_id, TRUE, *hnd);
+  if ((*hnd)->mosq == NULL)
+  {
+    LG_CRITICAL("MQTT - Could not instantiate a broker socket.");
+    goto init_mqtt_fail;
+  }
+  LG_DEBUG("MQTT broker socket instantiated.");
 
-    result = mosquitto_username_pw_set((*hnd)->mosq, (*hnd)->cfg->client_id, (*hnd)->cfg->client_id);
-    if (result != MOSQ_ERR_SUCCESS)
-    {
-      LG_CRITICAL("Could not set MQTT broker user: %d", result);
-      goto init_mqtt_fail;
-    }
-    LG_DEBUG("MQTT broker user set.");
+  if (!mqtt_v5_init(*hnd))
+  {
+    LG_CRITICAL("MQTT - Could not set up the MQTT v5 session.");
+    goto init_mqtt_fail;
+  }
+  if (!mqtt_zip_init(*hnd))
+  {
+    LG_CRITICAL("Could not allocate resources for MQTT compression!");
+    goto init_mqtt_fail;
+  }
 
-    mosquitto_publish_callback_set((*hnd)->mosq, on_publish);
-    mosquitto_connect_callback_set((*hnd)->mosq, on_connect);
-    mosquitto_disconnect_callback_set((*hnd)->mosq, on_disconnect);
-    mosquitto_message_callback_set((*hnd)->mosq, on_message);
-    LG_DEBUG("MQTT broker callbacks set.");
+  result = mosquitto_username_pw_set((*hnd)->mosq, (*hnd)->cfg->client_id, (*hnd)->cfg->client_id);
+  if (result != MOSQ_ERR_SUCCESS)
+  {
+    LG_CRITICAL("Could not set MQTT broker user: %d", result);
+    goto init_mqtt_fail;
   }
+  LG_DEBUG("MQTT broker user set.");
+
+  mosquitto_publish_v5_callback_set((*hnd)->mosq, on_publish);
+  mosquitto_connect_v5_callback_set((*hnd)->mosq, on_connect);
+  mosquitto_disconnect_v5_callback_set((*hnd)->mosq, on_disconnect);
+  mosquitto_message_v5_callback_set((*hnd)->mosq, on_message);
+  LG_DEBUG("MQTT broker callbacks set.");
+  return TRUE;
+
+init_mqtt_fail:
+  if (*hnd) {
+    if ((*hnd)->mosq)
+      mosquitto_destroy((*hnd)->mosq);
+    mqtt_batch_free(*hnd);
+    mqtt_cache_free(*hnd);
+    mqtt_spool_free(*hnd);
+    mqtt_stats_free(*hnd);
+    mqtt_v5_free(*hnd);
+    mqtt_zip_free(*hnd);
+    mqtt_trie_free((*hnd)->subs);
+    free(*hnd);
+    *hnd = NULL;
+  }
+  return FALSE;
+}
+
+enum mqtt_retval mqtt_init(struct mqtt_handle ** hnd, struct mqtt_config * cfg)
+{
+  int result;
+
+  if (*hnd == NULL && !mqtt_create(hnd, cfg, cfg->spool_bytes))
+    return MQTT_RET_FAILED;
 
   if ((result = mosquitto_connect((*hnd)->mosq, (*hnd)->cfg->remote_address, (*hnd)->cfg->remote_port, LINUXTOOLS_MQTT_KEEPALIVE)) != MOSQ_ERR_SUCCESS)
   {
     if (result == MOSQ_ERR_ERRNO)
       return MQTT_RET_RETRY;
     LG_CRITICAL("MQTT - Could not connect to broker. Connect returned: %u", result);
-    goto init_mqtt_fail;
+    mqtt_close(*hnd);
+    free(*hnd);
+    *hnd = NULL;
+    return MQTT_RET_FAILED;
   }
   LG_DEBUG("Success - MQTT broker connected.");
+  mqtt_conn_connecting(*hnd);
+  (*hnd)->misc_due = mqtt_now_ms() + MQTT_MISC_MS;
   return MQTT_RET_OK;
+}
 
-init_mqtt_fail:
-  if (*hnd) {
-    free(*hnd);
-    *hnd = NULL;
-  }
-  return MQTT_RET_FAILED;
+enum mqtt_retval mqtt_connect_async(struct mqtt_handle ** hnd, struct mqtt_config * cfg)
+{
+  if (!mqtt_create(hnd, cfg, cfg->spool_bytes ? cfg->spool_bytes : MQTT_SPOOL_DEFAULT))
+    return MQTT_RET_FAILED;
+  mqtt_conn_start(*hnd);
+  return MQTT_RET_OK;
 }
 
 
+static void mqtt_publish_field_v(struct mqtt_handle * hnd, const char * type, const char * entity, const char * field, const char * fmt, va_list ap)
+{
+  struct mqtt_line * line = mqtt_line_begin(entity);
+
+  mqtt_line_tag(line, "type", type);
+  mqtt_line_field_v(line, field, fmt, ap);
+  mqtt_line_publish(hnd, line);
+}
+
 void mqtt_publish_formatted(struct mqtt_handle * hnd, const char * type, const char * entity, const char * fmt, ...)
 {
-  static char tmp_val[64];
-  static char tmp_msg[255];
   va_list ap;
-  int result;
+  va_start(ap, fmt);
+  mqtt_publish_field_v(hnd, type, entity, "value", fmt, ap);
+  va_end(ap);
+}
 
+void mqtt_publish_field(struct mqtt_handle * hnd, const char * type, const char * entity, const char * field, const char * fmt, ...)
+{
+  va_list ap;
   va_start(ap, fmt);
-  result = vsnprintf(tmp_val, sizeof(tmp_val), fmt, ap);
+  mqtt_publish_field_v(hnd, type, entity, field, fmt, ap);
   va_end(ap);
+}
 
-  if (result >= ssizeof(tmp_val))
-  {
-    LG_ERROR("MQTT - publishing for %s:%s failed - format string exceeded size of %d chars.", type, entity, sizeof(tmp_val));
-    return;
-  }
+int mqtt_send(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len)
+{
+  if (hnd->v5)
+    return mqtt_v5_publish(hnd, topic, payload, len);
+  return mosquitto_publish(hnd->mosq, NULL, topic, (int) len, payload, hnd->cfg->qos, FALSE);
+}
+
+int mqtt_publish_payload(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len)
+{
+  return mqtt_zip_publish(hnd, topic, payload, len);  /* deflated from cfg->compress_min on */
+}
 
-  result = snprintf(tmp_msg, sizeof(tmp_msg), "%s,type=%s value=%s", entity, type, tmp_val);
+int mqtt_publish_plain(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len)
+{
+  int result;
 
-  if (result >= ssizeof(tmp_msg))
+  /* behind spooled messages - keep the order */
+  if (mqtt_spool_pending(hnd))
   {
-    LG_ERROR("MQTT - publishing for %s:%s failed - output string exceeded size of %d chars.", type, entity, sizeof(tmp_msg));
-    return;
+    mqtt_spool_add(hnd, topic, payload, len);
+    return MOSQ_ERR_SUCCESS;
   }
 
-  LG_DEBUG("MQTT - publishing in topic %s: %s.", hnd->cfg->topic, tmp_msg);
-  result = mosquitto_publish(hnd->mosq, NULL, hnd->cfg->topic, strlen(tmp_msg), tmp_msg, hnd->cfg->qos, FALSE);
-
-  switch (result)
+  result = mqtt_send(hnd, topic, payload, len);
+  if (hnd->spool && (result == MOSQ_ERR_NO_CONN || result == MOSQ_ERR_CONN_LOST))
   {
-    case MOSQ_ERR_SUCCESS            : break;
-    case MOSQ_ERR_INVAL              :
-    case MOSQ_ERR_NOMEM              :
-    case MOSQ_ERR_NO_CONN            :
-    case MOSQ_ERR_PROTOCOL           :
-    case MOSQ_ERR_PAYLOAD_SIZE       :
-    case MOSQ_ERR_MALFORMED_UTF8     :
-    case MOSQ_ERR_QOS_NOT_SUPPORTED  :
-    case MOSQ_ERR_OVERSIZE_PACKET    :
-      LG_ERROR("MQTT - Could not publish to broker. Error returned: %u", result);
-      break;
+    LG_DEBUG_RL("MQTT - broker not reachable, spooling messages.");
+    mqtt_spool_add(hnd, topic, payload, len);
+    return MOSQ_ERR_SUCCESS;
   }
-}
-
-void mqtt_publish_raw(struct mqtt_handle * hnd, const char * topic, const char * payload)
-{
-  int result = mosquitto_publish(hnd->mosq, NULL, topic, strlen(payload), payload, hnd->cfg->qos, FALSE);
+  mqtt_stats_published(hnd, len, result);
 
   switch (result)
   {
@@ -187,43 +329,176 @@ void mqtt_publish_raw(struct mqtt_handle * hnd, const char * topic, const char *
       LG_ERROR("MQTT - Could not publish '%s' to broker. Error returned: %u", topic, result);
       break;
   }
+  return result;
+}
 
+void mqtt_publish_raw(struct mqtt_handle * hnd, const char * topic, const char * payload)
+{
+  mqtt_publish_payload(hnd, topic, payload, strlen(payload));
 }
 
 void mqtt_publish(struct mqtt_handle * hnd, const char * type, const char * entity, int value)
 {
-  mqtt_publish_formatted(hnd, type, entity, "%d", value);
+  struct mqtt_line * line = mqtt_line_begin(entity);
+  char num[STR_NUM_LEN];
+
+  mqtt_line_tag(line, "type", type);
+  mqtt_line_field_raw(line, "value", num, str_i64(num, value));  /* no 'i' - stays the float field it always was */
+  mqtt_line_publish(hnd, line);
 }
 
 
-void mqtt_loop(struct mqtt_handle * hnd, int timeout)
+static int mqtt_result(struct mqtt_handle * hnd, int result)
 {
-  int result;
-  result = mosquitto_loop(hnd->mosq, timeout, 1);
+  const char * reason;
+
   switch (result)
   {
     case MOSQ_ERR_SUCCESS   : break;
     case MOSQ_ERR_NO_CONN   :
-      result = mosquitto_reconnect(hnd->mosq);
-      LG_INFO("MQTT - disconnected. Reconnect returns %d.", result);
+      mqtt_conn_down(hnd, "not connected");  /* the state machine reconnects, no-op while it does */
+      break;
+    case MOSQ_ERR_CONN_LOST :
+      mqtt_conn_down(hnd, mosquitto_strerror(result));
       break;
     case MOSQ_ERR_INVAL     :
     case MOSQ_ERR_NOMEM     :
-    case MOSQ_ERR_CONN_LOST :
     case MOSQ_ERR_PROTOCOL  :
-      LG_CRITICAL("MQTT - Could not process broker. Error returned: %u", result);
+      LG_CRITICAL_RL("MQTT - Could not process broker. Error returned: %u", result);
       break;
     case MOSQ_ERR_ERRNO     :
-      LG_CRITICAL("MQTT - Could not process broker. Syscall returned %s", strerror(errno));
+      reason = strerror(errno);
+      LG_CRITICAL_RL("MQTT - Could not process broker. Syscall returned %s", reason);
+      mqtt_conn_down(hnd, reason);
       break;
   }
+  return result;
+}
+
+/* earliest deadline of connection, batch, spool and stats, 0: none */
+static uint64_t mqtt_due(struct mqtt_handle * hnd)
+{
+  uint64_t due = mqtt_conn_due(hnd);
+  uint64_t batch = mqtt_batch_due(hnd);
+  uint64_t spool = mqtt_spool_due(hnd);
+  uint64_t stats = mqtt_stats_due(hnd);
+
+  if (batch && (due == 0 || batch < due))
+    due = batch;
+  if (spool && (due == 0 || spool < due))
+    due = spool;
+  if (stats && (due == 0 || stats < due))
+    due = stats;
+  return due;
+}
+
+int mqtt_loop_once(struct mqtt_handle * hnd, int timeout)
+{
+  enum mqtt_state state = mqtt_get_state(hnd);
+  uint64_t due = mqtt_due(hnd);
+  uint64_t start = stat_now_ns();
+  uint64_t now;
+  int result;
+
+  if (state != MQTT_STATE_CONNECTED && state != MQTT_STATE_CONNECTING)
+  {
+    mqtt_conn_wait(due, timeout);  /* no socket - mosquitto_loop would return at once */
+    result = MOSQ_ERR_NO_CONN;
+  }
+  else
+  {
+    if (due)
+    {
+      now = mqtt_now_ms();
+      if (due <= now)
+        timeout = 0;
+      else if (timeout < 0 || due - now < (uint64_t) timeout)
+        timeout = (int) (due - now);
+    }
+    result = mqtt_result(hnd, mosquitto_loop(hnd->mosq, timeout, 1));
+  }
+  mqtt_conn_poll(hnd);
+  mqtt_batch_poll(hnd);
+  mqtt_spool_poll(hnd);
+  mqtt_stats_poll(hnd);
+  mqtt_stats_loop(hnd, stat_now_ns() - start);
+  return result;
+}
+
+void mqtt_loop(struct mqtt_handle * hnd, int timeout)
+{
+  mqtt_loop_once(hnd, timeout);
+}
+
+
+int mqtt_get_fd(struct mqtt_handle * hnd)
+{
+  return mosquitto_socket(hnd->mosq);
+}
+
+int mqtt_wants_write(struct mqtt_handle * hnd)
+{
+  return mosquitto_want_write(hnd->mosq) ? TRUE : FALSE;
+}
+
+int mqtt_next_timeout(struct mqtt_handle * hnd)
+{
+  uint64_t now = mqtt_now_ms();
+  uint64_t due = mqtt_due(hnd);
+
+  if (due == 0 || due > hnd->misc_due)
+    due = hnd->misc_due;
+  return due > now ? (int) (due - now) : 0;
+}
+
+void mqtt_on_readable(struct mqtt_handle * hnd)
+{
+  uint64_t start = stat_now_ns();
+
+  mqtt_result(hnd, mosquitto_loop_read(hnd->mosq, 1));
+  mqtt_stats_loop(hnd, stat_now_ns() - start);
+}
+
+void mqtt_on_writable(struct mqtt_handle * hnd)
+{
+  uint64_t start = stat_now_ns();
+
+  mqtt_result(hnd, mosquitto_loop_write(hnd->mosq, 1));
+  mqtt_stats_loop(hnd, stat_now_ns() - start);
+}
+
+/* keepalive pings are checked every quarter keepalive (every MQTT_RETRY_MS after a failure), reconnects when the backoff is over */
+void mqtt_on_timeout(struct mqtt_handle * hnd)
+{
+  uint64_t start = stat_now_ns();
+  int result;
+
+  mqtt_conn_poll(hnd);
+  mqtt_batch_poll(hnd);
+  mqtt_spool_poll(hnd);
+  mqtt_stats_poll(hnd);
+  if (mqtt_now_ms() >= hnd->misc_due)
+  {
+    result = mqtt_result(hnd, mosquitto_loop_misc(hnd->mosq));
+    hnd->misc_due = mqtt_now_ms() + (result == MOSQ_ERR_SUCCESS ? MQTT_MISC_MS : MQTT_RETRY_MS);
+  }
+  mqtt_stats_loop(hnd, stat_now_ns() - start);
 }
 
 
 void mqtt_close(struct mqtt_handle * hnd)
 {
+  mqtt_stop(hnd);
+  mqtt_flush(hnd);
+  hnd->closing = TRUE;
   mosquitto_disconnect(hnd->mosq);
   mosquitto_destroy(hnd->mosq);
-
+  mqtt_trie_free(hnd->subs);
+  mqtt_batch_free(hnd);
+  mqtt_cache_free(hnd);
+  mqtt_spool_free(hnd);
+  mqtt_stats_free(hnd);
+  mqtt_v5_free(hnd);
+  mqtt_zip_free(hnd);
 }
 
@@ -1,9 +1,15 @@
 #ifndef _H_LINUXTOOLS_CTRL_COM_MQTT
 #define _H_LINUXTOOLS_CTRL_COM_MQTT
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../stathelp.h"
+
 #define LINUXTOOLS_MQTT_KEEPALIVE 10 // in seconds
 
 struct mqtt_handle;
+struct mqtt_pool;
 
 enum mqtt_retval
 {
@@ -12,6 +18,25 @@ enum mqtt_retval
   MQTT_RET_FAILED
 };
 
+enum mqtt_overflow  // threaded mode: worker queue full
+{
+  MQTT_OVF_BLOCK,       // network thread waits up to block_ms for room, then drops the message
+  MQTT_OVF_DROP_NEWEST, // message received is discarded
+  MQTT_OVF_DROP_OLDEST, // oldest queued message is discarded
+
+  MQTT_OVF_COUNT
+};
+
+enum mqtt_state
+{
+  MQTT_STATE_DISCONNECTED,  // not started or closed
+  MQTT_STATE_CONNECTING,    // socket connecting or waiting for the broker's answer
+  MQTT_STATE_CONNECTED,
+  MQTT_STATE_BACKOFF,       // waiting for the next attempt
+
+  MQTT_STATE_COUNT
+};
+
 struct mqtt_sub {
   const char * topic;
   void (*cb)(const char * topic, const char * payload);
@@ -26,8 +51,108 @@ struct mqtt_config
   const char *      topic;
   int               qos;
   struct mqtt_sub * subs;
+
+  // threaded mode (mqtt_start)
+  unsigned int       workers;    // callback threads, 0: callbacks run in the network thread
+  size_t             queue_len;  // messages per worker queue, 0: 256
+  enum mqtt_overflow overflow;
+  unsigned int       block_ms;   // MQTT_OVF_BLOCK, 0: half the keepalive
+
+  // batching of mqtt_publish* lines into one multi-line payload, lines get a ns timestamp
+  size_t             batch_bytes;  // max. payload size, 0: no batching
+  unsigned int       batch_lines;  // flush after that many lines, 0: no limit
+  unsigned int       batch_ms;     // flush when the oldest line is older, 0: 1000
+  int                batch_merge;  // a field for the series of the last line is added to that line
+
+  // change-only publishing of single field lines, per series and field
+  int                change_only;
+  double             deadband_abs;  // numbers: suppressed while |value - last sent| <= deadband_abs
+  double             deadband_pct;  //          or <= deadband_pct % of |last sent|, both 0: any change
+  unsigned int       heartbeat_s;   // unchanged values are sent again after that long, 0: never
+
+  // store-and-forward of publishes while the broker is unreachable, replayed in order
+  const char *       spool_path;   // file surviving restarts, NULL: memory only
+  size_t             spool_bytes;  // spool size, 0: no spooling
+  unsigned int       spool_msgs;   // max. messages spooled, 0: no limit
+  enum mqtt_overflow spool_evict;  // spool full: MQTT_OVF_DROP_OLDEST evicts, else the new message is dropped
+  unsigned int       spool_rate;   // replayed messages per second, 0: 100
+
+  // connection state machine
+  void (*on_state)(enum mqtt_state state, const char * reason);  // reason may be NULL
+  unsigned int       backoff_min_ms;  // first retry after a failure, doubled up to backoff_max_ms, 0: 500
+  unsigned int       backoff_max_ms;  // 0: 60000
+
+  // self-publishing of mqtt_get_stats() as a line protocol line
+  const char *       stats_topic;  // NULL: not published
+  unsigned int       stats_s;      // interval, 0: not published
+
+  // MQTT v5 session
+  int                v5;                // connect with protocol version 5
+  unsigned int       topic_aliases;     // QoS 0 topics published by alias, first come first served, capped by the broker
+  unsigned int       message_expiry_s;  // the broker drops publishes not delivered within, 0: never
+  unsigned int       receive_max;       // QoS 1/2 messages the broker may have unacknowledged with us, 0: 65535
+
+  // deflate of large payloads (built with zlib), received ones are inflated in any case
+  size_t             compress_min;    // payloads from that size on are compressed, 0: none
+  int                compress_level;  // zlib level 1..9, 0: zlib's default
+};
+
+/*
+ * line protocol builder - measurement[,tag=value...] field=value[,...] [ns]
+ * Keys, tag values and strings are escaped as needed. A line either lives in
+ * a per-thread buffer growing as needed (mqtt_line_begin) or in a buffer of
+ * the caller (mqtt_line_init). A line not fitting there is not truncated but
+ * refused by mqtt_line_publish, as is one with a nan or inf double field.
+ */
+struct mqtt_line
+{
+  char *       buf;
+  size_t       len;
+  size_t       cap;
+  size_t       series_len;  // measurement and tags
+  size_t       key_len;     // key of the first field
+  unsigned int fields;
+  uint64_t     ts;          // ns since the epoch, 0: set by the receiver (or the batch)
+  int          grow;        // buf belongs to the builder
+  int          failed;      // did not fit
+};
+
+struct mqtt_queue_stats
+{
+  unsigned long received;    // messages handed to the worker queues
+  unsigned long dispatched;  // messages the workers ran the callbacks for
+  unsigned long dropped;     // messages lost to a full queue
+  unsigned long blocked;     // times the network thread had to wait for room
+  size_t        depth;       // messages queued right now
+  size_t        depth_max;   // deepest worker queue seen
 };
 
+struct mqtt_spool_stats
+{
+  unsigned long spooled;   // messages stored while offline or behind the spool
+  unsigned long replayed;  // messages published from the spool
+  unsigned long evicted;   // spooled messages dropped to make room (or found corrupt)
+  unsigned long rejected;  // messages dropped as the spool was full or they were too large
+  size_t        count;     // messages spooled right now
+  size_t        bytes;     // spool bytes in use
+};
+
+#define MQTT_STATS_ERRORS 32  // publish_error[] slots, the last counts codes beyond
+
+struct mqtt_stats
+{
+  unsigned long    published;        // messages handed to mosquitto, replayed ones included
+  unsigned long    published_bytes;  // payload bytes
+  unsigned long    received;
+  unsigned long    received_bytes;
+  unsigned long    publish_errors;   // failed publishes, spooled ones are not counted
+  unsigned long    publish_error[MQTT_STATS_ERRORS];  // by MOSQ_ERR_* code
+  unsigned long    reconnects;       // connections established after the first one
+  uint64_t         disconnected_ms;  // time not connected since the handle was created
+  unsigned long    suppressed;       // change-only publishing: unchanged values not sent
+  struct stat_hist callback_ns;      // subscription callbacks, per message
+  struct stat_hist loop_ns;          // mqtt_loop iterations (waiting included), event loop entry points
+};
 
 #ifdef __cplusplus
 extern "C"
@@ -36,12 +161,91 @@ extern "C"
 
   enum mqtt_retval mqtt_init(struct mqtt_handle ** hnd, struct mqtt_config * cfg);
 
+  /*
+   * like mqtt_init, but the connection is set up by the loop without blocking
+   * and retried with backoff. Publishes are spooled until it stands - in
+   * memory if cfg->spool_bytes is 0. MQTT_RET_FAILED only on lack of resources.
+   */
+  enum mqtt_retval mqtt_connect_async(struct mqtt_handle ** hnd, struct mqtt_config * cfg);
+  enum mqtt_state  mqtt_get_state(struct mqtt_handle * hnd);
+  const char *     mqtt_get_state_name(enum mqtt_state state);
+
   void mqtt_publish(struct mqtt_handle * hnd, const char * type, const char * entity, int value);
   void mqtt_publish_formatted(struct mqtt_handle * hnd, const char * type, const char * entity, const char * fmt, ...);
+  void mqtt_publish_field(struct mqtt_handle * hnd, const char * type, const char * entity, const char * field, const char * fmt, ...);
   void mqtt_publish_raw(struct mqtt_handle * hnd, const char * topic, const char * payload);
+
+  /*
+   * typed lines, e.g.
+   *   struct mqtt_line * line = mqtt_line_begin("room1");
+   *   mqtt_line_tag(line, "type", "climate");
+   *   mqtt_line_double(line, "temp", 21.53, 1);
+   *   mqtt_line_int(line, "co2", 612);   // integer field: "612i"
+   *   mqtt_line_publish(mqtt, line);
+   * Tags go before the first field. mqtt_line_publish returns TRUE if the line
+   * was sent, batched or - cfg->change_only, single field lines - unchanged.
+   */
+  struct mqtt_line * mqtt_line_begin(const char * measurement);
+  void mqtt_line_init(struct mqtt_line * line, char * buf, size_t size, const char * measurement);
+  void mqtt_line_tag(struct mqtt_line * line, const char * key, const char * value);
+  void mqtt_line_int(struct mqtt_line * line, const char * key, int64_t value);
+  void mqtt_line_double(struct mqtt_line * line, const char * key, double value, unsigned int prec);
+  void mqtt_line_bool(struct mqtt_line * line, const char * key, int value);
+  void mqtt_line_str(struct mqtt_line * line, const char * key, const char * value);
+  void mqtt_line_time(struct mqtt_line * line, uint64_t ns);
+  int  mqtt_line_publish(struct mqtt_handle * hnd, struct mqtt_line * line);
+
+  void mqtt_flush(struct mqtt_handle * hnd);  // publish batched lines now
   void mqtt_loop(struct mqtt_handle * hnd, int timeout);
   void mqtt_close(struct mqtt_handle * hnd);
 
+  /*
+   * threaded mode: a network thread drives the connection, subscription
+   * callbacks run on cfg->workers threads - messages of one topic always on
+   * the same one, in order. Publishing is safe from any thread. Do not call
+   * mqtt_loop while started.
+   */
+  enum mqtt_retval mqtt_start(struct mqtt_handle * hnd);
+  void mqtt_stop(struct mqtt_handle * hnd);
+  void mqtt_get_queue_stats(struct mqtt_handle * hnd, struct mqtt_queue_stats * stats);
+
+  void mqtt_get_spool_stats(struct mqtt_handle * hnd, struct mqtt_spool_stats * stats);
+  void mqtt_get_stats(struct mqtt_handle * hnd, struct mqtt_stats * stats);  // safe from any thread
+
+  /*
+   * publisher pool: sessions connections to the broker, each connected async
+   * and started threaded. Lines are spread by series, raw messages by topic,
+   * per series / topic the order is kept. cfg must outlive the pool.
+   */
+  enum mqtt_retval     mqtt_pool_open(struct mqtt_pool ** pool, struct mqtt_config * cfg, unsigned int sessions);
+  void                 mqtt_pool_close(struct mqtt_pool * pool);
+  unsigned int         mqtt_pool_size(struct mqtt_pool * pool);
+  struct mqtt_handle * mqtt_pool_get_handle(struct mqtt_pool * pool, unsigned int idx);
+  void mqtt_pool_publish(struct mqtt_pool * pool, const char * type, const char * entity, int value);
+  void mqtt_pool_publish_formatted(struct mqtt_pool * pool, const char * type, const char * entity, const char * fmt, ...);
+  void mqtt_pool_publish_field(struct mqtt_pool * pool, const char * type, const char * entity, const char * field, const char * fmt, ...);
+  void mqtt_pool_publish_raw(struct mqtt_pool * pool, const char * topic, const char * payload);
+  int  mqtt_pool_line_publish(struct mqtt_pool * pool, struct mqtt_line * line);
+  void mqtt_pool_flush(struct mqtt_pool * pool);
+
+  /*
+   * event loop integration: watch mqtt_get_fd() for reading - and for writing
+   * while mqtt_wants_write() - and call mqtt_on_timeout() whenever
+   * mqtt_next_timeout() (ms) is 0. The fd is -1 while disconnected and may
+   * change with every reconnect, query it again after each call.
+   */
+  int  mqtt_get_fd(struct mqtt_handle * hnd);
+  int  mqtt_wants_write(struct mqtt_handle * hnd);
+  int  mqtt_next_timeout(struct mqtt_handle * hnd);
+  void mqtt_on_readable(struct mqtt_handle * hnd);
+  void mqtt_on_writable(struct mqtt_handle * hnd);
+  void mqtt_on_timeout(struct mqtt_handle * hnd);
+
+  /* reference driver on epoll - mqtt_epoll_run() runs until *stop is set, e.g. by a signal handler */
+  int  mqtt_epoll_update(struct mqtt_handle * hnd, int epfd);
+  void mqtt_epoll_dispatch(struct mqtt_handle * hnd, uint32_t events);
+  int  mqtt_epoll_run(struct mqtt_handle * hnd, const volatile int * stop);
+
 #ifdef __cplusplus
 }
 #endif
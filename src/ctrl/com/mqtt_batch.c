@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+#include "../../stringhelp.h"
+
+/*
+ * Batching publisher: line-protocol lines are collected into one multi-line
+ * payload for cfg->topic. Every line gets its own ns timestamp - lines of one
+ * series in one payload would otherwise be stamped alike on arrival and
+ * overwrite each other - a line with a timestamp of its own keeps it. The last
+ * line stays open until the next one starts, with batch_merge a single field
+ * for its series is added to it (and shares its timestamp).
+ */
+
+#define MQTT_BATCH_MIN   1024
+#define MQTT_BATCH_MS    1000
+#define MQTT_BATCH_TAIL  23    /* " <ns timestamp>\n" and the NUL of str_u64 */
+
+struct mqtt_batch
+{
+  pthread_mutex_t lock;
+  char *          buf;
+  size_t          len;
+  size_t          cap;
+  unsigned int    lines;
+  uint64_t        due;          /* mqtt_now_ms() deadline of the oldest line, 0: empty */
+  size_t          open_at;      /* offset of the open line */
+  size_t          open_series;  /* series length of the open line, 0: none */
+  uint64_t        open_ts;      /* CLOCK_REALTIME ns of the open line */
+  int             open_stamped; /* open_ts came with the line - nothing is merged into it */
+};
+
+
+int mqtt_batch_init(struct mqtt_handle * hnd)
+{
+  struct mqtt_batch * b;
+
+  if (hnd->cfg->batch_bytes == 0)
+    return TRUE;
+
+  b = calloc(1, sizeof(*b));
+  if (b == NULL)
+    return FALSE;
+  b->cap = hnd->cfg->batch_bytes < MQTT_BATCH_MIN ? MQTT_BATCH_MIN : hnd->cfg->batch_bytes;
+  b->buf = malloc(b->cap);
+  if (b->buf == NULL)
+  {
+    free(b);
+    return FALSE;
+  }
+  pthread_mutex_init(&b->lock, NULL);
+  hnd->batch = b;
+  return TRUE;
+}
+
+void mqtt_batch_free(struct mqtt_handle * hnd)
+{
+  struct mqtt_batch * b = hnd->batch;
+
+  if (b == NULL)
+    return;
+  hnd->batch = NULL;
+  pthread_mutex_destroy(&b->lock);
+  free(b->buf);
+  free(b);
+}
+
+
+static void mqtt_batch_close_line(struct mqtt_batch * b)
+{
+  if (b->open_series == 0)
+    return;
+  b->buf[b->len++] = ' ';
+  b->len += str_u64(b->buf + b->len, b->open_ts);
+  b->buf[b->len++] = '\n';
+  b->open_series = 0;
+}
+
+/* caller holds the lock */
+static void mqtt_batch_flush_locked(struct mqtt_handle * hnd, struct mqtt_batch * b)
+{
+  mqtt_batch_close_line(b);
+  if (b->len)
+  {
+    LG_DEBUG("MQTT - publishing %u batched line(s) in topic %s.", b->lines, hnd->cfg->topic);
+    mqtt_publish_payload(hnd, hnd->cfg->topic, b->buf, b->len - 1);  /* without the last '\n' */
+  }
+  b->len   = 0;
+  b->lines = 0;
+  __atomic_store_n(&b->due, 0, __ATOMIC_RELAXED);
+}
+
+/* fields of the open line, e.g. "value=1,other=2" */
+static int mqtt_batch_has_field(const struct mqtt_batch * b, const char * field, size_t len)
+{
+  const char * p   = b->buf + b->open_at + b->open_series + 1;
+  const char * end = b->buf + b->len;
+
+  while (p < end)
+  {
+    if ((size_t) (end - p) > len && memcmp(p, field, len) == 0 && p[len] == '=')
+      return TRUE;
+    while (p < end && *p != ',')
+      ++p;
+    ++p;
+  }
+  return FALSE;
+}
+
+int mqtt_batch_add(struct mqtt_handle * hnd, const struct mqtt_line * line)
+{
+  struct mqtt_batch * b = hnd->batch;
+  const char * fields = line->buf + line->series_len + 1;
+  size_t fields_len = line->len - line->series_len - 1;
+  struct timespec ts;
+  uint64_t now = mqtt_now_ms();
+
+  if (line->len + MQTT_BATCH_TAIL > b->cap)
+  {
+    LG_ERROR("MQTT - line for %.*s exceeds the batch size of %zu bytes.", (int) line->series_len, line->buf, b->cap);
+    return FALSE;
+  }
+
+  pthread_mutex_lock(&b->lock);
+
+  if (hnd->cfg->batch_merge && line->ts == 0 && line->fields == 1 && b->open_series && !b->open_stamped &&
+      b->open_series == line->series_len && memcmp(b->buf + b->open_at, line->buf, line->series_len) == 0 &&
+      !mqtt_batch_has_field(b, fields, line->key_len) && b->len + 1 + fields_len + MQTT_BATCH_TAIL <= b->cap)
+  {
+    b->buf[b->len++] = ',';
+    memcpy(b->buf + b->len, fields, fields_len);
+    b->len += fields_len;
+    goto batch_add_check;
+  }
+
+  mqtt_batch_close_line(b);
+  if (b->len + line->len + MQTT_BATCH_TAIL > b->cap)
+    mqtt_batch_flush_locked(hnd, b);
+
+  if (b->len == 0)
+    __atomic_store_n(&b->due, now + (hnd->cfg->batch_ms ? hnd->cfg->batch_ms : MQTT_BATCH_MS), __ATOMIC_RELAXED);
+  if (line->ts)
+    b->open_ts = line->ts;
+  else
+  {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    b->open_ts = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+  b->open_stamped = line->ts != 0;
+  b->open_at      = b->len;
+  b->open_series  = line->series_len;
+  memcpy(b->buf + b->len, line->buf, line->len);
+  b->len += line->len;
+  ++b->lines;
+
+batch_add_check:
+  if ((hnd->cfg->batch_lines && b->lines >= hnd->cfg->batch_lines) || now >= b->due)
+    mqtt_batch_flush_locked(hnd, b);
+  pthread_mutex_unlock(&b->lock);
+  return TRUE;
+}
+
+void mqtt_batch_poll(struct mqtt_handle * hnd)
+{
+  struct mqtt_batch * b = hnd->batch;
+  uint64_t due;
+
+  if (b == NULL)
+    return;
+  due = __atomic_load_n(&b->due, __ATOMIC_RELAXED);
+  if (due == 0 || due > mqtt_now_ms())
+    return;
+
+  pthread_mutex_lock(&b->lock);
+  if (b->due && b->due <= mqtt_now_ms())
+    mqtt_batch_flush_locked(hnd, b);
+  pthread_mutex_unlock(&b->lock);
+}
+
+uint64_t mqtt_batch_due(struct mqtt_handle * hnd)
+{
+  return hnd->batch ? __atomic_load_n(&hnd->batch->due, __ATOMIC_RELAXED) : 0;
+}
+
+void mqtt_flush(struct mqtt_handle * hnd)
+{
+  struct mqtt_batch * b = hnd ? hnd->batch : NULL;
+
+  if (b == NULL)
+    return;
+  pthread_mutex_lock(&b->lock);
+  mqtt_batch_flush_locked(hnd, b);
+  pthread_mutex_unlock(&b->lock);
+}
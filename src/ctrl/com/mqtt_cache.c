@@ -0,0 +1,226 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+
+/*
+ * Change-only publishing: the last value sent per series and field - the
+ * head of a single field line, "entity,type=T field" - is kept in an open
+ * addressing table. Numbers are compared against the deadbands, anything
+ * else (strings, booleans) by a hash of its text. An entry is only updated
+ * once the line was handed on successfully - a failed publish must not
+ * suppress the value until the heartbeat.
+ */
+
+#define MQTT_CACHE_LEN  64   /* initial table size */
+
+struct mqtt_cache_entry
+{
+  char *   key;      /* NULL: free slot */
+  size_t   key_len;
+  uint32_t hash;
+  int      numeric;
+  double   value;
+  uint64_t text;     /* hash of a non numeric value */
+  uint64_t sent;     /* mqtt_now_ms() of the last publish */
+};
+
+struct mqtt_cache
+{
+  pthread_mutex_t           lock;
+  struct mqtt_cache_entry * entries;
+  size_t                    size;  /* power of 2 */
+  size_t                    used;
+  unsigned long             suppressed;
+};
+
+
+static uint32_t mqtt_cache_hash(const char * key, size_t len)
+{
+  uint32_t hash = 2166136261u;
+
+  while (len--)
+  {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint64_t mqtt_cache_text(const char * text, size_t len)
+{
+  uint64_t hash = 14695981039346656037ull;
+
+  while (len--)
+  {
+    hash ^= (unsigned char) *text++;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static struct mqtt_cache_entry * mqtt_cache_slot(struct mqtt_cache * c, const char * key, size_t len, uint32_t hash)
+{
+  size_t idx = hash & (c->size - 1);
+
+  while (c->entries[idx].key &&
+         (c->entries[idx].hash != hash || c->entries[idx].key_len != len || memcmp(c->entries[idx].key, key, len) != 0))
+    idx = (idx + 1) & (c->size - 1);
+  return &c->entries[idx];
+}
+
+static int mqtt_cache_grow(struct mqtt_cache * c)
+{
+  struct mqtt_cache old = *c;
+
+  c->entries = calloc(old.size * 2, sizeof(*c->entries));
+  if (c->entries == NULL)
+  {
+    c->entries = old.entries;
+    return FALSE;
+  }
+  c->size = old.size * 2;
+  for (size_t i = 0; i < old.size; i++)
+    if (old.entries[i].key)
+      *mqtt_cache_slot(c, old.entries[i].key, old.entries[i].key_len, old.entries[i].hash) = old.entries[i];
+  free(old.entries);
+  return TRUE;
+}
+
+
+int mqtt_cache_init(struct mqtt_handle * hnd)
+{
+  struct mqtt_cache * c;
+
+  if (!hnd->cfg->change_only)
+    return TRUE;
+
+  c = calloc(1, sizeof(*c));
+  if (c == NULL)
+    return FALSE;
+  c->size    = MQTT_CACHE_LEN;
+  c->entries = calloc(c->size, sizeof(*c->entries));
+  if (c->entries == NULL)
+  {
+    free(c);
+    return FALSE;
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  hnd->cache = c;
+  return TRUE;
+}
+
+void mqtt_cache_free(struct mqtt_handle * hnd)
+{
+  struct mqtt_cache * c = hnd->cache;
+
+  if (c == NULL)
+    return;
+  hnd->cache = NULL;
+  for (size_t i = 0; i < c->size; i++)
+    free(c->entries[i].key);
+  pthread_mutex_destroy(&c->lock);
+  free(c->entries);
+  free(c);
+}
+
+static int mqtt_cache_changed(const struct mqtt_config * cfg, const struct mqtt_cache_entry * e, int numeric, double value, uint64_t text)
+{
+  double diff;
+
+  if (!numeric || !e->numeric)
+    return numeric != e->numeric || text != e->text;
+
+  diff = value > e->value ? value - e->value : e->value - value;
+  if (cfg->deadband_abs <= 0 && cfg->deadband_pct <= 0)
+    return diff != 0;
+  if (cfg->deadband_abs > 0 && diff > cfg->deadband_abs)
+    return TRUE;
+  if (cfg->deadband_pct > 0 && diff > cfg->deadband_pct / 100 * (e->value < 0 ? -e->value : e->value))
+    return TRUE;
+  return FALSE;
+}
+
+int mqtt_cache_pass(struct mqtt_handle * hnd, struct mqtt_line * line, struct mqtt_cache_value * v)
+{
+  struct mqtt_cache * c = hnd->cache;
+  struct mqtt_cache_entry * e;
+  const char * key  = line->buf;
+  size_t key_len    = line->series_len + 1 + line->key_len;
+  const char * text = line->buf + key_len + 1;
+  size_t text_len   = line->len - key_len - 1;
+  char * end;
+  int pass = TRUE;
+
+  /* the builder keeps room for a '\0', integers end with 'i' */
+  line->buf[line->len] = '\0';
+  v->hash    = mqtt_cache_hash(key, key_len);
+  v->now     = mqtt_now_ms();
+  v->value   = strtod(text, &end);
+  v->numeric = end != text && (end == line->buf + line->len || (*end == 'i' && end + 1 == line->buf + line->len));
+  v->text    = v->numeric ? 0 : mqtt_cache_text(text, text_len);
+
+  pthread_mutex_lock(&c->lock);
+  e = mqtt_cache_slot(c, key, key_len, v->hash);
+  if (e->key)
+  {
+    pass = mqtt_cache_changed(hnd->cfg, e, v->numeric, v->value, v->text) ||
+           (hnd->cfg->heartbeat_s && v->now - e->sent >= (uint64_t) hnd->cfg->heartbeat_s * 1000);
+  }
+  if (!pass)
+    ++c->suppressed;
+  pthread_mutex_unlock(&c->lock);
+  return pass;
+}
+
+void mqtt_cache_sent(struct mqtt_handle * hnd, const struct mqtt_line * line, const struct mqtt_cache_value * v)
+{
+  struct mqtt_cache * c = hnd->cache;
+  struct mqtt_cache_entry * e;
+  const char * key = line->buf;
+  size_t key_len   = line->series_len + 1 + line->key_len;
+
+  pthread_mutex_lock(&c->lock);
+  e = mqtt_cache_slot(c, key, key_len, v->hash);
+  if (e->key == NULL && (c->used + 1) * 2 > c->size && mqtt_cache_grow(c))
+    e = mqtt_cache_slot(c, key, key_len, v->hash);
+
+  /* not cached (out of memory): published every time */
+  if (e->key == NULL && (c->used + 1) * 2 <= c->size)
+  {
+    e->key = malloc(key_len);
+    if (e->key)
+    {
+      memcpy(e->key, key, key_len);
+      e->key_len = key_len;
+      e->hash    = v->hash;
+      ++c->used;
+    }
+  }
+  if (e->key)
+  {
+    e->numeric = v->numeric;
+    e->value   = v->value;
+    e->text    = v->text;
+    e->sent    = v->now;
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+unsigned long mqtt_cache_suppressed(struct mqtt_handle * hnd)
+{
+  unsigned long count;
+
+  if (hnd->cache == NULL)
+    return 0;
+  pthread_mutex_lock(&hnd->cache->lock);
+  count = hnd->cache->suppressed;
+  pthread_mutex_unlock(&hnd->cache->lock);
+  return count;
+}
@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <mosquitto.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+
+/*
+ * Connection state machine. Connects and reconnects never block on the
+ * socket: mosquitto_(re)connect_async starts them, the loop - or the event
+ * loop entry points - complete them, on_connect reports the broker's answer.
+ * A failed attempt or a lost connection waits a jittered, exponentially
+ * growing backoff before the next one:
+ *
+ *   CONNECTING -> CONNECTED,  CONNECTING/CONNECTED -> BACKOFF -> CONNECTING
+ *
+ * Only the thread driving the loop (or the network thread) changes states.
+ * Resolving a host name is still done by mosquitto and may block - configure
+ * an address where that matters.
+ */
+
+#define MQTT_BACKOFF_MIN_MS  500
+#define MQTT_BACKOFF_MAX_MS  60000
+#define MQTT_CONNECT_MS      (LINUXTOOLS_MQTT_KEEPALIVE * 1000)  /* broker has to answer within */
+
+static const char * mqtt_state_names[MQTT_STATE_COUNT] = {
+  "disconnected",
+  "connecting",
+  "connected",
+  "backoff"
+};
+
+
+const char * mqtt_get_state_name(enum mqtt_state state)
+{
+  return state < MQTT_STATE_COUNT ? mqtt_state_names[state] : NULL;
+}
+
+enum mqtt_state mqtt_get_state(struct mqtt_handle * hnd)
+{
+  return (enum mqtt_state) __atomic_load_n(&hnd->state, __ATOMIC_RELAXED);
+}
+
+static void mqtt_conn_state(struct mqtt_handle * hnd, enum mqtt_state state, const char * reason)
+{
+  if (mqtt_get_state(hnd) == state)
+    return;
+  __atomic_store_n(&hnd->state, state, __ATOMIC_RELAXED);
+  mqtt_stats_connected(hnd, state == MQTT_STATE_CONNECTED);
+  LG_DEBUG("MQTT - %s (%s).", mqtt_state_names[state], reason ? reason : "-");
+  if (hnd->cfg->on_state)
+    hnd->cfg->on_state(state, reason);
+}
+
+/* xorshift32 - jitter only */
+static uint32_t mqtt_conn_rand(struct mqtt_handle * hnd)
+{
+  uint32_t x = hnd->rnd;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  hnd->rnd = x;
+  return x;
+}
+
+void mqtt_conn_init(struct mqtt_handle * hnd)
+{
+  hnd->rnd   = (uint32_t) (mqtt_now_ms() ^ ((uintptr_t) hnd >> 4)) | 1;
+  hnd->state = MQTT_STATE_DISCONNECTED;
+}
+
+int mqtt_conn_start(struct mqtt_handle * hnd)
+{
+  int result;
+
+  if (hnd->conn_started)
+    result = mosquitto_reconnect_async(hnd->mosq);
+  else
+    result = mosquitto_connect_async(hnd->mosq, hnd->cfg->remote_address, hnd->cfg->remote_port, LINUXTOOLS_MQTT_KEEPALIVE);
+
+  if (result != MOSQ_ERR_SUCCESS)
+  {
+    mqtt_conn_down(hnd, result == MOSQ_ERR_ERRNO ? strerror(errno) : mosquitto_strerror(result));
+    return result;
+  }
+  mqtt_conn_connecting(hnd);
+  return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt_conn_connecting(struct mqtt_handle * hnd)
+{
+  /* a new socket - the old one left the epoll set with its close, the number may come again */
+  ++hnd->conn_gen;
+  hnd->conn_started = TRUE;
+  hnd->conn_due     = mqtt_now_ms() + MQTT_CONNECT_MS;
+  if (mqtt_get_state(hnd) != MQTT_STATE_CONNECTED)  /* the answer may be in already */
+    mqtt_conn_state(hnd, MQTT_STATE_CONNECTING, NULL);
+}
+
+void mqtt_conn_up(struct mqtt_handle * hnd)
+{
+  hnd->backoff_ms = 0;
+  hnd->misc_due   = mqtt_now_ms() + MQTT_MISC_MS;
+  mqtt_conn_state(hnd, MQTT_STATE_CONNECTED, NULL);
+}
+
+void mqtt_conn_down(struct mqtt_handle * hnd, const char * reason)
+{
+  unsigned int min = hnd->cfg->backoff_min_ms ? hnd->cfg->backoff_min_ms : MQTT_BACKOFF_MIN_MS;
+  unsigned int max = hnd->cfg->backoff_max_ms ? hnd->cfg->backoff_max_ms : MQTT_BACKOFF_MAX_MS;
+  unsigned int delay;
+
+  if (hnd->closing)
+  {
+    mqtt_conn_state(hnd, MQTT_STATE_DISCONNECTED, reason);
+    return;
+  }
+  if (mqtt_get_state(hnd) == MQTT_STATE_BACKOFF)
+    return;
+
+  /* half of the backoff fixed, half random - clients of a broker coming back do not all knock at once */
+  hnd->backoff_ms = hnd->backoff_ms ? hnd->backoff_ms * 2 : min;
+  if (hnd->backoff_ms > max)
+    hnd->backoff_ms = max;
+  delay = hnd->backoff_ms / 2 + mqtt_conn_rand(hnd) % (hnd->backoff_ms / 2 + 1);
+  hnd->conn_due = mqtt_now_ms() + delay;
+  LG_WARN_RL("MQTT - connection to broker down (%s), next attempt in %u ms.", reason ? reason : "-", delay);
+  mqtt_conn_state(hnd, MQTT_STATE_BACKOFF, reason);
+}
+
+void mqtt_conn_poll(struct mqtt_handle * hnd)
+{
+  enum mqtt_state state = mqtt_get_state(hnd);
+
+  if ((state != MQTT_STATE_BACKOFF && state != MQTT_STATE_CONNECTING) || mqtt_now_ms() < hnd->conn_due)
+    return;
+  if (state == MQTT_STATE_CONNECTING)
+    mqtt_conn_down(hnd, "no answer from broker");
+  else
+    mqtt_conn_start(hnd);
+}
+
+uint64_t mqtt_conn_due(struct mqtt_handle * hnd)
+{
+  enum mqtt_state state = mqtt_get_state(hnd);
+
+  return state == MQTT_STATE_BACKOFF || state == MQTT_STATE_CONNECTING ? hnd->conn_due : 0;
+}
+
+/* loop while there is no socket: wait for whatever comes first */
+void mqtt_conn_wait(uint64_t due, int timeout)
+{
+  uint64_t now = mqtt_now_ms();
+  uint64_t until = now + (timeout < 0 ? MQTT_RETRY_MS : (uint64_t) timeout);
+  struct timespec ts;
+
+  if (due && due < until)
+    until = due;
+  if (until <= now)
+    return;
+  ts.tv_sec  = (time_t) ((until - now) / 1000);
+  ts.tv_nsec = (long) ((until - now) % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+}
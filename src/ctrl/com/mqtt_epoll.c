@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+
+/*
+ * Reference driver for the event loop entry points. mqtt_epoll_update and
+ * mqtt_epoll_dispatch plug the handle into an epoll set owned by the caller
+ * (data.ptr is the handle), mqtt_epoll_run is a complete single threaded loop.
+ */
+
+int mqtt_epoll_update(struct mqtt_handle * hnd, int epfd)
+{
+  struct epoll_event ev;
+  int fd = mqtt_get_fd(hnd);
+  uint32_t mask = EPOLLIN | (mqtt_wants_write(hnd) ? EPOLLOUT : 0);
+  int op;
+
+  if (fd == hnd->ev_fd && mask == hnd->ev_mask && hnd->conn_gen == hnd->ev_gen)
+    return TRUE;
+
+  /* a closed socket left the set on its own, a new one may have the same number */
+  if (hnd->ev_fd >= 0 && (fd != hnd->ev_fd || hnd->conn_gen != hnd->ev_gen))
+    epoll_ctl(epfd, EPOLL_CTL_DEL, hnd->ev_fd, NULL);
+  op = fd == hnd->ev_fd && hnd->conn_gen == hnd->ev_gen ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  hnd->ev_fd = -1;
+  if (fd < 0)
+    return TRUE;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events   = mask;
+  ev.data.ptr = hnd;
+  if (epoll_ctl(epfd, op, fd, &ev) != 0 && (errno != ENOENT || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0))
+  {
+    LG_ERROR("MQTT - Could not watch socket %d: %s", fd, strerror(errno));
+    return FALSE;
+  }
+  hnd->ev_fd   = fd;
+  hnd->ev_mask = mask;
+  hnd->ev_gen  = hnd->conn_gen;
+  return TRUE;
+}
+
+void mqtt_epoll_dispatch(struct mqtt_handle * hnd, uint32_t events)
+{
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    mqtt_on_readable(hnd);
+  if ((events & EPOLLOUT) && mqtt_get_fd(hnd) >= 0)
+    mqtt_on_writable(hnd);
+}
+
+int mqtt_epoll_run(struct mqtt_handle * hnd, const volatile int * stop)
+{
+  struct epoll_event ev;
+  int epfd, n;
+  int result = TRUE;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0)
+  {
+    LG_CRITICAL("MQTT - Could not create epoll instance: %s", strerror(errno));
+    return FALSE;
+  }
+  hnd->ev_fd = -1;
+
+  while (!*stop)
+  {
+    if (mqtt_next_timeout(hnd) == 0)
+      mqtt_on_timeout(hnd);
+    if (!mqtt_epoll_update(hnd, epfd))
+    {
+      result = FALSE;
+      break;
+    }
+
+    n = epoll_wait(epfd, &ev, 1, mqtt_next_timeout(hnd));
+    if (n < 0 && errno != EINTR)
+    {
+      LG_CRITICAL("MQTT - epoll_wait failed: %s", strerror(errno));
+      result = FALSE;
+      break;
+    }
+    if (n > 0)
+      mqtt_epoll_dispatch(ev.data.ptr, ev.events);
+  }
+
+  close(epfd);
+  hnd->ev_fd = -1;
+  return result;
+}
@@ -0,0 +1,280 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+#include "../../stringhelp.h"
+
+/*
+ * Line protocol builder. Numbers are formatted by stringhelp instead of
+ * printf, the line is published with its length - no extra pass over it.
+ */
+
+#define MQTT_LINE_LEN  256   /* initial size of the per thread buffer */
+
+#define MQTT_ESC_MEASUREMENT ", "
+#define MQTT_ESC_KEY         ",= "
+#define MQTT_ESC_STRING      "\"\\"
+
+static __thread struct mqtt_line mqtt_line_tls;
+static pthread_key_t             mqtt_line_tls_key;
+static pthread_once_t            mqtt_line_once = PTHREAD_ONCE_INIT;
+
+
+static void mqtt_line_tls_free(void * buf)
+{
+  free(buf);
+}
+
+static void mqtt_line_tls_init(void)
+{
+  pthread_key_create(&mqtt_line_tls_key, mqtt_line_tls_free);
+}
+
+/* room for len more bytes and a '\0' */
+static int mqtt_line_reserve(struct mqtt_line * line, size_t len)
+{
+  size_t cap;
+  char * buf;
+
+  if (line->failed)
+    return FALSE;
+  if (line->len + len < line->cap)
+    return TRUE;
+
+  if (line->grow)
+  {
+    for (cap = line->cap ? line->cap : MQTT_LINE_LEN; cap <= line->len + len; cap *= 2)
+      ;
+    buf = realloc(line->buf, cap);
+    if (buf)
+    {
+      if (line == &mqtt_line_tls)
+        pthread_setspecific(mqtt_line_tls_key, buf);
+      line->buf = buf;
+      line->cap = cap;
+      return TRUE;
+    }
+  }
+  line->failed = TRUE;
+  return FALSE;
+}
+
+static void mqtt_line_put(struct mqtt_line * line, const char * str, size_t len)
+{
+  if (!mqtt_line_reserve(line, len))
+    return;
+  memcpy(line->buf + line->len, str, len);
+  line->len += len;
+}
+
+static void mqtt_line_put_esc(struct mqtt_line * line, const char * str, const char * special)
+{
+  const char * run;
+
+  while (*str)
+  {
+    for (run = str; *str && strchr(special, *str) == NULL; ++str)
+      ;
+    mqtt_line_put(line, run, (size_t) (str - run));
+    if (*str)
+    {
+      mqtt_line_put(line, "\\", 1);
+      mqtt_line_put(line, str++, 1);
+    }
+  }
+}
+
+/* "," or " " and the escaped key, with '=' */
+static void mqtt_line_key(struct mqtt_line * line, const char * key)
+{
+  size_t start;
+
+  if (line->fields++ == 0)
+  {
+    line->series_len = line->len;
+    mqtt_line_put(line, " ", 1);
+    start = line->len;
+    mqtt_line_put_esc(line, key, MQTT_ESC_KEY);
+    line->key_len = line->len - start;
+  }
+  else
+  {
+    mqtt_line_put(line, ",", 1);
+    mqtt_line_put_esc(line, key, MQTT_ESC_KEY);
+  }
+  mqtt_line_put(line, "=", 1);
+}
+
+static void mqtt_line_start(struct mqtt_line * line, const char * measurement)
+{
+  line->len        = 0;
+  line->series_len = 0;
+  line->key_len    = 0;
+  line->fields     = 0;
+  line->ts         = 0;
+  line->failed     = FALSE;
+  mqtt_line_put_esc(line, measurement, MQTT_ESC_MEASUREMENT);
+}
+
+struct mqtt_line * mqtt_line_begin(const char * measurement)
+{
+  struct mqtt_line * line = &mqtt_line_tls;
+
+  if (!line->grow)
+  {
+    pthread_once(&mqtt_line_once, mqtt_line_tls_init);
+    line->grow = TRUE;
+  }
+  mqtt_line_start(line, measurement);
+  return line;
+}
+
+void mqtt_line_init(struct mqtt_line * line, char * buf, size_t size, const char * measurement)
+{
+  line->buf  = buf;
+  line->cap  = size;
+  line->grow = FALSE;
+  mqtt_line_start(line, measurement);
+}
+
+void mqtt_line_tag(struct mqtt_line * line, const char * key, const char * value)
+{
+  if (line->fields)
+  {
+    LG_ERROR("MQTT - tag %s added after the fields of a line.", key);
+    line->failed = TRUE;
+    return;
+  }
+  mqtt_line_put(line, ",", 1);
+  mqtt_line_put_esc(line, key, MQTT_ESC_KEY);
+  mqtt_line_put(line, "=", 1);
+  mqtt_line_put_esc(line, value, MQTT_ESC_KEY);
+}
+
+void mqtt_line_int(struct mqtt_line * line, const char * key, int64_t value)
+{
+  char num[STR_NUM_LEN];
+  size_t len = str_i64(num, value);
+
+  num[len++] = 'i';
+  mqtt_line_key(line, key);
+  mqtt_line_put(line, num, len);
+}
+
+void mqtt_line_double(struct mqtt_line * line, const char * key, double value, unsigned int prec)
+{
+  char num[STR_NUM_LEN];
+
+  /* nan and inf are no line protocol floats - the receiver would drop the whole payload */
+  if (!isfinite(value))
+  {
+    LG_ERROR("MQTT - field %s of a line is not a finite number.", key);
+    line->failed = TRUE;
+    return;
+  }
+  mqtt_line_key(line, key);
+  mqtt_line_put(line, num, str_fixed(num, value, prec));
+}
+
+void mqtt_line_bool(struct mqtt_line * line, const char * key, int value)
+{
+  mqtt_line_key(line, key);
+  mqtt_line_put(line, value ? "t" : "f", 1);
+}
+
+void mqtt_line_str(struct mqtt_line * line, const char * key, const char * value)
+{
+  mqtt_line_key(line, key);
+  mqtt_line_put(line, "\"", 1);
+  mqtt_line_put_esc(line, value, MQTT_ESC_STRING);
+  mqtt_line_put(line, "\"", 1);
+}
+
+void mqtt_line_time(struct mqtt_line * line, uint64_t ns)
+{
+  line->ts = ns;
+}
+
+void mqtt_line_field_raw(struct mqtt_line * line, const char * key, const char * value, size_t len)
+{
+  mqtt_line_key(line, key);
+  mqtt_line_put(line, value, len);
+}
+
+void mqtt_line_field_v(struct mqtt_line * line, const char * key, const char * fmt, va_list ap)
+{
+  va_list cp;
+  int len;
+
+  mqtt_line_key(line, key);
+  if (!mqtt_line_reserve(line, 0))
+    return;
+  va_copy(cp, ap);
+  len = vsnprintf(line->buf + line->len, line->cap - line->len, fmt, cp);
+  va_end(cp);
+  if (len < 0)
+  {
+    line->failed = TRUE;
+    return;
+  }
+  if ((size_t) len >= line->cap - line->len)
+  {
+    if (!mqtt_line_reserve(line, (size_t) len))
+      return;
+    vsnprintf(line->buf + line->len, line->cap - line->len, fmt, ap);
+  }
+  line->len += (size_t) len;
+}
+
+int mqtt_line_publish(struct mqtt_handle * hnd, struct mqtt_line * line)
+{
+  struct mqtt_cache_value value;
+  int cached;
+  int result;
+
+  if (line->failed || line->fields == 0)
+  {
+    LG_ERROR("MQTT - line for %.*s not published - %s.", (int) (line->series_len ? line->series_len : line->len),
+             line->buf ? line->buf : "", line->failed ? "it is malformed or exceeds its buffer" : "it has no fields");
+    return FALSE;
+  }
+
+  cached = hnd->cache && line->fields == 1;
+  if (cached && !mqtt_cache_pass(hnd, line, &value))
+    return TRUE;
+
+  if (hnd->batch)
+    result = mqtt_batch_add(hnd, line);
+  else
+  {
+    if (line->ts)
+    {
+      char num[STR_NUM_LEN];
+
+      mqtt_line_put(line, " ", 1);
+      mqtt_line_put(line, num, str_u64(num, line->ts));
+      line->ts = 0;
+    }
+    if (line->failed)
+    {
+      LG_ERROR("MQTT - line for %.*s not published - it exceeds its buffer.", (int) line->series_len, line->buf);
+      return FALSE;
+    }
+
+    LG_DEBUG("MQTT - publishing in topic %s: %.*s.", hnd->cfg->topic, (int) line->len, line->buf);
+    result = mqtt_publish_payload(hnd, hnd->cfg->topic, line->buf, line->len) == MOSQ_ERR_SUCCESS;
+  }
+
+  /* cached once handed on - after a failed publish the same value passes again */
+  if (result && cached)
+    mqtt_cache_sent(hnd, line, &value);
+  return result;
+}
@@ -0,0 +1,185 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+#include "../../stringhelp.h"
+
+/*
+ * Pooled publisher: N sessions to the same broker, client ids "<id>-<n>",
+ * each a threaded handle with its own network thread. A line goes to the
+ * session picked by a hash of its series (measurement and tags), a raw
+ * message by a hash of its topic - one series or topic always uses the same
+ * session and keeps its order. Subscriptions are made by session 0 only.
+ */
+
+#define MQTT_POOL_ID_LEN 24   /* room for "-<n>" */
+
+struct mqtt_pool_session
+{
+  struct mqtt_config   cfg;
+  struct mqtt_handle * hnd;
+  char *               client_id;
+  char *               spool_path;
+};
+
+struct mqtt_pool
+{
+  unsigned int               count;
+  struct mqtt_pool_session * sessions;
+};
+
+
+static uint32_t mqtt_pool_hash(const char * key, size_t len)
+{
+  uint32_t hash = 2166136261u;
+
+  while (len--)
+  {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static struct mqtt_handle * mqtt_pool_pick(struct mqtt_pool * pool, const char * key, size_t len)
+{
+  return pool->sessions[pool->count > 1 ? mqtt_pool_hash(key, len) % pool->count : 0].hnd;
+}
+
+static char * mqtt_pool_name(const char * base, unsigned int idx)
+{
+  size_t len = strlen(base) + MQTT_POOL_ID_LEN;
+  char * name = malloc(len);
+
+  if (name)
+    snprintf(name, len, "%s-%u", base, idx);
+  return name;
+}
+
+
+enum mqtt_retval mqtt_pool_open(struct mqtt_pool ** pool, struct mqtt_config * cfg, unsigned int sessions)
+{
+  struct mqtt_pool * p;
+
+  *pool = NULL;
+  p = calloc(1, sizeof(*p));
+  if (p == NULL || (p->sessions = calloc(sessions ? sessions : 1, sizeof(*p->sessions))) == NULL)
+    goto open_pool_fail;
+  p->count = sessions ? sessions : 1;
+
+  for (unsigned int i = 0; i < p->count; i++)
+  {
+    struct mqtt_pool_session * s = &p->sessions[i];
+
+    s->cfg       = *cfg;
+    s->client_id = mqtt_pool_name(cfg->client_id, i);
+    if (s->client_id == NULL)
+      goto open_pool_fail;
+    s->cfg.client_id = s->client_id;
+    if (cfg->spool_path)
+    {
+      s->spool_path = mqtt_pool_name(cfg->spool_path, i);
+      if (s->spool_path == NULL)
+        goto open_pool_fail;
+      s->cfg.spool_path = s->spool_path;
+    }
+    if (i > 0)
+      s->cfg.subs = NULL;
+
+    if (mqtt_connect_async(&s->hnd, &s->cfg) != MQTT_RET_OK || mqtt_start(s->hnd) != MQTT_RET_OK)
+      goto open_pool_fail;
+  }
+  LG_INFO("MQTT - publisher pool of %u session(s) started.", p->count);
+  *pool = p;
+  return MQTT_RET_OK;
+
+open_pool_fail:
+  LG_CRITICAL("Could not set up the MQTT publisher pool!");
+  mqtt_pool_close(p);
+  return MQTT_RET_FAILED;
+}
+
+void mqtt_pool_close(struct mqtt_pool * pool)
+{
+  if (pool == NULL)
+    return;
+  for (unsigned int i = 0; pool->sessions && i < pool->count; i++)
+  {
+    if (pool->sessions[i].hnd)
+      mqtt_close(pool->sessions[i].hnd);
+    free(pool->sessions[i].client_id);
+    free(pool->sessions[i].spool_path);
+  }
+  free(pool->sessions);
+  free(pool);
+}
+
+unsigned int mqtt_pool_size(struct mqtt_pool * pool)
+{
+  return pool->count;
+}
+
+struct mqtt_handle * mqtt_pool_get_handle(struct mqtt_pool * pool, unsigned int idx)
+{
+  return idx < pool->count ? pool->sessions[idx].hnd : NULL;
+}
+
+
+int mqtt_pool_line_publish(struct mqtt_pool * pool, struct mqtt_line * line)
+{
+  size_t len = line->fields ? line->series_len : line->len;
+
+  return mqtt_line_publish(mqtt_pool_pick(pool, line->buf ? line->buf : "", len), line);
+}
+
+void mqtt_pool_publish(struct mqtt_pool * pool, const char * type, const char * entity, int value)
+{
+  struct mqtt_line * line = mqtt_line_begin(entity);
+  char num[STR_NUM_LEN];
+
+  mqtt_line_tag(line, "type", type);
+  mqtt_line_field_raw(line, "value", num, str_i64(num, value));  /* as mqtt_publish */
+  mqtt_pool_line_publish(pool, line);
+}
+
+static void mqtt_pool_publish_field_v(struct mqtt_pool * pool, const char * type, const char * entity, const char * field, const char * fmt, va_list ap)
+{
+  struct mqtt_line * line = mqtt_line_begin(entity);
+
+  mqtt_line_tag(line, "type", type);
+  mqtt_line_field_v(line, field, fmt, ap);
+  mqtt_pool_line_publish(pool, line);
+}
+
+void mqtt_pool_publish_formatted(struct mqtt_pool * pool, const char * type, const char * entity, const char * fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  mqtt_pool_publish_field_v(pool, type, entity, "value", fmt, ap);
+  va_end(ap);
+}
+
+void mqtt_pool_publish_field(struct mqtt_pool * pool, const char * type, const char * entity, const char * field, const char * fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  mqtt_pool_publish_field_v(pool, type, entity, field, fmt, ap);
+  va_end(ap);
+}
+
+void mqtt_pool_publish_raw(struct mqtt_pool * pool, const char * topic, const char * payload)
+{
+  mqtt_publish_raw(mqtt_pool_pick(pool, topic, strlen(topic)), topic, payload);
+}
+
+void mqtt_pool_flush(struct mqtt_pool * pool)
+{
+  for (unsigned int i = 0; i < pool->count; i++)
+    mqtt_flush(pool->sessions[i].hnd);
+}
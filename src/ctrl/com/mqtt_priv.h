@@ -0,0 +1,128 @@
+#ifndef _H_LINUXTOOLS_CTRL_COM_MQTT_PRIV
+#define _H_LINUXTOOLS_CTRL_COM_MQTT_PRIV
+
+/* mqtt internals shared between the mqtt translation units - not part of the API */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <mosquitto.h>
+
+#include "mqtt.h"
+#include "../logger.h"
+
+#define MQTT_MISC_MS   (LINUXTOOLS_MQTT_KEEPALIVE * 250)  /* keepalive check interval in event loop mode */
+#define MQTT_RETRY_MS  1000                              /* pause after a failed loop or reconnect */
+#define MQTT_SPOOL_DEFAULT (256 * 1024)                  /* mqtt_connect_async without cfg->spool_bytes */
+#define MQTT_REASON_LEN    128                           /* reason code text and reason string */
+#define MQTT_REASON_ERROR  0x80                          /* v5 reason codes from here on are failures */
+
+struct mqtt_trie;
+struct mqtt_threads;
+struct mqtt_batch;
+struct mqtt_cache;
+struct mqtt_spool;
+struct mqtt_meter;
+struct mqtt_v5;
+struct mqtt_zip;
+
+struct mqtt_handle
+{
+  struct mosquitto *    mosq;
+  struct mqtt_config *  cfg;
+  struct mqtt_trie *    subs;
+  struct mqtt_threads * threads;   /* threaded mode */
+  struct mqtt_batch *   batch;     /* batching publisher */
+  struct mqtt_cache *   cache;     /* change-only publishing */
+  struct mqtt_spool *   spool;     /* store-and-forward */
+  struct mqtt_meter *   meter;     /* counters and histograms */
+  struct mqtt_v5 *      v5;        /* MQTT v5 session, topic aliases */
+  struct mqtt_zip *     zip;       /* payload compression */
+  int                   state;     /* enum mqtt_state, read with __atomic */
+  int                   closing;
+  int                   conn_started;  /* connect done once, reconnect from now on */
+  uint64_t              conn_due;  /* BACKOFF: next attempt, CONNECTING: give up, mqtt_now_ms() */
+  unsigned int          backoff_ms;
+  uint32_t              rnd;
+  unsigned int          conn_gen;  /* bumped on every connect attempt, the socket is a new one */
+  uint64_t              misc_due;  /* event loop mode: next mqtt_on_timeout, CLOCK_MONOTONIC ms */
+  int                   ev_fd;     /* event loop mode: fd registered with the driver */
+  uint32_t              ev_mask;
+  unsigned int          ev_gen;
+};
+
+/* change-only publishing: a value checked by mqtt_cache_pass, cached by mqtt_cache_sent */
+struct mqtt_cache_value
+{
+  uint32_t hash;
+  int      numeric;
+  double   value;
+  uint64_t text;
+  uint64_t now;
+};
+
+extern struct log_channel log_ch_mqtt;
+
+uint64_t mqtt_now_ms(void);  /* CLOCK_MONOTONIC */
+
+void     mqtt_conn_init(struct mqtt_handle * hnd);
+int      mqtt_conn_start(struct mqtt_handle * hnd);   /* non-blocking (re)connect, mosquitto result */
+void     mqtt_conn_connecting(struct mqtt_handle * hnd);  /* connect sent, waiting for the broker */
+void     mqtt_conn_up(struct mqtt_handle * hnd);
+void     mqtt_conn_down(struct mqtt_handle * hnd, const char * reason);  /* failed or lost: backoff */
+void     mqtt_conn_poll(struct mqtt_handle * hnd);    /* next attempt or connect timeout when due */
+uint64_t mqtt_conn_due(struct mqtt_handle * hnd);
+void     mqtt_conn_wait(uint64_t due, int timeout);  /* no socket to wait on: sleep until due or timeout */
+
+int  mqtt_loop_once(struct mqtt_handle * hnd, int timeout);  /* mosquitto result */
+int  mqtt_send(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len);  /* mosquitto result */
+int  mqtt_publish_payload(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len);
+int  mqtt_publish_plain(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len);  /* no compression */
+void mqtt_dispatch(struct mqtt_handle * hnd, const char * topic, const char * payload);
+
+void mqtt_line_field_raw(struct mqtt_line * line, const char * key, const char * value, size_t len);
+void mqtt_line_field_v(struct mqtt_line * line, const char * key, const char * fmt, va_list ap);
+
+int      mqtt_batch_init(struct mqtt_handle * hnd);
+void     mqtt_batch_free(struct mqtt_handle * hnd);
+int      mqtt_batch_add(struct mqtt_handle * hnd, const struct mqtt_line * line);
+void     mqtt_batch_poll(struct mqtt_handle * hnd);  /* flush when due */
+uint64_t mqtt_batch_due(struct mqtt_handle * hnd);   /* mqtt_now_ms() deadline, 0: nothing pending */
+
+int           mqtt_cache_init(struct mqtt_handle * hnd);
+void          mqtt_cache_free(struct mqtt_handle * hnd);
+int           mqtt_cache_pass(struct mqtt_handle * hnd, struct mqtt_line * line, struct mqtt_cache_value * v);  /* FALSE: unchanged, not to be sent */
+void          mqtt_cache_sent(struct mqtt_handle * hnd, const struct mqtt_line * line, const struct mqtt_cache_value * v);
+unsigned long mqtt_cache_suppressed(struct mqtt_handle * hnd);
+
+int      mqtt_spool_init(struct mqtt_handle * hnd, size_t bytes);
+void     mqtt_spool_free(struct mqtt_handle * hnd);
+int      mqtt_spool_pending(struct mqtt_handle * hnd);  /* TRUE: publishes have to queue up behind the spool */
+void     mqtt_spool_add(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len);
+void     mqtt_spool_poll(struct mqtt_handle * hnd);     /* replay when due */
+uint64_t mqtt_spool_due(struct mqtt_handle * hnd);      /* mqtt_now_ms() of the next replay, 0: nothing to do */
+
+int      mqtt_stats_init(struct mqtt_handle * hnd);
+void     mqtt_stats_free(struct mqtt_handle * hnd);
+void     mqtt_stats_published(struct mqtt_handle * hnd, size_t len, int result);  /* mosquitto_publish result */
+void     mqtt_stats_received(struct mqtt_handle * hnd, size_t len);
+void     mqtt_stats_callback(struct mqtt_handle * hnd, uint64_t ns);
+void     mqtt_stats_loop(struct mqtt_handle * hnd, uint64_t ns);
+void     mqtt_stats_connected(struct mqtt_handle * hnd, int up);
+void     mqtt_stats_poll(struct mqtt_handle * hnd);  /* self-publish when due */
+uint64_t mqtt_stats_due(struct mqtt_handle * hnd);
+
+int          mqtt_v5_init(struct mqtt_handle * hnd);  /* after mosquitto_new, before the connect */
+void         mqtt_v5_free(struct mqtt_handle * hnd);
+void         mqtt_v5_connected(struct mqtt_handle * hnd, const mosquitto_property * props);
+int          mqtt_v5_publish(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len);
+const char * mqtt_v5_reason(const char * text, const mosquitto_property * props, char * buf, size_t size);
+
+int  mqtt_zip_init(struct mqtt_handle * hnd);
+void mqtt_zip_free(struct mqtt_handle * hnd);
+int  mqtt_zip_publish(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len);  /* mosquitto result */
+int  mqtt_zip_packed(const struct mosquitto_message * msg);  /* TRUE: compressed payload */
+int  mqtt_zip_unpack(struct mqtt_handle * hnd, const struct mosquitto_message * msg, struct mosquitto_message * plain);  /* FALSE: drop it */
+
+int  mqtt_threads_push(struct mqtt_handle * hnd, const struct mosquitto_message * msg);  /* FALSE: not queued */
+
+#endif // _H_LINUXTOOLS_CTRL_COM_MQTT_PRIV
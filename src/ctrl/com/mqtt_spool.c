@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+
+/*
+ * Store-and-forward: publishes failing for want of a connection - and all
+ * publishes after them until the spool has drained - are appended to a ring
+ * in a shared file mapping and replayed in order, spool_rate per second, once
+ * the broker is back. The ring lives behind a header page; head and tail are
+ * byte offsets that only grow, the position in the ring is offset % cap. A
+ * record not fitting in front of the end of the ring leaves a wrap marker
+ * (len 0) and goes to the start. Without spool_path the mapping is anonymous
+ * and the spool only bridges outages while the process runs.
+ *
+ * The file is consistent after a crash of the process (the page cache keeps
+ * it), after a power loss only as far as the kernel wrote it back.
+ */
+
+#define MQTT_SPOOL_MAGIC   "LTSPOOL1"
+#define MQTT_SPOOL_HEAD    4096
+#define MQTT_SPOOL_MIN     4096
+#define MQTT_SPOOL_RATE    100   /* replayed messages per second */
+#define MQTT_SPOOL_TICK_MS 100
+#define MQTT_SPOOL_ALIGN(x) (((x) + 7) & ~(size_t) 7)
+
+struct mqtt_spool_head
+{
+  char     magic[8];
+  uint64_t cap;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t count;
+};
+
+struct mqtt_spool_rec
+{
+  uint32_t len;          /* whole record, aligned to 8, 0: wrap marker */
+  uint32_t payload_len;
+  uint32_t topic_len;    /* with its '\0' */
+  uint32_t check;
+};
+
+struct mqtt_spool
+{
+  pthread_mutex_t          lock;
+  struct mqtt_spool_head * head;
+  unsigned char *          ring;
+  size_t                   map_len;
+  int                      pending;   /* messages spooled, read without the lock */
+  uint64_t                 due;       /* next replay tick, mqtt_now_ms() */
+  struct mqtt_spool_stats  stats;
+};
+
+
+static uint32_t mqtt_spool_check(const struct mqtt_spool_rec * rec)
+{
+  return (rec->len ^ (rec->payload_len * 2654435761u) ^ (rec->topic_len << 16)) ^ 0x5a5a17a5u;
+}
+
+static void mqtt_spool_reset(struct mqtt_spool * s, uint64_t cap)
+{
+  memset(s->head, 0, sizeof(*s->head));
+  memcpy(s->head->magic, MQTT_SPOOL_MAGIC, sizeof(s->head->magic));
+  s->head->cap = cap;
+}
+
+static int mqtt_spool_valid(const struct mqtt_spool_head * h, const struct mqtt_spool_rec * rec, uint64_t at)
+{
+  size_t pos = at % h->cap;
+
+  return rec->check == mqtt_spool_check(rec) && rec->len <= h->tail - at && pos + rec->len <= h->cap &&
+         sizeof(*rec) + rec->topic_len + rec->payload_len <= rec->len && rec->topic_len != 0 &&
+         ((const char *) (rec + 1))[rec->topic_len - 1] == '\0';
+}
+
+/* records between head and tail - the header count is not trusted, a crash may hit between its stores; -1: broken */
+static int64_t mqtt_spool_walk(const struct mqtt_spool * s)
+{
+  const struct mqtt_spool_head * h = s->head;
+  const struct mqtt_spool_rec * rec;
+  uint64_t at = h->head;
+  int64_t count = 0;
+  size_t pos;
+
+  while (at < h->tail)
+  {
+    pos = at % h->cap;
+    rec = (const struct mqtt_spool_rec *) (s->ring + pos);
+    if (rec->len == 0)  /* wrap marker */
+    {
+      at += h->cap - pos;
+      continue;
+    }
+    if (h->cap - pos < sizeof(*rec) || !mqtt_spool_valid(h, rec, at))
+      return -1;
+    at += rec->len;
+    ++count;
+  }
+  return at == h->tail ? count : -1;
+}
+
+/* record at the head, wrap markers skipped - NULL: empty or broken */
+static struct mqtt_spool_rec * mqtt_spool_peek(struct mqtt_spool * s)
+{
+  struct mqtt_spool_head * h = s->head;
+  struct mqtt_spool_rec * rec;
+  size_t pos;
+
+  while (h->head < h->tail)
+  {
+    pos = h->head % h->cap;
+    rec = (struct mqtt_spool_rec *) (s->ring + pos);
+    if (rec->len == 0)
+    {
+      h->head += h->cap - pos;
+      continue;
+    }
+    if (!mqtt_spool_valid(h, rec, h->head))
+    {
+      LG_ERROR("MQTT - spool is corrupt, discarding %llu message(s).", (unsigned long long) h->count);
+      s->stats.evicted += h->count;
+      mqtt_spool_reset(s, h->cap);
+      return NULL;
+    }
+    return rec;
+  }
+  return NULL;
+}
+
+static void mqtt_spool_pop(struct mqtt_spool * s, const struct mqtt_spool_rec * rec)
+{
+  s->head->head += rec->len;
+  --s->head->count;
+  if (s->head->count == 0)
+    s->head->head = s->head->tail;
+}
+
+
+int mqtt_spool_init(struct mqtt_handle * hnd, size_t bytes)
+{
+  const struct mqtt_config * cfg = hnd->cfg;
+  struct mqtt_spool * s;
+  struct stat st;
+  uint64_t cap;
+  int64_t count;
+  void * map;
+  int fd = -1;
+
+  if (bytes == 0)
+    return TRUE;
+
+  cap = MQTT_SPOOL_ALIGN(bytes < MQTT_SPOOL_MIN ? MQTT_SPOOL_MIN : bytes);
+  s = calloc(1, sizeof(*s));
+  if (s == NULL)
+    return FALSE;
+  s->map_len = MQTT_SPOOL_HEAD + cap;
+
+  if (cfg->spool_path)
+  {
+    fd = open(cfg->spool_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) != 0 || ((size_t) st.st_size != s->map_len && ftruncate(fd, (off_t) s->map_len) != 0))
+    {
+      LG_CRITICAL("MQTT - Could not open spool file %s: %s", cfg->spool_path, strerror(errno));
+      goto spool_init_fail;
+    }
+    map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    fd = -1;
+  }
+  else
+    map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+  {
+    LG_CRITICAL("MQTT - Could not map spool: %s", strerror(errno));
+    goto spool_init_fail;
+  }
+  s->head = map;
+  s->ring = (unsigned char *) map + MQTT_SPOOL_HEAD;
+
+  if (memcmp(s->head->magic, MQTT_SPOOL_MAGIC, sizeof(s->head->magic)) != 0 || s->head->cap != cap ||
+      s->head->head > s->head->tail || s->head->tail - s->head->head > cap || (count = mqtt_spool_walk(s)) < 0)
+  {
+    if (s->head->magic[0])
+      LG_WARN("MQTT - spool %s does not match the configuration, starting over.", cfg->spool_path);
+    mqtt_spool_reset(s, cap);
+  }
+  else if ((s->head->count = (uint64_t) count) != 0)
+    LG_INFO("MQTT - %llu spooled message(s) from a previous run to replay.", (unsigned long long) s->head->count);
+
+  s->pending = s->head->count != 0;
+  pthread_mutex_init(&s->lock, NULL);
+  hnd->spool = s;
+  return TRUE;
+
+spool_init_fail:
+  if (fd >= 0)
+    close(fd);
+  free(s);
+  return FALSE;
+}
+
+void mqtt_spool_free(struct mqtt_handle * hnd)
+{
+  struct mqtt_spool * s = hnd->spool;
+
+  if (s == NULL)
+    return;
+  hnd->spool = NULL;
+  if (hnd->cfg->spool_path)
+    msync(s->head, s->map_len, MS_SYNC);
+  munmap(s->head, s->map_len);
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+int mqtt_spool_pending(struct mqtt_handle * hnd)
+{
+  return hnd->spool && __atomic_load_n(&hnd->spool->pending, __ATOMIC_RELAXED);
+}
+
+void mqtt_spool_add(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len)
+{
+  struct mqtt_spool * s = hnd->spool;
+  struct mqtt_spool_head * h = s->head;
+  struct mqtt_spool_rec rec;
+  struct mqtt_spool_rec * old;
+  size_t topic_len = strlen(topic) + 1;
+  size_t need = MQTT_SPOOL_ALIGN(sizeof(rec) + topic_len + len);
+  size_t pos, waste;
+  unsigned int limit = hnd->cfg->spool_msgs;
+
+  pthread_mutex_lock(&s->lock);
+  if (need > h->cap / 2)
+  {
+    ++s->stats.rejected;
+    pthread_mutex_unlock(&s->lock);
+    LG_ERROR_RL("MQTT - message for %s too large for the spool, dropped.", topic);
+    return;
+  }
+
+  for (;;)
+  {
+    pos   = h->tail % h->cap;
+    waste = pos + need > h->cap ? h->cap - pos : 0;
+    if (h->cap - (h->tail - h->head) >= waste + need && (limit == 0 || h->count < limit))
+      break;
+    if (hnd->cfg->spool_evict != MQTT_OVF_DROP_OLDEST)
+    {
+      ++s->stats.rejected;
+      pthread_mutex_unlock(&s->lock);
+      LG_WARN_RL("MQTT - spool full, message for %s dropped.", topic);
+      return;
+    }
+    old = mqtt_spool_peek(s);
+    if (old == NULL)
+    {
+      /* nothing left (or reset) - an empty ring takes any record up to cap / 2 */
+      h->head  = h->tail;
+      h->count = 0;
+      break;
+    }
+    mqtt_spool_pop(s, old);
+    ++s->stats.evicted;
+  }
+
+  if (waste)
+  {
+    ((struct mqtt_spool_rec *) (s->ring + pos))->len = 0;
+    h->tail += waste;
+    pos = 0;
+  }
+  rec.len         = (uint32_t) need;
+  rec.payload_len = (uint32_t) len;
+  rec.topic_len   = (uint32_t) topic_len;
+  rec.check       = mqtt_spool_check(&rec);
+  memcpy(s->ring + pos, &rec, sizeof(rec));
+  memcpy(s->ring + pos + sizeof(rec), topic, topic_len);
+  memcpy(s->ring + pos + sizeof(rec) + topic_len, payload, len);
+  /* record and count are complete before the tail covers them, should the process die in between */
+  ++h->count;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  h->tail += need;
+  ++s->stats.spooled;
+  if (!s->pending)
+    __atomic_store_n(&s->pending, TRUE, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* one tick: up to spool_rate / 10 messages while connected */
+void mqtt_spool_poll(struct mqtt_handle * hnd)
+{
+  struct mqtt_spool * s = hnd->spool;
+  struct mqtt_spool_rec * rec;
+  unsigned int rate = hnd->cfg->spool_rate ? hnd->cfg->spool_rate : MQTT_SPOOL_RATE;
+  unsigned int budget = rate * MQTT_SPOOL_TICK_MS / 1000;
+  uint64_t now = mqtt_now_ms();
+  int result;
+
+  if (s == NULL || !__atomic_load_n(&s->pending, __ATOMIC_RELAXED) || mqtt_get_state(hnd) != MQTT_STATE_CONNECTED ||
+      now < __atomic_load_n(&s->due, __ATOMIC_RELAXED))
+    return;
+
+  pthread_mutex_lock(&s->lock);
+  __atomic_store_n(&s->due, now + MQTT_SPOOL_TICK_MS, __ATOMIC_RELAXED);
+  for (budget = budget ? budget : 1; budget; --budget)
+  {
+    rec = mqtt_spool_peek(s);
+    if (rec == NULL)
+      break;
+    result = mqtt_send(hnd, (const char *) (rec + 1), (const char *) (rec + 1) + rec->topic_len, rec->payload_len);
+    if (result == MOSQ_ERR_NO_CONN || result == MOSQ_ERR_CONN_LOST || result == MOSQ_ERR_NOMEM)
+      break;  /* next tick */
+    mqtt_stats_published(hnd, rec->payload_len, result);
+    if (result != MOSQ_ERR_SUCCESS)
+    {
+      LG_ERROR("MQTT - Could not replay spooled message for '%s', dropped. Error returned: %d", (const char *) (rec + 1), result);
+      ++s->stats.rejected;
+    }
+    else
+      ++s->stats.replayed;
+    mqtt_spool_pop(s, rec);
+  }
+  if (s->head->count == 0)
+  {
+    __atomic_store_n(&s->pending, FALSE, __ATOMIC_RELAXED);
+    LG_INFO("MQTT - spool drained.");
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+uint64_t mqtt_spool_due(struct mqtt_handle * hnd)
+{
+  uint64_t due;
+
+  if (!mqtt_spool_pending(hnd) || mqtt_get_state(hnd) != MQTT_STATE_CONNECTED)
+    return 0;
+  due = __atomic_load_n(&hnd->spool->due, __ATOMIC_RELAXED);
+  return due ? due : 1;
+}
+
+void mqtt_get_spool_stats(struct mqtt_handle * hnd, struct mqtt_spool_stats * stats)
+{
+  struct mqtt_spool * s = hnd->spool;
+
+  memset(stats, 0, sizeof(*stats));
+  if (s == NULL)
+    return;
+  pthread_mutex_lock(&s->lock);
+  *stats       = s->stats;
+  stats->count = s->head->count;
+  stats->bytes = s->head->tail - s->head->head;
+  pthread_mutex_unlock(&s->lock);
+}
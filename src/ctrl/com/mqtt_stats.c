@@ -0,0 +1,177 @@
+#include <stdlib.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+
+/*
+ * Instrumentation: counters and histograms of a handle, updated from any
+ * thread with relaxed atomics - publishers, the network thread and the
+ * workers all feed them. With cfg->stats_topic and cfg->stats_s the loop
+ * publishes a snapshot as one line "mqtt,client=<id> published=...i,..."
+ * every stats_s seconds while connected; counters and histograms in it are
+ * totals since the handle was created.
+ */
+
+#define MQTT_STATS_LINE 1024
+
+struct mqtt_meter
+{
+  struct mqtt_stats stats;       /* counters and histograms, disconnected_ms up to down_since */
+  uint64_t          down_since;  /* mqtt_now_ms() the connection went down, 0: connected */
+  unsigned long     connects;
+  uint64_t          due;         /* next self-publish */
+};
+
+
+int mqtt_stats_init(struct mqtt_handle * hnd)
+{
+  hnd->meter = calloc(1, sizeof(*hnd->meter));
+  if (hnd->meter == NULL)
+    return FALSE;
+  hnd->meter->down_since = mqtt_now_ms();
+  if (hnd->cfg->stats_topic && hnd->cfg->stats_s)
+    hnd->meter->due = mqtt_now_ms() + hnd->cfg->stats_s * 1000ull;
+  return TRUE;
+}
+
+void mqtt_stats_free(struct mqtt_handle * hnd)
+{
+  free(hnd->meter);
+  hnd->meter = NULL;
+}
+
+
+void mqtt_stats_published(struct mqtt_handle * hnd, size_t len, int result)
+{
+  struct mqtt_stats * s = &hnd->meter->stats;
+  unsigned int idx;
+
+  if (result == MOSQ_ERR_SUCCESS)
+  {
+    __atomic_add_fetch(&s->published, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->published_bytes, len, __ATOMIC_RELAXED);
+    return;
+  }
+  idx = result > 0 && result < MQTT_STATS_ERRORS - 1 ? (unsigned int) result : MQTT_STATS_ERRORS - 1;
+  __atomic_add_fetch(&s->publish_error[idx], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->publish_errors, 1, __ATOMIC_RELAXED);
+}
+
+void mqtt_stats_received(struct mqtt_handle * hnd, size_t len)
+{
+  __atomic_add_fetch(&hnd->meter->stats.received, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hnd->meter->stats.received_bytes, len, __ATOMIC_RELAXED);
+}
+
+void mqtt_stats_callback(struct mqtt_handle * hnd, uint64_t ns)
+{
+  stat_hist_add(&hnd->meter->stats.callback_ns, ns);
+}
+
+void mqtt_stats_loop(struct mqtt_handle * hnd, uint64_t ns)
+{
+  stat_hist_add(&hnd->meter->stats.loop_ns, ns);
+}
+
+/* on state changes, by the thread driving the connection */
+void mqtt_stats_connected(struct mqtt_handle * hnd, int up)
+{
+  struct mqtt_meter * m = hnd->meter;
+  uint64_t since;
+
+  if (m == NULL)
+    return;
+  since = __atomic_load_n(&m->down_since, __ATOMIC_RELAXED);
+  if ((up != 0) == (since == 0))
+    return;
+  if (up)
+  {
+    __atomic_add_fetch(&m->stats.disconnected_ms, mqtt_now_ms() - since, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->down_since, 0, __ATOMIC_RELAXED);
+    if (m->connects++)
+      __atomic_add_fetch(&m->stats.reconnects, 1, __ATOMIC_RELAXED);
+  }
+  else
+    __atomic_store_n(&m->down_since, mqtt_now_ms(), __ATOMIC_RELAXED);
+}
+
+
+void mqtt_get_stats(struct mqtt_handle * hnd, struct mqtt_stats * stats)
+{
+  struct mqtt_stats * s = &hnd->meter->stats;
+  uint64_t since = __atomic_load_n(&hnd->meter->down_since, __ATOMIC_RELAXED);
+
+  stats->published       = __atomic_load_n(&s->published, __ATOMIC_RELAXED);
+  stats->published_bytes = __atomic_load_n(&s->published_bytes, __ATOMIC_RELAXED);
+  stats->received        = __atomic_load_n(&s->received, __ATOMIC_RELAXED);
+  stats->received_bytes  = __atomic_load_n(&s->received_bytes, __ATOMIC_RELAXED);
+  stats->publish_errors  = __atomic_load_n(&s->publish_errors, __ATOMIC_RELAXED);
+  for (unsigned int i = 0; i < MQTT_STATS_ERRORS; i++)
+    stats->publish_error[i] = __atomic_load_n(&s->publish_error[i], __ATOMIC_RELAXED);
+  stats->reconnects      = __atomic_load_n(&s->reconnects, __ATOMIC_RELAXED);
+  stats->disconnected_ms = __atomic_load_n(&s->disconnected_ms, __ATOMIC_RELAXED);
+  if (since)
+    stats->disconnected_ms += mqtt_now_ms() - since;
+  stats->suppressed      = mqtt_cache_suppressed(hnd);
+  stat_hist_snapshot(&stats->callback_ns, &s->callback_ns);
+  stat_hist_snapshot(&stats->loop_ns, &s->loop_ns);
+}
+
+
+static void mqtt_stats_publish(struct mqtt_handle * hnd)
+{
+  struct mqtt_stats stats;
+  struct mqtt_spool_stats spool;
+  struct mqtt_queue_stats queue;
+  struct mqtt_line line;
+  char buf[MQTT_STATS_LINE];
+
+  mqtt_get_stats(hnd, &stats);
+  mqtt_get_spool_stats(hnd, &spool);
+  mqtt_get_queue_stats(hnd, &queue);
+
+  mqtt_line_init(&line, buf, sizeof(buf), "mqtt");
+  mqtt_line_tag(&line, "client", hnd->cfg->client_id);
+  mqtt_line_int(&line, "published", (int64_t) stats.published);
+  mqtt_line_int(&line, "published_bytes", (int64_t) stats.published_bytes);
+  mqtt_line_int(&line, "received", (int64_t) stats.received);
+  mqtt_line_int(&line, "received_bytes", (int64_t) stats.received_bytes);
+  mqtt_line_int(&line, "publish_errors", (int64_t) stats.publish_errors);
+  mqtt_line_int(&line, "reconnects", (int64_t) stats.reconnects);
+  mqtt_line_int(&line, "disconnected_ms", (int64_t) stats.disconnected_ms);
+  mqtt_line_int(&line, "suppressed", (int64_t) stats.suppressed);
+  mqtt_line_int(&line, "spooled", (int64_t) spool.count);
+  mqtt_line_int(&line, "queue_dropped", (int64_t) queue.dropped);
+  mqtt_line_int(&line, "callback_p50_ns", (int64_t) stat_hist_percentile(&stats.callback_ns, 0.5));
+  mqtt_line_int(&line, "callback_p99_ns", (int64_t) stat_hist_percentile(&stats.callback_ns, 0.99));
+  mqtt_line_int(&line, "callback_max_ns", (int64_t) stats.callback_ns.max);
+  mqtt_line_int(&line, "loop_p50_ns", (int64_t) stat_hist_percentile(&stats.loop_ns, 0.5));
+  mqtt_line_int(&line, "loop_p99_ns", (int64_t) stat_hist_percentile(&stats.loop_ns, 0.99));
+  mqtt_line_int(&line, "loop_max_ns", (int64_t) stats.loop_ns.max);
+  if (line.failed)
+  {
+    LG_ERROR_RL("MQTT - stats line does not fit, not published.");
+    return;
+  }
+  mqtt_publish_payload(hnd, hnd->cfg->stats_topic, line.buf, line.len);
+}
+
+void mqtt_stats_poll(struct mqtt_handle * hnd)
+{
+  struct mqtt_meter * m = hnd->meter;
+  uint64_t now;
+
+  if (m->due == 0 || (now = mqtt_now_ms()) < m->due)
+    return;
+  m->due = now + hnd->cfg->stats_s * 1000ull;
+  if (mqtt_get_state(hnd) == MQTT_STATE_CONNECTED)  /* not into the spool */
+    mqtt_stats_publish(hnd);
+}
+
+uint64_t mqtt_stats_due(struct mqtt_handle * hnd)
+{
+  return hnd->meter->due;
+}
@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mosquitto.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+#include "../../ringhelp.h"
+
+/*
+ * Threaded mode: the network thread owns the mosquitto loop. Inbound messages
+ * are copied into per-worker queues (lock-free rings, one producer), the
+ * worker is picked by a hash of the topic so messages of one topic keep their
+ * order. Worker and network thread only take the worker's mutex to sleep or
+ * to wake the other side.
+ */
+
+#define MQTT_QUEUE_LEN  256
+#define MQTT_LOOP_MS    1000  /* also the time mqtt_stop may wait for the network thread */
+
+struct mqtt_msg
+{
+  char * topic;
+  char * payload;
+  /* topic and payload follow */
+};
+
+struct mqtt_worker
+{
+  struct mqtt_threads * pool;
+  pthread_t             thread;
+  int                   started;
+  struct ring *         ring;
+  void *                mem;
+  pthread_mutex_t       lock;
+  pthread_cond_t        wake;   /* messages queued */
+  pthread_cond_t        room;   /* messages taken */
+  atomic_int            idle;   /* worker waits on wake */
+  atomic_int            full;   /* network thread waits on room */
+};
+
+struct mqtt_threads
+{
+  struct mqtt_handle * hnd;
+  pthread_t            net;
+  int                  net_started;
+  atomic_int           running;
+  enum mqtt_overflow   policy;
+  unsigned int         block_ms;
+  unsigned int         count;
+  struct mqtt_worker * workers;
+  atomic_ulong         received;
+  atomic_ulong         dispatched;
+  atomic_ulong         dropped;
+  atomic_ulong         blocked;
+  atomic_size_t        depth_max;
+};
+
+
+static uint32_t mqtt_topic_hash(const char * topic)
+{
+  uint32_t hash = 2166136261u;
+  for (; *topic; topic++)
+  {
+    hash ^= (unsigned char) *topic;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static struct mqtt_msg ** mqtt_worker_reserve(struct mqtt_threads * thr, struct mqtt_worker * w)
+{
+  struct mqtt_msg ** slot;
+  struct timespec deadline;
+  int waited = FALSE;
+  int rc;
+
+  while ((slot = ring_reserve(w->ring)) == NULL)
+  {
+    switch (thr->policy)
+    {
+      case MQTT_OVF_DROP_NEWEST:
+        return NULL;
+      case MQTT_OVF_DROP_OLDEST:
+        if ((slot = ring_acquire(w->ring)) != NULL)
+        {
+          free(*slot);
+          ring_release(w->ring, slot);
+          atomic_fetch_add_explicit(&thr->dropped, 1, memory_order_relaxed);
+        }
+        break;
+      case MQTT_OVF_BLOCK:
+      default:
+        if (!waited)
+        {
+          atomic_fetch_add_explicit(&thr->blocked, 1, memory_order_relaxed);
+          clock_gettime(CLOCK_REALTIME, &deadline);
+          deadline.tv_sec  += thr->block_ms / 1000;
+          deadline.tv_nsec += (thr->block_ms % 1000) * 1000000L;
+          if (deadline.tv_nsec >= 1000000000L)
+          {
+            deadline.tv_sec  += 1;
+            deadline.tv_nsec -= 1000000000L;
+          }
+          waited = TRUE;
+        }
+        rc = 0;
+        pthread_mutex_lock(&w->lock);
+        atomic_store(&w->full, TRUE);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ring_used(w->ring) >= ring_capacity(w->ring))
+          rc = pthread_cond_timedwait(&w->room, &w->lock, &deadline);
+        atomic_store(&w->full, FALSE);
+        pthread_mutex_unlock(&w->lock);
+        if (rc == ETIMEDOUT)
+          return NULL;
+        break;
+    }
+  }
+  return slot;
+}
+
+int mqtt_threads_push(struct mqtt_handle * hnd, const struct mosquitto_message * msg)
+{
+  struct mqtt_threads * thr = hnd->threads;
+  struct mqtt_worker * w;
+  struct mqtt_msg ** slot;
+  struct mqtt_msg * m;
+  size_t len, depth, max;
+
+  if (thr == NULL || thr->count == 0)
+    return FALSE;
+
+  len = strlen(msg->topic) + 1;
+  m = malloc(sizeof(*m) + len + msg->payloadlen + 1);
+  if (m == NULL)
+  {
+    atomic_fetch_add_explicit(&thr->dropped, 1, memory_order_relaxed);
+    LG_ERROR_RL("MQTT - out of memory, message on %s dropped.", msg->topic);
+    return TRUE;
+  }
+  m->topic   = (char *) (m + 1);
+  m->payload = m->topic + len;
+  memcpy(m->topic, msg->topic, len);
+  if (msg->payloadlen)
+    memcpy(m->payload, msg->payload, msg->payloadlen);
+  m->payload[msg->payloadlen] = '\0';
+
+  w = &thr->workers[mqtt_topic_hash(msg->topic) % thr->count];
+  slot = mqtt_worker_reserve(thr, w);
+  if (slot == NULL)
+  {
+    free(m);
+    atomic_fetch_add_explicit(&thr->dropped, 1, memory_order_relaxed);
+    LG_WARN_RL("MQTT - worker queue full, message on %s dropped.", msg->topic);
+    return TRUE;
+  }
+  *slot = m;
+  ring_commit(w->ring, slot);
+  atomic_fetch_add_explicit(&thr->received, 1, memory_order_relaxed);
+
+  depth = ring_used(w->ring);
+  max   = atomic_load_explicit(&thr->depth_max, memory_order_relaxed);
+  if (depth > max)
+    atomic_store_explicit(&thr->depth_max, depth, memory_order_relaxed);
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&w->idle))
+  {
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+  }
+  return TRUE;
+}
+
+
+static void * mqtt_worker_main(void * arg)
+{
+  struct mqtt_worker * w = arg;
+  struct mqtt_threads * thr = w->pool;
+  struct mqtt_msg ** slot;
+  struct mqtt_msg * m;
+
+  for (;;)
+  {
+    while ((slot = ring_acquire(w->ring)) != NULL)
+    {
+      m = *slot;
+      ring_release(w->ring, slot);
+      atomic_thread_fence(memory_order_seq_cst);
+      if (atomic_load(&w->full))
+      {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->room);
+        pthread_mutex_unlock(&w->lock);
+      }
+      mqtt_dispatch(thr->hnd, m->topic, m->payload);
+      free(m);
+      atomic_fetch_add_explicit(&thr->dispatched, 1, memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    atomic_store(&w->idle, TRUE);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ring_used(w->ring) == 0)
+    {
+      if (!atomic_load(&thr->running))
+      {
+        pthread_mutex_unlock(&w->lock);
+        break;
+      }
+      pthread_cond_wait(&w->wake, &w->lock);
+    }
+    atomic_store(&w->idle, FALSE);
+    pthread_mutex_unlock(&w->lock);
+  }
+  return NULL;
+}
+
+static void * mqtt_net_main(void * arg)
+{
+  struct mqtt_threads * thr = arg;
+  struct timespec pause = { MQTT_RETRY_MS / 1000, (MQTT_RETRY_MS % 1000) * 1000000L };
+
+  int result;
+
+  /* without a connection mqtt_loop_once waits for the next attempt itself */
+  while (atomic_load(&thr->running))
+  {
+    result = mqtt_loop_once(thr->hnd, MQTT_LOOP_MS);
+    if (result != MOSQ_ERR_SUCCESS && result != MOSQ_ERR_NO_CONN && atomic_load(&thr->running))
+      nanosleep(&pause, NULL);
+  }
+  return NULL;
+}
+
+
+static void mqtt_threads_free(struct mqtt_threads * thr)
+{
+  atomic_store(&thr->running, FALSE);
+  if (thr->net_started)
+    pthread_join(thr->net, NULL);
+
+  for (unsigned int i = 0; thr->workers && i < thr->count; i++)
+  {
+    struct mqtt_worker * w = &thr->workers[i];
+    if (w->started)
+    {
+      pthread_mutex_lock(&w->lock);
+      pthread_cond_signal(&w->wake);
+      pthread_mutex_unlock(&w->lock);
+      pthread_join(w->thread, NULL);
+    }
+    if (w->mem)
+    {
+      pthread_mutex_destroy(&w->lock);
+      pthread_cond_destroy(&w->wake);
+      pthread_cond_destroy(&w->room);
+      free(w->mem);
+    }
+  }
+  free(thr->workers);
+  free(thr);
+}
+
+enum mqtt_retval mqtt_start(struct mqtt_handle * hnd)
+{
+  struct mqtt_threads * thr;
+  size_t len, size;
+
+  if (hnd == NULL || hnd->threads)
+    return MQTT_RET_FAILED;
+
+  thr = calloc(1, sizeof(*thr));
+  if (thr == NULL)
+    goto start_mqtt_fail;
+  thr->hnd      = hnd;
+  thr->count    = hnd->cfg->workers;
+  thr->policy   = hnd->cfg->overflow < MQTT_OVF_COUNT ? hnd->cfg->overflow : MQTT_OVF_BLOCK;
+  thr->block_ms = hnd->cfg->block_ms ? hnd->cfg->block_ms : LINUXTOOLS_MQTT_KEEPALIVE * 500;
+  atomic_store(&thr->running, TRUE);
+
+  len  = hnd->cfg->queue_len ? hnd->cfg->queue_len : MQTT_QUEUE_LEN;
+  size = ring_mem_size(len, sizeof(struct mqtt_msg *));
+  if (thr->count)
+  {
+    thr->workers = calloc(thr->count, sizeof(*thr->workers));
+    if (thr->workers == NULL)
+      goto start_mqtt_fail;
+  }
+  for (unsigned int i = 0; i < thr->count; i++)
+  {
+    struct mqtt_worker * w = &thr->workers[i];
+    w->pool = thr;
+    w->mem  = aligned_alloc(64, (size + 63) & ~(size_t) 63);
+    if (w->mem == NULL)
+      goto start_mqtt_fail;
+    w->ring = ring_init(w->mem, len, sizeof(struct mqtt_msg *));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->room, NULL);
+    if (pthread_create(&w->thread, NULL, mqtt_worker_main, w) != 0)
+      goto start_mqtt_fail;
+    w->started = TRUE;
+  }
+
+  mosquitto_threaded_set(hnd->mosq, TRUE);
+  hnd->threads = thr;
+  if (pthread_create(&thr->net, NULL, mqtt_net_main, thr) != 0)
+  {
+    hnd->threads = NULL;
+    mosquitto_threaded_set(hnd->mosq, FALSE);
+    goto start_mqtt_fail;
+  }
+  thr->net_started = TRUE;
+  LG_DEBUG("MQTT - network thread and %u worker(s) started.", thr->count);
+  return MQTT_RET_OK;
+
+start_mqtt_fail:
+  LG_CRITICAL("MQTT - Could not start network thread and workers.");
+  if (thr)
+    mqtt_threads_free(thr);
+  return MQTT_RET_FAILED;
+}
+
+void mqtt_stop(struct mqtt_handle * hnd)
+{
+  struct mqtt_threads * thr;
+
+  if (hnd == NULL || (thr = hnd->threads) == NULL)
+    return;
+
+  /* the network thread is gone before the workers drain their queues */
+  mqtt_threads_free(thr);
+  hnd->threads = NULL;
+  mosquitto_threaded_set(hnd->mosq, FALSE);
+  LG_DEBUG("MQTT - network thread and workers stopped.");
+}
+
+void mqtt_get_queue_stats(struct mqtt_handle * hnd, struct mqtt_queue_stats * stats)
+{
+  struct mqtt_threads * thr;
+
+  if (stats == NULL)
+    return;
+  memset(stats, 0, sizeof(*stats));
+  if (hnd == NULL || (thr = hnd->threads) == NULL)
+    return;
+
+  stats->received   = atomic_load_explicit(&thr->received, memory_order_relaxed);
+  stats->dispatched = atomic_load_explicit(&thr->dispatched, memory_order_relaxed);
+  stats->dropped    = atomic_load_explicit(&thr->dropped, memory_order_relaxed);
+  stats->blocked    = atomic_load_explicit(&thr->blocked, memory_order_relaxed);
+  stats->depth_max  = atomic_load_explicit(&thr->depth_max, memory_order_relaxed);
+  for (unsigned int i = 0; i < thr->count; i++)
+    stats->depth += ring_used(thr->workers[i].ring);
+}
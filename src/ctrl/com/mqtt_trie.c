@@ -0,0 +1,255 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_trie.h"
+#include "../../stringhelp.h"
+
+#define MQTT_TRIE_NONE (-1)
+
+struct mqtt_trie_node
+{
+  int plus;   /* child for '+' */
+  int exact;  /* entries ending at this node */
+  int multi;  /* entries ending with '#' right below this node */
+};
+
+struct mqtt_trie_edge
+{
+  const char * level;  /* NULL: free slot */
+  size_t       len;
+  uint32_t     hash;
+  int          parent;
+  int          child;
+};
+
+struct mqtt_trie_entry
+{
+  const struct mqtt_sub * sub;
+  int                     next;
+};
+
+struct mqtt_trie
+{
+  struct mqtt_trie_node *  nodes;
+  size_t                   node_count;
+  struct mqtt_trie_edge *  edges;
+  size_t                   edge_mask;
+  struct mqtt_trie_entry * entries;
+  size_t                   entry_count;
+};
+
+
+static size_t mqtt_trie_level_len(const char * level)
+{
+  return str_level_len(level);
+}
+
+static uint32_t mqtt_trie_hash(int parent, const char * level, size_t len)
+{
+  uint32_t hash = 2166136261u ^ ((uint32_t) parent * 2654435761u);
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char) level[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int mqtt_trie_child(const struct mqtt_trie * trie, int parent, const char * level, size_t len, uint32_t hash)
+{
+  size_t idx = hash & trie->edge_mask;
+  const struct mqtt_trie_edge * edge;
+
+  for (edge = &trie->edges[idx]; edge->level; edge = &trie->edges[idx = (idx + 1) & trie->edge_mask])
+    if (edge->hash == hash && edge->parent == parent && edge->len == len && memcmp(edge->level, level, len) == 0)
+      return edge->child;
+  return MQTT_TRIE_NONE;
+}
+
+static int mqtt_trie_node_new(struct mqtt_trie * trie)
+{
+  struct mqtt_trie_node * node = &trie->nodes[trie->node_count];
+  node->plus  = MQTT_TRIE_NONE;
+  node->exact = MQTT_TRIE_NONE;
+  node->multi = MQTT_TRIE_NONE;
+  return (int) trie->node_count++;
+}
+
+static int mqtt_trie_add_child(struct mqtt_trie * trie, int parent, const char * level, size_t len)
+{
+  uint32_t hash = mqtt_trie_hash(parent, level, len);
+  int child = mqtt_trie_child(trie, parent, level, len, hash);
+  size_t idx;
+
+  if (child != MQTT_TRIE_NONE)
+    return child;
+
+  child = mqtt_trie_node_new(trie);
+  for (idx = hash & trie->edge_mask; trie->edges[idx].level; idx = (idx + 1) & trie->edge_mask)
+    ;
+  trie->edges[idx].level  = level;
+  trie->edges[idx].len    = len;
+  trie->edges[idx].hash   = hash;
+  trie->edges[idx].parent = parent;
+  trie->edges[idx].child  = child;
+  return child;
+}
+
+static void mqtt_trie_add_entry(struct mqtt_trie * trie, int * list, const struct mqtt_sub * sub)
+{
+  struct mqtt_trie_entry * entry = &trie->entries[trie->entry_count];
+  int * tail = list;
+
+  /* keep the order of the subscription table */
+  while (*tail != MQTT_TRIE_NONE)
+    tail = &trie->entries[*tail].next;
+  entry->sub  = sub;
+  entry->next = MQTT_TRIE_NONE;
+  *tail = (int) trie->entry_count++;
+}
+
+/* '+' and '#' only as a whole level, '#' only as the last one */
+static int mqtt_trie_valid(const char * topic)
+{
+  const char * level = topic;
+  size_t len;
+
+  if (*topic == '\0')
+    return 0;
+  for (;;)
+  {
+    len = mqtt_trie_level_len(level);
+    for (size_t i = 0; i < len; i++)
+      if ((level[i] == '+' || level[i] == '#') && len != 1)
+        return 0;
+    if (len == 1 && level[0] == '#' && level[1] != '\0')
+      return 0;
+    if (level[len] == '\0')
+      return 1;
+    level += len + 1;
+  }
+}
+
+struct mqtt_trie * mqtt_trie_build(const struct mqtt_sub * subs)
+{
+  struct mqtt_trie * trie;
+  size_t count = 0, levels = 0, edges = 2;
+  const char * level;
+  size_t len;
+  int node;
+
+  for (const struct mqtt_sub * sub = subs; sub && sub->topic; ++sub, ++count)
+    for (const char * p = sub->topic; ; ++p)
+    {
+      if (*p == '/' || *p == '\0')
+        ++levels;
+      if (*p == '\0')
+        break;
+    }
+  while (edges < 2 * levels)
+    edges <<= 1;
+
+  trie = calloc(1, sizeof(*trie));
+  if (trie == NULL)
+    return NULL;
+  trie->nodes     = calloc(levels + 1, sizeof(*trie->nodes));
+  trie->edges     = calloc(edges, sizeof(*trie->edges));
+  trie->entries   = calloc(count + 1, sizeof(*trie->entries));
+  trie->edge_mask = edges - 1;
+  if (trie->nodes == NULL || trie->edges == NULL || trie->entries == NULL)
+  {
+    mqtt_trie_free(trie);
+    return NULL;
+  }
+  mqtt_trie_node_new(trie);
+
+  for (const struct mqtt_sub * sub = subs; sub && sub->topic; ++sub)
+  {
+    if (!mqtt_trie_valid(sub->topic))
+      continue;  /* the broker refuses it as well */
+
+    node  = 0;
+    level = sub->topic;
+    for (;;)
+    {
+      len = mqtt_trie_level_len(level);
+      if (len == 1 && level[0] == '#')
+        break;
+      if (len == 1 && level[0] == '+')
+      {
+        if (trie->nodes[node].plus == MQTT_TRIE_NONE)
+        {
+          int child = mqtt_trie_node_new(trie);
+          trie->nodes[node].plus = child;
+        }
+        node = trie->nodes[node].plus;
+      }
+      else
+        node = mqtt_trie_add_child(trie, node, level, len);
+      if (level[len] == '\0')
+        break;
+      level += len + 1;
+    }
+
+    if (len == 1 && level[0] == '#')
+      mqtt_trie_add_entry(trie, &trie->nodes[node].multi, sub);
+    else
+      mqtt_trie_add_entry(trie, &trie->nodes[node].exact, sub);
+  }
+  return trie;
+}
+
+
+static size_t mqtt_trie_fire(const struct mqtt_trie * trie, int entry, mqtt_trie_fct fct, void * ctx)
+{
+  size_t n = 0;
+
+  for (; entry != MQTT_TRIE_NONE; entry = trie->entries[entry].next, ++n)
+    fct(trie->entries[entry].sub, ctx);
+  return n;
+}
+
+static size_t mqtt_trie_walk(const struct mqtt_trie * trie, int node, const char * level, int wild, mqtt_trie_fct fct, void * ctx);
+
+static size_t mqtt_trie_descend(const struct mqtt_trie * trie, int child, const char * rest, mqtt_trie_fct fct, void * ctx)
+{
+  if (child == MQTT_TRIE_NONE)
+    return 0;
+  if (rest)
+    return mqtt_trie_walk(trie, child, rest, 1, fct, ctx);
+  return mqtt_trie_fire(trie, trie->nodes[child].exact, fct, ctx)
+       + mqtt_trie_fire(trie, trie->nodes[child].multi, fct, ctx);
+}
+
+static size_t mqtt_trie_walk(const struct mqtt_trie * trie, int node, const char * level, int wild, mqtt_trie_fct fct, void * ctx)
+{
+  const struct mqtt_trie_node * n = &trie->nodes[node];
+  size_t len  = mqtt_trie_level_len(level);
+  const char * rest = level[len] ? level + len + 1 : NULL;
+  size_t hits = 0;
+
+  if (wild)
+    hits += mqtt_trie_fire(trie, n->multi, fct, ctx);
+  hits += mqtt_trie_descend(trie, mqtt_trie_child(trie, node, level, len, mqtt_trie_hash(node, level, len)), rest, fct, ctx);
+  if (wild)
+    hits += mqtt_trie_descend(trie, n->plus, rest, fct, ctx);
+  return hits;
+}
+
+size_t mqtt_trie_match(const struct mqtt_trie * trie, const char * topic, mqtt_trie_fct fct, void * ctx)
+{
+  if (trie == NULL || topic == NULL || *topic == '\0')
+    return 0;
+  return mqtt_trie_walk(trie, 0, topic, topic[0] != '$', fct, ctx);
+}
+
+void mqtt_trie_free(struct mqtt_trie * trie)
+{
+  if (trie == NULL)
+    return;
+  free(trie->nodes);
+  free(trie->edges);
+  free(trie->entries);
+  free(trie);
+}
@@ -0,0 +1,34 @@
+#ifndef _H_LINUXTOOLS_CTRL_COM_MQTT_TRIE
+#define _H_LINUXTOOLS_CTRL_COM_MQTT_TRIE
+
+#include <stddef.h>
+
+#include "mqtt.h"
+
+/*
+ * Subscription table compiled into a topic-level trie. Exact levels are found
+ * through one hash table keyed by (parent node, level), so matching a topic
+ * costs O(levels) lookups independent of the number of subscriptions. '+' and
+ * '#' follow MQTT semantics, "a/#" also matches "a", wildcards at the first
+ * level do not match topics starting with '$'. The trie refers to the topic
+ * strings of the subscriptions and is read-only after the build.
+ */
+
+struct mqtt_trie;
+
+typedef void (*mqtt_trie_fct)(const struct mqtt_sub * sub, void * ctx);
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  struct mqtt_trie * mqtt_trie_build(const struct mqtt_sub * subs);  /* subs terminated by topic NULL */
+  size_t mqtt_trie_match(const struct mqtt_trie * trie, const char * topic, mqtt_trie_fct fct, void * ctx);
+  void   mqtt_trie_free(struct mqtt_trie * trie);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _H_LINUXTOOLS_CTRL_COM_MQTT_TRIE
@@ -0,0 +1,186 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mosquitto.h>
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+
+/*
+ * MQTT v5 session: protocol version and receive maximum are set before the
+ * connect, message expiry goes with every publish. Topic aliases: the first
+ * topics published with QoS 0 get one each - up to cfg->topic_aliases and
+ * the Topic Alias Maximum of the broker's CONNACK. The first publish on a
+ * connection carries topic and alias, the following ones the alias only.
+ * Aliases live as long as the connection, the table starts over on every
+ * connect. QoS 1/2 publishes keep the full topic - mosquitto resends them
+ * after a reconnect, where an alias would not be known (yet).
+ */
+
+struct mqtt_v5_alias
+{
+  char *               topic;
+  uint32_t             hash;
+  int                  announced;  /* topic sent with the alias on this connection */
+  mosquitto_property * props;      /* alias and expiry */
+};
+
+struct mqtt_v5
+{
+  pthread_mutex_t        lock;
+  struct mqtt_v5_alias * aliases;  /* [i]: alias i + 1 */
+  unsigned int           count;
+  unsigned int           max;      /* cfg->topic_aliases capped by the broker */
+  mosquitto_property *   props;    /* expiry, publishes without alias */
+};
+
+
+static uint32_t mqtt_v5_hash(const char * topic)
+{
+  uint32_t hash = 2166136261u;
+
+  while (*topic)
+  {
+    hash ^= (unsigned char) *topic++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void mqtt_v5_clear(struct mqtt_v5 * v5)
+{
+  for (unsigned int i = 0; i < v5->count; i++)
+  {
+    free(v5->aliases[i].topic);
+    mosquitto_property_free_all(&v5->aliases[i].props);
+  }
+  v5->count = 0;
+}
+
+int mqtt_v5_init(struct mqtt_handle * hnd)
+{
+  struct mqtt_config * cfg = hnd->cfg;
+  struct mqtt_v5 * v5;
+
+  if (!cfg->v5)
+    return TRUE;
+  if (mosquitto_int_option(hnd->mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5) != MOSQ_ERR_SUCCESS ||
+      (cfg->receive_max && mosquitto_int_option(hnd->mosq, MOSQ_OPT_RECEIVE_MAXIMUM, (int) cfg->receive_max) != MOSQ_ERR_SUCCESS))
+    return FALSE;
+
+  v5 = calloc(1, sizeof(*v5));
+  if (v5 == NULL)
+    return FALSE;
+  if (cfg->topic_aliases && (v5->aliases = calloc(cfg->topic_aliases, sizeof(*v5->aliases))) == NULL)
+    goto init_v5_fail;
+  if (cfg->message_expiry_s &&
+      mosquitto_property_add_int32(&v5->props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, cfg->message_expiry_s) != MOSQ_ERR_SUCCESS)
+    goto init_v5_fail;
+  pthread_mutex_init(&v5->lock, NULL);
+  hnd->v5 = v5;
+  return TRUE;
+
+init_v5_fail:
+  mosquitto_property_free_all(&v5->props);
+  free(v5->aliases);
+  free(v5);
+  return FALSE;
+}
+
+void mqtt_v5_free(struct mqtt_handle * hnd)
+{
+  struct mqtt_v5 * v5 = hnd->v5;
+
+  if (v5 == NULL)
+    return;
+  mqtt_v5_clear(v5);
+  mosquitto_property_free_all(&v5->props);
+  pthread_mutex_destroy(&v5->lock);
+  free(v5->aliases);
+  free(v5);
+  hnd->v5 = NULL;
+}
+
+/* CONNACK: aliases of the last connection are void */
+void mqtt_v5_connected(struct mqtt_handle * hnd, const mosquitto_property * props)
+{
+  struct mqtt_v5 * v5 = hnd->v5;
+  uint16_t broker_max = 0;
+
+  if (v5 == NULL)
+    return;
+  mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &broker_max, FALSE);
+  pthread_mutex_lock(&v5->lock);
+  mqtt_v5_clear(v5);
+  v5->max = hnd->cfg->topic_aliases < broker_max ? hnd->cfg->topic_aliases : broker_max;
+  pthread_mutex_unlock(&v5->lock);
+  LG_DEBUG("MQTT - v5 session, %u topic alias(es).", v5->max);
+}
+
+static struct mqtt_v5_alias * mqtt_v5_alias(struct mqtt_handle * hnd, const char * topic)
+{
+  struct mqtt_v5 * v5 = hnd->v5;
+  struct mqtt_v5_alias * a;
+  uint32_t hash = mqtt_v5_hash(topic);
+
+  for (unsigned int i = 0; i < v5->count; i++)
+    if (v5->aliases[i].hash == hash && strcmp(v5->aliases[i].topic, topic) == 0)
+      return &v5->aliases[i];
+  if (v5->count >= v5->max)
+    return NULL;
+
+  a = &v5->aliases[v5->count];
+  a->topic = strdup(topic);
+  if (a->topic == NULL)
+    return NULL;
+  if (mosquitto_property_add_int16(&a->props, MQTT_PROP_TOPIC_ALIAS, (uint16_t) (v5->count + 1)) != MOSQ_ERR_SUCCESS ||
+      (hnd->cfg->message_expiry_s &&
+       mosquitto_property_add_int32(&a->props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, hnd->cfg->message_expiry_s) != MOSQ_ERR_SUCCESS))
+  {
+    mosquitto_property_free_all(&a->props);
+    free(a->topic);
+    a->topic = NULL;
+    return NULL;
+  }
+  a->hash      = hash;
+  a->announced = FALSE;
+  ++v5->count;
+  return a;
+}
+
+int mqtt_v5_publish(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len)
+{
+  struct mqtt_v5 * v5 = hnd->v5;
+  struct mqtt_v5_alias * a = NULL;
+  int result;
+
+  pthread_mutex_lock(&v5->lock);  /* the announcing publish has to be queued first */
+  if (hnd->cfg->qos == 0 && v5->max)
+    a = mqtt_v5_alias(hnd, topic);
+  if (a)
+  {
+    result = mosquitto_publish_v5(hnd->mosq, NULL, a->announced ? NULL : topic, (int) len, payload, 0, FALSE, a->props);
+    if (result == MOSQ_ERR_SUCCESS)
+      a->announced = TRUE;
+  }
+  else
+    result = mosquitto_publish_v5(hnd->mosq, NULL, topic, (int) len, payload, hnd->cfg->qos, FALSE, v5->props);
+  pthread_mutex_unlock(&v5->lock);
+  return result;
+}
+
+/* text of a reason code, with the reason string of the broker if it sent one */
+const char * mqtt_v5_reason(const char * text, const mosquitto_property * props, char * buf, size_t size)
+{
+  char * str = NULL;
+
+  if (props == NULL || mosquitto_property_read_string(props, MQTT_PROP_REASON_STRING, &str, FALSE) == NULL || str == NULL)
+    return text;
+  snprintf(buf, size, "%s: %s", text, str);
+  free(str);
+  return buf;
+}
@@ -0,0 +1,217 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mosquitto.h>
+#ifdef LINUXTOOLS_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+
+#include "mqtt.h"
+#include "mqtt_priv.h"
+#include "../logger.h"
+
+/*
+ * Payload compression: payloads from cfg->compress_min bytes on are sent as
+ *
+ *   "\0LZ1" <length of the plain payload, uint32 big endian> <raw deflate>
+ *
+ * deflated with a preset dictionary of line protocol snippets. The leading
+ * '\0' keeps it from being taken for text, "1" is the version of format and
+ * dictionary. Received payloads with that header are inflated before the
+ * subscription callbacks see them - whether or not the handle compresses
+ * itself. The streams and buffers live as long as the handle: deflating
+ * publishers take turns on a lock, inflating is done by the thread driving
+ * the loop only. Without LINUXTOOLS_WITH_ZLIB nothing is compressed and
+ * compressed payloads are dropped.
+ */
+
+#define MQTT_ZIP_MAGIC    "\0LZ1"
+#define MQTT_ZIP_HEAD     8
+#define MQTT_ZIP_PLAIN_MAX (64u << 20)  /* larger announced payloads are not inflated */
+
+#ifdef LINUXTOOLS_WITH_ZLIB
+
+/* zlib matches against the end of the dictionary best - the most frequent snippets go last */
+static const char mqtt_zip_dict[] =
+  "true,false,\"ok\",\"error\",status=,state=,count=,total=,level=,rssi=,voltage=,current=,power=,"
+  "energy=,pressure=,flow=,humidity=,temperature=,temp=,unit=,name=,location=,site=,room=,"
+  "sensor=,device=,host=,id=,0i,1i,0.0,0.5,1.0,10,100,-1,"
+  "00,01,02,03,04,05,06,07,08,09,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,"
+  ",type=, value=1, value=0, value=";
+
+struct mqtt_zip
+{
+  pthread_mutex_t lock;       /* deflate side */
+  z_stream        def;
+  unsigned char * def_buf;
+  size_t          def_cap;
+  z_stream        inf;        /* inflate side, loop thread only */
+  int             inf_ready;
+  char *          inf_buf;
+  size_t          inf_cap;
+};
+
+
+static int mqtt_zip_reserve(void ** buf, size_t * cap, size_t len)
+{
+  void * tmp;
+
+  if (len <= *cap)
+    return TRUE;
+  tmp = realloc(*buf, len);
+  if (tmp == NULL)
+    return FALSE;
+  *buf = tmp;
+  *cap = len;
+  return TRUE;
+}
+
+int mqtt_zip_init(struct mqtt_handle * hnd)
+{
+  struct mqtt_zip * z = calloc(1, sizeof(*z));
+
+  if (z == NULL)
+    return FALSE;
+  if (hnd->cfg->compress_min &&
+      deflateInit2(&z->def, hnd->cfg->compress_level ? hnd->cfg->compress_level : Z_DEFAULT_COMPRESSION,
+                   Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    free(z);
+    return FALSE;
+  }
+  pthread_mutex_init(&z->lock, NULL);
+  hnd->zip = z;
+  return TRUE;
+}
+
+void mqtt_zip_free(struct mqtt_handle * hnd)
+{
+  struct mqtt_zip * z = hnd->zip;
+
+  if (z == NULL)
+    return;
+  if (hnd->cfg->compress_min)
+    deflateEnd(&z->def);
+  if (z->inf_ready)
+    inflateEnd(&z->inf);
+  pthread_mutex_destroy(&z->lock);
+  free(z->def_buf);
+  free(z->inf_buf);
+  free(z);
+  hnd->zip = NULL;
+}
+
+int mqtt_zip_publish(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len)
+{
+  struct mqtt_zip * z = hnd->zip;
+  size_t bound;
+  int result;
+
+  if (z == NULL || hnd->cfg->compress_min == 0 || len < hnd->cfg->compress_min || len > UINT32_MAX)
+    return mqtt_publish_plain(hnd, topic, payload, len);
+
+  pthread_mutex_lock(&z->lock);
+  bound = MQTT_ZIP_HEAD + deflateBound(&z->def, (uLong) len);
+  if (!mqtt_zip_reserve((void **) &z->def_buf, &z->def_cap, bound) ||
+      deflateReset(&z->def) != Z_OK ||
+      deflateSetDictionary(&z->def, (const Bytef *) mqtt_zip_dict, sizeof(mqtt_zip_dict) - 1) != Z_OK)
+    goto zip_plain;
+
+  z->def.next_in   = (Bytef *) payload;
+  z->def.avail_in  = (uInt) len;
+  z->def.next_out  = z->def_buf + MQTT_ZIP_HEAD;
+  z->def.avail_out = (uInt) (bound - MQTT_ZIP_HEAD);
+  if (deflate(&z->def, Z_FINISH) != Z_STREAM_END || MQTT_ZIP_HEAD + z->def.total_out >= len)
+    goto zip_plain;  /* incompressible */
+
+  memcpy(z->def_buf, MQTT_ZIP_MAGIC, 4);
+  z->def_buf[4] = (unsigned char) (len >> 24);
+  z->def_buf[5] = (unsigned char) (len >> 16);
+  z->def_buf[6] = (unsigned char) (len >> 8);
+  z->def_buf[7] = (unsigned char) len;
+  result = mqtt_publish_plain(hnd, topic, z->def_buf, MQTT_ZIP_HEAD + z->def.total_out);
+  pthread_mutex_unlock(&z->lock);
+  return result;
+
+zip_plain:
+  pthread_mutex_unlock(&z->lock);
+  return mqtt_publish_plain(hnd, topic, payload, len);
+}
+
+int mqtt_zip_unpack(struct mqtt_handle * hnd, const struct mosquitto_message * msg, struct mosquitto_message * plain)
+{
+  struct mqtt_zip * z = hnd->zip;
+  const unsigned char * p = msg->payload;
+  size_t len;
+  int ret;
+
+  len = (size_t) p[4] << 24 | (size_t) p[5] << 16 | (size_t) p[6] << 8 | p[7];
+  if (len > MQTT_ZIP_PLAIN_MAX || !mqtt_zip_reserve((void **) &z->inf_buf, &z->inf_cap, len + 1))
+  {
+    LG_ERROR_RL("MQTT - Compressed message on %s too large (%zu bytes), dropped.", msg->topic, len);
+    return FALSE;
+  }
+  if (!z->inf_ready)
+  {
+    if (inflateInit2(&z->inf, -MAX_WBITS) != Z_OK)
+      return FALSE;
+    z->inf_ready = TRUE;
+  }
+  else
+    inflateReset(&z->inf);
+
+  inflateSetDictionary(&z->inf, (const Bytef *) mqtt_zip_dict, sizeof(mqtt_zip_dict) - 1);
+  z->inf.next_in   = (Bytef *) p + MQTT_ZIP_HEAD;
+  z->inf.avail_in  = (uInt) (msg->payloadlen - MQTT_ZIP_HEAD);
+  z->inf.next_out  = (Bytef *) z->inf_buf;
+  z->inf.avail_out = (uInt) len;
+  ret = inflate(&z->inf, Z_FINISH);
+  if (ret != Z_STREAM_END || z->inf.total_out != len)
+  {
+    LG_ERROR_RL("MQTT - Could not inflate message on %s (%s), dropped.", msg->topic, z->inf.msg ? z->inf.msg : "length mismatch");
+    return FALSE;
+  }
+  z->inf_buf[len] = '\0';
+
+  *plain            = *msg;
+  plain->payload    = z->inf_buf;
+  plain->payloadlen = (int) len;
+  return TRUE;
+}
+
+#else  /* LINUXTOOLS_WITH_ZLIB */
+
+int mqtt_zip_init(struct mqtt_handle * hnd)
+{
+  if (hnd->cfg->compress_min)
+    LG_WARN("MQTT - built without zlib, payloads are sent uncompressed.");
+  return TRUE;
+}
+
+void mqtt_zip_free(struct mqtt_handle * hnd)
+{
+  (void) hnd;
+}
+
+int mqtt_zip_publish(struct mqtt_handle * hnd, const char * topic, const void * payload, size_t len)
+{
+  return mqtt_publish_plain(hnd, topic, payload, len);
+}
+
+int mqtt_zip_unpack(struct mqtt_handle * hnd, const struct mosquitto_message * msg, struct mosquitto_message * plain)
+{
+  (void) hnd;
+  (void) plain;
+  LG_ERROR_RL("MQTT - Compressed message on %s, built without zlib - dropped.", msg->topic);
+  return FALSE;
+}
+
+#endif  /* LINUXTOOLS_WITH_ZLIB */
+
+int mqtt_zip_packed(const struct mosquitto_message * msg)
+{
+  return msg->payloadlen >= MQTT_ZIP_HEAD && memcmp(msg->payload, MQTT_ZIP_MAGIC, 4) == 0;
+}
@@ -1,21 +1,43 @@
+#include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <syslog.h>
 
 #include "logger.h"
+#include "logger_priv.h"
 #include "../stringhelp.h"
+#include "../timehelp.h"
 
-typedef void (*logfct)(const enum log_level ll, const char * format, va_list argp);
+#define LOG_BATCH_LEN 8192
+
+typedef void (*logfct)(const struct log_record * rec);
+typedef void (*logctlfct)(void);
+
+struct log_channel log_channel_global = { NULL, 0, 0, TRUE, NULL };
+
+static pthread_mutex_t      log_channel_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_channel * log_channels;
+static unsigned int         log_capture;   /* levels passed to log_push regardless of output levels */
 
 static struct logger_state
 {
-  size_t        level[LL_COUNT];
   logfct        fct;
+  logctlfct     commit;
+  logctlfct     flush;
+  enum ts_style ts_style;
 } log;
 
+static __thread struct log_batch
+{
+  FILE *        fd;
+  size_t        len;
+  char          buf[LOG_BATCH_LEN];
+} log_batch;
+
 const char * log_level_txt[] = {
    "NONE",
    "CRIT ",
@@ -50,38 +72,83 @@ const char * log_facility_txt [] = {
   "local4" ,
   "local5" ,
   "local6" ,
-  "local7"
+  "local7" ,
+  "file"   ,
+  "shm"
 };
 
-static void log_stdout_stderr(const enum log_level ll, const char * format, va_list ap)
+static void log_stdout_stderr_commit(void)
 {
-  static char tmp[MAX_LOG_LEN] = { '\0' };
-  static char tim[64];
-
-  FILE * fd;
-  struct tm * tm;
-  struct timespec tp;
-  size_t pos;
+  if (log_batch.len)
+  {
+    fwrite(log_batch.buf, 1, log_batch.len, log_batch.fd);
+    log_batch.len = 0;
+  }
+}
 
-  clock_gettime(CLOCK_REALTIME, &tp);
-  tm = localtime(&tp.tv_sec);
-  strftime(tim, sizeof(tim), "%d.%m.%y %H:%M:%S",tm);
+static void log_stdout_stderr_flush(void)
+{
+  log_stdout_stderr_commit();
+  fflush(stdout);
+  fflush(stderr);
+}
 
-  pos = vsnprintf(tmp, sizeof(tmp) - 1, format, ap);
+size_t log_format_line(const struct log_record * rec, char * out)
+{
+  size_t pos = 0;
+  size_t len;
 
-  if (pos < sizeof(tmp) - 2 && tmp[pos - 1] != '\r') {
-    tmp[pos] = '\n';
-    tmp[pos+1] = '\0';
+  out[pos++] = '[';
+  pos += ts_format(&rec->ts, log.ts_style, out + pos, LOG_TIME_LEN);
+  out[pos++] = ']';
+  out[pos++] = '[';
+  len = strlen(log_level_txt[rec->ll]);
+  memcpy(out + pos, log_level_txt[rec->ll], len);
+  pos += len;
+  out[pos++] = ']';
+  if (rec->channel)
+  {
+    len = strnlen(rec->channel, LOG_CHANNEL_LEN);  /* names are cut, see LOG_LINE_LEN */
+    out[pos++] = '[';
+    memcpy(out + pos, rec->channel, len);
+    pos += len;
+    out[pos++] = ']';
+  }
+  out[pos++] = ' ';
+  memcpy(out + pos, rec->msg, rec->len);
+  pos += rec->len;
+  if (rec->sdlen)
+  {
+    out[pos++] = ' ';
+    out[pos++] = '[';
+    memcpy(out + pos, rec->sd, rec->sdlen);
+    pos += rec->sdlen;
+    out[pos++] = ']';
   }
+  if (rec->len == 0 || rec->msg[rec->len - 1] != '\r')
+    out[pos++] = '\n';
+  return pos;
+}
 
-  switch (ll)
+static void log_stdout_stderr(const struct log_record * rec)
+{
+  FILE * fd;
+
+  switch (rec->ll)
   {
     case LL_CRITICAL:
     case LL_ERROR   :
     case LL_WARN    : fd = stderr; break;
     default         : fd = stdout; break;
   }
-  fprintf (fd, "[%s.%06ld][%s] %s", tim, tp.tv_nsec / 1000, log_level_txt[ll], tmp);
+
+  if (fd != log_batch.fd || log_batch.len + LOG_LINE_LEN > sizeof(log_batch.buf))
+  {
+    log_stdout_stderr_commit();
+    log_batch.fd = fd;
+  }
+
+  log_batch.len += log_format_line(rec, log_batch.buf + log_batch.len);
 }
 
 
@@ -99,9 +166,15 @@ const int ll_translation[LL_COUNT] =
   LOG_DEBUG    /*  LL_DEBUG_MAX   */
 };
 
-static void log_syslog(const enum log_level ll, const char * format, va_list ap)
+static void log_syslog(const struct log_record * rec)
 {
-  vsyslog(ll_translation[ll], format, ap);
+  const char * sd_open  = rec->sdlen ? " [" : "";
+  const char * sd_close = rec->sdlen ? "]"  : "";
+
+  if (rec->channel)
+    syslog(ll_translation[rec->ll], "[%s] %s%s%s%s", rec->channel, rec->msg, sd_open, rec->sd, sd_close);
+  else
+    syslog(ll_translation[rec->ll], "%s%s%s%s", rec->msg, sd_open, rec->sd, sd_close);
 }
 
 const int lf_translation[LF_COUNT] =
@@ -115,50 +188,209 @@ const int lf_translation[LF_COUNT] =
   LOG_LOCAL5  , /*  LF_LOCAL5   reserved for local use */
   LOG_LOCAL6  , /*  LF_LOCAL6   reserved for local use */
   LOG_LOCAL7  , /*  LF_LOCAL7   reserved for local use */
+  0           , /*  LF_FILE     not a syslog facility */
+  0           , /*  LF_SHM      not a syslog facility */
 };
 
 
+/* caller holds log_channel_lock */
+static void log_channel_update(struct log_channel * ch, unsigned int levels)
+{
+  __atomic_store_n(&ch->levels, levels, __ATOMIC_RELAXED);
+  __atomic_store_n(&ch->mask, levels | log_capture, __ATOMIC_RELAXED);
+}
+
+static void log_channel_set_state(struct log_channel * ch, enum log_level ll, size_t active)
+{
+  unsigned int levels = ch->levels;
+
+  if (active)
+  {
+    if (ll >= LL_COUNT)
+      ll = (enum log_level) (LL_COUNT - 1);
+    levels |= (2u << ll) - 1;
+  }
+  else if (ll < LL_COUNT)
+    levels &= ~(1u << ll);
+  log_channel_update(ch, levels);
+}
+
+static void log_channel_propagate(void)
+{
+  for (struct log_channel * ch = log_channels; ch; ch = ch->next)
+    log_channel_update(ch, ch->own ? ch->levels : log_channel_global.levels);
+}
+
+void log_set_capture_levels(unsigned int levels)
+{
+  pthread_mutex_lock(&log_channel_lock);
+  log_capture = levels;
+  log_channel_update(&log_channel_global, log_channel_global.levels);
+  log_channel_propagate();
+  pthread_mutex_unlock(&log_channel_lock);
+}
+
 void log_init(const char * ident, enum log_facility facility, enum log_level default_ll)
 {
+  const char * fail = "";
+  int native = (facility & LF_NATIVE) != 0;
+
+  facility = (enum log_facility) (facility & ~LF_NATIVE);
+
   memset(&log,0,sizeof(log));
+  pthread_mutex_lock(&log_channel_lock);
+  log_channel_update(&log_channel_global, 0);
+  pthread_mutex_unlock(&log_channel_lock);
   log_set_level_state(default_ll, TRUE);
 
-  if (facility > LF_STDOUT && facility < LF_COUNT && ident)
+  if (facility == LF_FILE)
   {
-    openlog(ident, 0, lf_translation[facility - 1]);
-    log.fct = log_syslog;
+    if (log_file_open(ident))
+    {
+      log.fct    = log_file_write;
+      log.commit = log_file_commit;
+      log.flush  = log_file_flush;
+      return;
+    }
+    fail = "Could not open log file";
   }
-  else
+  else if (facility == LF_SHM)
+  {
+    if (log_shm_open(ident))
+    {
+      log.fct = log_shm_write;
+      return;
+    }
+    fail = "Could not map shared memory log ring";
+  }
+  else if (facility > LF_STDOUT && facility < LF_FILE && ident && native)
   {
-    if (facility != LF_STDOUT)
+    if (log_syslog_open(ident, lf_translation[facility - 1]))
     {
-      const char * fac_name = facility >= LF_COUNT ? "invalid" : log_facility_txt[facility];
-      const char * ident_name = ident == NULL ? "unknown" : ident;
-      log_push(LL_WARN, "Logging via STDOUT/STDERR. %s facility and %s ident not feasible.", fac_name, ident_name);
+      log.fct    = log_syslog_write;
+      log.commit = log_syslog_commit;
+      log.flush  = log_syslog_commit;
+      return;
     }
-    log.fct = log_stdout_stderr;
+    fail = "Could not open syslog socket";
+  }
+  else if (facility > LF_STDOUT && facility < LF_FILE && ident)
+  {
+    openlog(ident, 0, lf_translation[facility - 1]);
+    log.fct = log_syslog;
+    return;
+  }
+
+  log.fct    = log_stdout_stderr;
+  log.commit = log_stdout_stderr_commit;
+  log.flush  = log_stdout_stderr_flush;
+
+  if (facility != LF_STDOUT)
+  {
+    const char * fac_name = facility >= LF_COUNT ? "invalid" : log_facility_txt[facility];
+    const char * ident_name = ident == NULL ? "unknown" : ident;
+    log_push(LL_WARN, "Logging via STDOUT/STDERR. %s facility and %s ident not feasible. %s", fac_name, ident_name, fail);
   }
 }
 
+void log_set_time_style(enum ts_style style)
+{
+  if (style >= 0 && style < TS_COUNT)
+    log.ts_style = style;
+}
+
+static struct log_channel * log_channel_find(const char * name)
+{
+  struct log_channel * ch;
+  for (ch = log_channels; ch; ch = ch->next)
+    if (stricmp(ch->name, name) == 0)
+      break;
+  return ch;
+}
+
 void log_set_level_state(enum log_level ll, size_t active)
 {
   if (ll < LL_NONE)
     return;
-  if (active)
+
+  pthread_mutex_lock(&log_channel_lock);
+  log_channel_set_state(&log_channel_global, ll, active);
+  log_channel_propagate();
+  pthread_mutex_unlock(&log_channel_lock);
+}
+
+int log_get_level_state(enum log_level ll)
+{
+  return ll < 0 || ll >= LL_COUNT ? FALSE : (log_channel_output(&log_channel_global, ll) != 0);
+}
+
+void log_channel_register(struct log_channel * ch)
+{
+  if (ch == NULL || ch->name == NULL)
+    return;
+
+  pthread_mutex_lock(&log_channel_lock);
+  for (struct log_channel * c = log_channels; c; c = c->next)
+    if (c == ch)
+      goto register_end;
+  ch->own  = FALSE;
+  log_channel_update(ch, log_channel_global.levels);
+  ch->next = log_channels;
+  log_channels = ch;
+register_end:
+  pthread_mutex_unlock(&log_channel_lock);
+}
+
+int log_set_channel_level_state(const char * name, enum log_level ll, size_t active)
+{
+  struct log_channel * ch;
+
+  if (name == NULL || ll < LL_NONE)
+    return FALSE;
+
+  pthread_mutex_lock(&log_channel_lock);
+  ch = log_channel_find(name);
+  if (ch)
   {
-    if (ll >= ARRLEN(log.level))
-      ll = (enum log_level) (LL_COUNT - 1);
-    do {
-      log.level[ll] = TRUE;
-    } while (ll-- != LL_NONE);
+    ch->own = TRUE;
+    log_channel_set_state(ch, ll, active);
   }
-  else if (ll < ARRLEN(log.level))
-    log.level[ll] = FALSE;
+  pthread_mutex_unlock(&log_channel_lock);
+  return ch != NULL;
 }
 
-int log_get_level_state(enum log_level ll)
+int log_get_channel_level_state(const char * name, enum log_level ll)
+{
+  struct log_channel * ch;
+  int state = FALSE;
+
+  if (name == NULL || ll < 0 || ll >= LL_COUNT)
+    return FALSE;
+
+  pthread_mutex_lock(&log_channel_lock);
+  ch = log_channel_find(name);
+  if (ch)
+    state = log_channel_output(ch, ll) != 0;
+  pthread_mutex_unlock(&log_channel_lock);
+  return state;
+}
+
+int log_reset_channel(const char * name)
 {
-  return ll < 0 || ll >= ARRLEN(log.level) ? FALSE : log.level[ll];
+  struct log_channel * ch;
+
+  if (name == NULL)
+    return FALSE;
+
+  pthread_mutex_lock(&log_channel_lock);
+  ch = log_channel_find(name);
+  if (ch)
+  {
+    ch->own = FALSE;
+    log_channel_update(ch, log_channel_global.levels);
+  }
+  pthread_mutex_unlock(&log_channel_lock);
+  return ch != NULL;
 }
 
 const char * log_get_level_name(enum log_level ll, int do_fulltext)
@@ -178,37 +410,199 @@ enum log_level log_get_level_no(const char * level)
   return LL_NONE;
 }
 
+/* "native:local0" selects the native syslog sink for local0 */
 enum log_facility log_get_facility(const char * facility)
 {
+  int native = 0;
+
+  if (strncasecmp(facility, "native:", 7) == 0)
+  {
+    facility += 7;
+    native = LF_NATIVE;
+  }
+
   for (size_t i = 0; i < ARRLEN(log_facility_txt); i++)
   {
     if (stricmp(log_facility_txt[i], facility) == 0)
-      return (enum log_facility) i;
+      return (enum log_facility) (i | native);
   }
   return LF_COUNT;
 }
 
 const char * log_get_facility_name(enum log_facility lf)
 {
+  lf = (enum log_facility) (lf & ~LF_NATIVE);
   if  (lf >= 0 && lf < ARRLEN(log_facility_txt))
     return log_facility_txt[lf];
   return NULL;
 }
 
 
-void log_push(const enum log_level ll, const char * format, ...)
+static size_t log_field_put(char * out, size_t pos, size_t end, char c)
+{
+  if (pos < end)
+    out[pos] = c;
+  return pos + 1;
+}
+
+static void log_record_fields(struct log_record * rec, const struct log_field * fields, size_t count)
+{
+  const size_t end = sizeof(rec->sd) - 1;
+  size_t pos = 0;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    const char * key = fields[i].key;
+    const char * val = fields[i].value ? fields[i].value : "";
+    size_t start = pos;
+    size_t keylen = 0;
+
+    if (key == NULL)
+      continue;
+    if (pos)
+      pos = log_field_put(rec->sd, pos, end, ' ');
+    for (; *key && keylen < 32; key++)
+    {
+      /* RFC5424 PARAM-NAME */
+      if (*key <= ' ' || *key >= 0x7f || *key == '=' || *key == ']' || *key == '"')
+        continue;
+      pos = log_field_put(rec->sd, pos, end, *key);
+      ++keylen;
+    }
+    pos = log_field_put(rec->sd, pos, end, '=');
+    pos = log_field_put(rec->sd, pos, end, '"');
+    for (; *val; val++)
+    {
+      if (*val == '"' || *val == '\\' || *val == ']')
+        pos = log_field_put(rec->sd, pos, end, '\\');
+      pos = log_field_put(rec->sd, pos, end, *val);
+    }
+    pos = log_field_put(rec->sd, pos, end, '"');
+
+    if (keylen == 0 || pos > end)
+      pos = start;
+  }
+  rec->sd[pos] = '\0';
+  rec->sdlen   = (unsigned int) pos;
+}
+
+void log_record_format(struct log_record * rec, const struct log_channel * ch, enum log_level ll,
+                       const struct log_field * fields, size_t count, const char * format, va_list ap)
+{
+  int len;
+
+  clock_gettime(CLOCK_REALTIME, &rec->ts);
+  rec->ll      = ll;
+  rec->channel = ch && ch != &log_channel_global ? ch->name : NULL;
+  len = vsnprintf(rec->msg, sizeof(rec->msg), format, ap);
+  if (len < 0)
+  {
+    rec->msg[0] = '\0';
+    len = 0;
+  }
+  rec->len = len < ssizeof(rec->msg) ? (unsigned int) len : sizeof(rec->msg) - 1;
+  log_record_fields(rec, fields, count);
+  log_stats_record(ll, rec->len + rec->sdlen);
+}
+
+void log_sink_write(const struct log_record * rec)
+{
+  uint64_t start;
+
+  if (log.fct)
+  {
+    start = log_stats_clock();
+    log.fct(rec);
+    log_stats_time(&log_stats_live.write_ns, start);
+  }
+}
+
+void log_sink_commit(void)
 {
-  if (ll >= 0 && ll < LL_COUNT && log.level[ll] && log.fct)
+  uint64_t start;
+
+  if (log.commit)
   {
-    va_list ap;
-    va_start(ap, format);
-    log.fct(ll, format, ap);
-    va_end(ap);
+    start = log_stats_clock();
+    log.commit();
+    log_stats_time(&log_stats_live.commit_ns, start);
   }
 }
 
+void log_sink_flush(void)
+{
+  if (log.flush)
+    log.flush();
+  log_bin_flush();
+}
+
+
+void log_push(const enum log_level ll, const char * format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  log_push_ch_v(&log_channel_global, ll, format, ap);
+  va_end(ap);
+}
+
 void log_push_v(const enum log_level ll, const char * format, va_list argp)
 {
-  if (ll >= 0 && ll < LL_COUNT && log.level[ll] && log.fct)
-    log.fct(ll, format, argp);
+  log_push_ch_v(&log_channel_global, ll, format, argp);
+}
+
+void log_push_ch(struct log_channel * ch, const enum log_level ll, const char * format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  log_push_ch_v(ch, ll, format, ap);
+  va_end(ap);
+}
+
+void log_push_ch_v(struct log_channel * ch, const enum log_level ll, const char * format, va_list argp)
+{
+  log_push_ch_fields_v(ch, ll, NULL, 0, format, argp);
+}
+
+void log_push_fields(const enum log_level ll, const struct log_field * fields, size_t count, const char * format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  log_push_ch_fields_v(&log_channel_global, ll, fields, count, format, ap);
+  va_end(ap);
+}
+
+void log_push_ch_fields(struct log_channel * ch, const enum log_level ll, const struct log_field * fields, size_t count,
+                        const char * format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  log_push_ch_fields_v(ch, ll, fields, count, format, ap);
+  va_end(ap);
+}
+
+void log_push_ch_fields_v(struct log_channel * ch, const enum log_level ll, const struct log_field * fields, size_t count,
+                          const char * format, va_list argp)
+{
+  struct log_record rec;
+  uint64_t start;
+
+  if (ch == NULL)
+    ch = &log_channel_global;
+
+  if (ll < 0 || ll >= LL_COUNT)
+    return;
+
+  log_flightrec_push(ch, ll, format, argp);
+
+  if (!log_channel_output(ch, ll) || !log.fct)
+    return;
+
+  start = log_stats_clock();
+  if (!log_bin_push(ch, ll, format, argp) && !log_async_push(ch, ll, fields, count, format, argp))
+  {
+    log_record_format(&rec, ch, ll, fields, count, format, argp);
+    log_sink_write(&rec);
+    log_sink_commit();
+  }
+  log_stats_time(&log_stats_live.call_ns, start);
 }
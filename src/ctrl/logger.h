@@ -4,7 +4,9 @@
 #include <stdarg.h>
 #include <stddef.h>
 
+#include "../stathelp.h"
 #include "../stuff.h"
+#include "../timehelp.h"
 
 enum log_level
 {
@@ -33,22 +35,221 @@ enum log_facility
   LF_LOCAL5       , /* reserved for local use */
   LF_LOCAL6       , /* reserved for local use */
   LF_LOCAL7       , /* reserved for local use */
+  LF_FILE         , /* buffered log file with rotation, see log_set_file_config */
+  LF_SHM          , /* POSIX shm ring drained by linuxtools_logcollect, see log_set_shm_config */
 
-  LF_COUNT
+  LF_COUNT,
+
+  LF_NATIVE = 0x100 /* or'ed to a syslog facility: RFC5424 datagrams straight to /dev/log instead of syslog(3) */
+};
+
+enum log_fsync
+{
+  LFS_NONE,     /* leave it to the kernel */
+  LFS_ROTATE,   /* fsync before a file is rotated or closed */
+  LFS_INTERVAL, /* additionally fsync at most every fsync_interval seconds */
+
+  LFS_COUNT
+};
+
+struct log_file_config
+{
+  const char *   path;            /* NULL: <ident>.log */
+  size_t         buffer_size;     /* userspace buffer in bytes, 0: 64 KiB */
+  unsigned int   flush_ms;        /* max. age of buffered lines, 0: 1000 */
+  size_t         max_size;        /* rotate when the file would grow beyond, 0: never */
+  unsigned int   max_age;         /* rotate after seconds, 0: never */
+  unsigned int   keep;            /* rotated files kept as <path>.1 .. <path>.<keep> */
+  enum log_fsync fsync;
+  unsigned int   fsync_interval;  /* seconds, LFS_INTERVAL only */
+};
+
+enum log_overflow
+{
+  LO_BLOCK,       /* producer waits until the writer made room */
+  LO_DROP_NEWEST, /* record to be pushed is discarded */
+  LO_DROP_OLDEST, /* oldest queued record is discarded */
+
+  LO_COUNT
+};
+
+/* counters are kept always, latencies (ns) only after log_set_stats_latency(TRUE) */
+struct log_stats
+{
+  unsigned long long records[LL_COUNT];  /* records formatted or packed for output */
+  unsigned long long bytes[LL_COUNT];    /* message bytes, packed bytes in binary mode */
+  unsigned long long dropped_newest;     /* async ring overflow */
+  unsigned long long dropped_oldest;
+  unsigned long long suppressed;         /* records held back by rate limited call sites */
+  unsigned long long dropped_shm;        /* LF_SHM ring full */
+  struct stat_hist   call_ns;            /* log_push* calls passing the level gate */
+  struct stat_hist   write_ns;           /* sink write of one record */
+  struct stat_hist   commit_ns;          /* sink commit - hand-off of a batch to the OS */
+};
+
+#define LOG_SHM_NAME      "/linuxtools-log"
+#define LOG_SHM_PROCS     64  /* processes with counters of their own */
+#define LOG_SHM_IDENT_LEN 32
+
+/* a process writing to the shm ring, as seen by the collector */
+struct log_shm_proc_stats
+{
+  unsigned int       slot;
+  int                pid;    /* in the pid namespace of the process */
+  int                alive;  /* still holds its table entry */
+  char               ident[LOG_SHM_IDENT_LEN];
+  unsigned long long written;
+  unsigned long long dropped;  /* ring full */
 };
 
 #ifndef MAX_LOG_LEN
 #define MAX_LOG_LEN 256
 #endif
 
-#define LG_DBGMX(FORMAT, ...) log_push(LL_DEBUG_MAX, FORMAT, ##__VA_ARGS__)
-#define LG_DBGMR(FORMAT, ...) log_push(LL_DEBUG_MORE, FORMAT, ##__VA_ARGS__)
-#define LG_DEBUG(FORMAT, ...) log_push(LL_DEBUG, FORMAT, ##__VA_ARGS__)
-#define LG_EVENT(FORMAT, ...) log_push(LL_EVENT, FORMAT, ##__VA_ARGS__)
-#define LG_INFO(FORMAT, ... ) log_push(LL_INFO, FORMAT, ##__VA_ARGS__)
-#define LG_WARN(FORMAT, ...) log_push(LL_WARN, FORMAT, ##__VA_ARGS__)
-#define LG_ERROR(FORMAT, ...) log_push(LL_ERROR, FORMAT, ##__VA_ARGS__)
-#define LG_CRITICAL(FORMAT, ...) log_push(LL_CRITICAL, FORMAT, ##__VA_ARGS__)
+/*
+ * Log channels carry their own level mask. As long as no level was set for a
+ * channel explicitly it follows the global levels. A translation unit selects
+ * its channel for the LG_* macros by defining LOG_CURRENT_CHANNEL before
+ * including this header, e.g.
+ *
+ *   #define LOG_CURRENT_CHANNEL (&log_ch_mqtt)
+ *   #include "logger.h"
+ *   static LOG_CHANNEL(log_ch_mqtt, "mqtt");
+ */
+struct log_channel
+{
+  const char *         name;
+  unsigned int         mask;    /* level gate read at the call site: output levels + captured levels */
+  unsigned int         levels;  /* output levels */
+  int                  own;     /* levels were set for this channel */
+  struct log_channel * next;
+};
+
+/*
+ * Structured data of a record. The native syslog sink sends the fields as an
+ * RFC5424 SD-ELEMENT, text sinks append them to the line, binary mode and the
+ * flight recorder leave them out. Keys are cut to 32 printable characters,
+ * fields not fitting into a record are dropped.
+ */
+struct log_field
+{
+  const char * key;
+  const char * value;
+};
+
+#define LOG_CHANNEL(VAR, NAME) \
+  struct log_channel VAR = { NAME, 0, 0, FALSE, NULL }; \
+  static void __attribute__((constructor)) VAR##_register(void) { log_channel_register(&VAR); }
+
+extern struct log_channel log_channel_global;
+
+#ifndef LOG_CURRENT_CHANNEL
+#define LOG_CURRENT_CHANNEL (&log_channel_global)
+#endif
+
+/*
+ * LINUXTOOLS_MIN_LOG_LEVEL is the numeric value of the most verbose log level
+ * compiled in (LL_NONE = 0 ... LL_DEBUG_MAX = 8). LG_* macros of more verbose
+ * levels expand to nothing - their arguments are not evaluated. Levels still
+ * compiled in are gated at the call site by one relaxed load of the channel's
+ * level mask.
+ */
+#ifndef LINUXTOOLS_MIN_LOG_LEVEL
+#define LINUXTOOLS_MIN_LOG_LEVEL 8
+#endif
+
+#define log_channel_enabled(CH, LL) (__atomic_load_n(&(CH)->mask, __ATOMIC_RELAXED) & (1u << (LL)))
+#define log_level_enabled(LL) log_channel_enabled(&log_channel_global, LL)
+
+#define LGC_LOG(CH, LL, FORMAT, ...) (log_channel_enabled(CH, LL) ? log_push_ch(CH, LL, FORMAT, ##__VA_ARGS__) : (void) 0)
+#define LG_LOG(LL, FORMAT, ...) LGC_LOG(LOG_CURRENT_CHANNEL, LL, FORMAT, ##__VA_ARGS__)
+#define LGC_LOG_FIELDS(CH, LL, FIELDS, COUNT, FORMAT, ...) \
+  ((LL) <= LINUXTOOLS_MIN_LOG_LEVEL && log_channel_enabled(CH, LL) ? \
+   log_push_ch_fields(CH, LL, FIELDS, COUNT, FORMAT, ##__VA_ARGS__) : (void) 0)
+#define LG_LOG_FIELDS(LL, FIELDS, COUNT, FORMAT, ...) LGC_LOG_FIELDS(LOG_CURRENT_CHANNEL, LL, FIELDS, COUNT, FORMAT, ##__VA_ARGS__)
+#define LG_OFF(LL, FORMAT, ...) (0 ? log_push_ch(LOG_CURRENT_CHANNEL, LL, FORMAT, ##__VA_ARGS__) : (void) 0)
+
+#if LINUXTOOLS_MIN_LOG_LEVEL >= 8
+#  define LG_DBGMX(FORMAT, ...) LG_LOG(LL_DEBUG_MAX, FORMAT, ##__VA_ARGS__)
+#else
+#  define LG_DBGMX(FORMAT, ...) LG_OFF(LL_DEBUG_MAX, FORMAT, ##__VA_ARGS__)
+#endif
+#if LINUXTOOLS_MIN_LOG_LEVEL >= 7
+#  define LG_DBGMR(FORMAT, ...) LG_LOG(LL_DEBUG_MORE, FORMAT, ##__VA_ARGS__)
+#else
+#  define LG_DBGMR(FORMAT, ...) LG_OFF(LL_DEBUG_MORE, FORMAT, ##__VA_ARGS__)
+#endif
+#if LINUXTOOLS_MIN_LOG_LEVEL >= 6
+#  define LG_DEBUG(FORMAT, ...) LG_LOG(LL_DEBUG, FORMAT, ##__VA_ARGS__)
+#else
+#  define LG_DEBUG(FORMAT, ...) LG_OFF(LL_DEBUG, FORMAT, ##__VA_ARGS__)
+#endif
+#if LINUXTOOLS_MIN_LOG_LEVEL >= 5
+#  define LG_EVENT(FORMAT, ...) LG_LOG(LL_EVENT, FORMAT, ##__VA_ARGS__)
+#else
+#  define LG_EVENT(FORMAT, ...) LG_OFF(LL_EVENT, FORMAT, ##__VA_ARGS__)
+#endif
+#if LINUXTOOLS_MIN_LOG_LEVEL >= 4
+#  define LG_INFO(FORMAT, ... ) LG_LOG(LL_INFO, FORMAT, ##__VA_ARGS__)
+#else
+#  define LG_INFO(FORMAT, ... ) LG_OFF(LL_INFO, FORMAT, ##__VA_ARGS__)
+#endif
+#if LINUXTOOLS_MIN_LOG_LEVEL >= 3
+#  define LG_WARN(FORMAT, ...) LG_LOG(LL_WARN, FORMAT, ##__VA_ARGS__)
+#else
+#  define LG_WARN(FORMAT, ...) LG_OFF(LL_WARN, FORMAT, ##__VA_ARGS__)
+#endif
+#if LINUXTOOLS_MIN_LOG_LEVEL >= 2
+#  define LG_ERROR(FORMAT, ...) LG_LOG(LL_ERROR, FORMAT, ##__VA_ARGS__)
+#else
+#  define LG_ERROR(FORMAT, ...) LG_OFF(LL_ERROR, FORMAT, ##__VA_ARGS__)
+#endif
+#if LINUXTOOLS_MIN_LOG_LEVEL >= 1
+#  define LG_CRITICAL(FORMAT, ...) LG_LOG(LL_CRITICAL, FORMAT, ##__VA_ARGS__)
+#else
+#  define LG_CRITICAL(FORMAT, ...) LG_OFF(LL_CRITICAL, FORMAT, ##__VA_ARGS__)
+#endif
+
+/*
+ * Rate limited variants: every call site owns a token bucket of LOG_RL_BURST
+ * records refilled by one token per LOG_RL_INTERVAL_MS. Records beyond are
+ * counted and reported as "last message repeated N times" once the site
+ * passes again.
+ */
+#ifndef LOG_RL_BURST
+#define LOG_RL_BURST       5
+#endif
+#ifndef LOG_RL_INTERVAL_MS
+#define LOG_RL_INTERVAL_MS 2000
+#endif
+
+struct log_ratelimit
+{
+  unsigned long long state;      /* refill time in ms << 16 | tokens */
+  unsigned int       suppressed;
+};
+
+#define LGC_LOG_RL(CH, LL, FORMAT, ...) \
+  do { \
+    static struct log_ratelimit log_rl_site_; \
+    unsigned int log_rl_suppressed_; \
+    if ((LL) <= LINUXTOOLS_MIN_LOG_LEVEL && log_channel_enabled(CH, LL) && \
+        log_ratelimit_pass(&log_rl_site_, LOG_RL_BURST, LOG_RL_INTERVAL_MS, &log_rl_suppressed_)) \
+    { \
+      if (log_rl_suppressed_) \
+        log_push_ch(CH, LL, "last message repeated %u times", log_rl_suppressed_); \
+      log_push_ch(CH, LL, FORMAT, ##__VA_ARGS__); \
+    } \
+  } while (0)
+
+#define LG_LOG_RL(LL, FORMAT, ...) LGC_LOG_RL(LOG_CURRENT_CHANNEL, LL, FORMAT, ##__VA_ARGS__)
+
+#define LG_DEBUG_RL(FORMAT, ...)    LG_LOG_RL(LL_DEBUG, FORMAT, ##__VA_ARGS__)
+#define LG_EVENT_RL(FORMAT, ...)    LG_LOG_RL(LL_EVENT, FORMAT, ##__VA_ARGS__)
+#define LG_INFO_RL(FORMAT, ...)     LG_LOG_RL(LL_INFO, FORMAT, ##__VA_ARGS__)
+#define LG_WARN_RL(FORMAT, ...)     LG_LOG_RL(LL_WARN, FORMAT, ##__VA_ARGS__)
+#define LG_ERROR_RL(FORMAT, ...)    LG_LOG_RL(LL_ERROR, FORMAT, ##__VA_ARGS__)
+#define LG_CRITICAL_RL(FORMAT, ...) LG_LOG_RL(LL_CRITICAL, FORMAT, ##__VA_ARGS__)
 
 #ifdef __cplusplus
 extern "C"
@@ -57,6 +258,10 @@ extern "C"
 
   void log_init(const char * ident, enum log_facility facility, enum log_level ll);
   void log_set_level_state(enum log_level ll, size_t active);
+  void log_set_time_style(enum ts_style style);
+  void log_set_file_config(const struct log_file_config * cfg);  /* before log_init(.., LF_FILE, ..) */
+  void log_set_syslog_socket(const char * path);                 /* before log_init(.., LF_NATIVE | .., ..), NULL: /dev/log */
+  void log_set_shm_config(const char * name, size_t slots);      /* before log_init(.., LF_SHM, ..), NULL: LOG_SHM_NAME, 0: 4096 */
   int  log_get_level_state(enum log_level ll);
 
   enum log_level log_get_level_no(const char * level);
@@ -67,6 +272,49 @@ extern "C"
 
   void log_push(const enum log_level ll, const char * format, ...)__attribute__((format(gnu_printf, 2, 3)));
   void log_push_v(const enum log_level ll, const char * format, va_list argp);
+  void log_push_ch(struct log_channel * ch, const enum log_level ll, const char * format, ...)__attribute__((format(gnu_printf, 3, 4)));
+  void log_push_ch_v(struct log_channel * ch, const enum log_level ll, const char * format, va_list argp);
+  void log_push_fields(const enum log_level ll, const struct log_field * fields, size_t count, const char * format, ...)__attribute__((format(gnu_printf, 4, 5)));
+  void log_push_ch_fields(struct log_channel * ch, const enum log_level ll, const struct log_field * fields, size_t count,
+                          const char * format, ...)__attribute__((format(gnu_printf, 5, 6)));
+  void log_push_ch_fields_v(struct log_channel * ch, const enum log_level ll, const struct log_field * fields, size_t count,
+                            const char * format, va_list argp);
+
+  int  log_ratelimit_pass(struct log_ratelimit * rl, unsigned int burst, unsigned int interval_ms, unsigned int * suppressed);
+
+  /* log channels - levels of a channel set here no longer follow the global ones until reset */
+  void log_channel_register(struct log_channel * ch);
+  int  log_set_channel_level_state(const char * name, enum log_level ll, size_t active);
+  int  log_get_channel_level_state(const char * name, enum log_level ll);
+  int  log_reset_channel(const char * name);
+
+  /* self-instrumentation - a snapshot may be taken while logging goes on */
+  void log_set_stats_latency(int active);
+  void log_get_stats(struct log_stats * stats);
+  void log_reset_stats(void);
+
+  /* asynchronous mode - records are queued in a lock-free ring and written by a background thread */
+  int  log_async_start(size_t capacity, enum log_overflow policy);
+  void log_async_stop(void);
+  void log_get_async_drops(unsigned long * dropped_newest, unsigned long * dropped_oldest);
+  void log_flush(void);
+
+  /* binary mode - records keep the format pointer and the packed arguments, decode with linuxtools_logdecode */
+  int  log_binary_open(const char * path);
+  void log_binary_close(void);
+
+  /* flight recorder - all levels go to an in-memory ring, dumped (binary log) on SIGSEGV/SIGABRT/SIGUSR1 */
+  int  log_flightrec_start(size_t records, const char * dump_path);  /* dump_path NULL: stderr */
+  void log_flightrec_stop(void);
+  void log_flightrec_dump(int fd);
+  int  log_flightrec_altstack(void);  /* signal stack for the dump of a stack overflow in the calling thread */
+
+  /* shm collector - records of LF_SHM processes go to the sink of this process' log_init, see linuxtools_logcollect */
+  int    log_shm_collect_open(const char * name, size_t slots);  /* creates the ring or attaches to it */
+  size_t log_shm_collect(size_t max);                            /* returns the number of records written */
+  size_t log_shm_get_procs(struct log_shm_proc_stats * procs, size_t count, unsigned long long * orphan_dropped);
+  size_t log_shm_reap(void);                                     /* frees entries of exited processes */
+  void   log_shm_collect_close(int unlink);
 
 #ifdef __cplusplus
 }
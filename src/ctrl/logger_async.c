@@ -0,0 +1,282 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "logger_priv.h"
+#include "../ringhelp.h"
+
+#define LOG_ASYNC_BATCH     64
+#define LOG_ASYNC_IDLE_MS   100
+
+static struct log_async_state
+{
+  struct ring *        ring;
+  void *               mem;
+  enum log_overflow    policy;
+  pthread_t            writer;
+  atomic_int           active;
+  atomic_int           users;           /* producers currently inside log_async_push */
+  atomic_int           running;
+  atomic_int           idle;
+  atomic_uint          wake_seq;
+  atomic_uint          space_seq;       /* bumped by the writer after releasing slots */
+  atomic_int           blocked;         /* LO_BLOCK producers waiting for space */
+  atomic_uint_fast64_t completed;       /* records written or dropped from the ring */
+  atomic_ulong         dropped_newest;
+  atomic_ulong         dropped_oldest;
+  unsigned long        reported;        /* drops already announced by the writer */
+} las;
+
+static void log_async_futex_wait(atomic_uint * addr, unsigned int val, long ms)
+{
+  struct timespec to = { ms / 1000, (ms % 1000) * 1000000L };
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &to, NULL, 0);
+}
+
+static void log_async_wake(void)
+{
+  atomic_fetch_add(&las.wake_seq, 1);
+  syscall(SYS_futex, &las.wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* writer: slots were released - no syscall unless a producer waits */
+static void log_async_space(void)
+{
+  atomic_fetch_add(&las.space_seq, 1);
+  if (atomic_load(&las.blocked))
+    syscall(SYS_futex, &las.space_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * LO_BLOCK: sleeps until the writer released slots. A producer counts as
+ * blocked before it takes the sequence and tries once more, so a release
+ * after that try either changes the sequence or wakes it.
+ */
+static struct log_record * log_async_wait_space(void)
+{
+  struct log_record * rec;
+  unsigned int seq;
+
+  atomic_fetch_add(&las.blocked, 1);
+  seq = atomic_load(&las.space_seq);
+  rec = ring_reserve(las.ring);
+  if (rec == NULL)
+  {
+    if (atomic_load(&las.idle))
+      log_async_wake();
+    log_async_futex_wait(&las.space_seq, seq, LOG_ASYNC_IDLE_MS);
+  }
+  atomic_fetch_sub(&las.blocked, 1);
+  return rec;
+}
+
+static void log_async_report_drops(void)
+{
+  unsigned long dropped = atomic_load_explicit(&las.dropped_newest, memory_order_relaxed)
+                        + atomic_load_explicit(&las.dropped_oldest, memory_order_relaxed);
+  struct log_record rec;
+
+  if (dropped == las.reported)
+    return;
+
+  clock_gettime(CLOCK_REALTIME, &rec.ts);
+  rec.ll  = LL_WARN;
+  rec.channel = NULL;
+  rec.sdlen = 0;
+  rec.sd[0] = '\0';
+  rec.len = snprintf(rec.msg, sizeof(rec.msg), "LOG - ring overflow, %lu record(s) dropped.", dropped - las.reported);
+  if (rec.len >= sizeof(rec.msg))
+    rec.len = sizeof(rec.msg) - 1;
+  las.reported = dropped;
+  log_sink_write(&rec);
+}
+
+static size_t log_async_drain(void)
+{
+  struct log_record * rec;
+  size_t n = 0;
+
+  while (n < LOG_ASYNC_BATCH && (rec = ring_acquire(las.ring)) != NULL)
+  {
+    log_sink_write(rec);
+    ring_release(las.ring, rec);
+    ++n;
+  }
+  if (n)
+  {
+    log_async_space();
+    log_async_report_drops();
+    log_sink_commit();
+    atomic_fetch_add_explicit(&las.completed, n, memory_order_release);
+  }
+  return n;
+}
+
+static void * log_async_writer(void * arg)
+{
+  unsigned int seq;
+  (void) arg;
+
+  for (;;)
+  {
+    if (log_async_drain())
+      continue;
+
+    seq = atomic_load(&las.wake_seq);
+    atomic_store(&las.idle, TRUE);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (log_async_drain() == 0)
+    {
+      if (!atomic_load(&las.running))
+      {
+        atomic_store(&las.idle, FALSE);
+        break;
+      }
+      log_sink_flush();
+      log_async_futex_wait(&las.wake_seq, seq, LOG_ASYNC_IDLE_MS);
+    }
+    atomic_store(&las.idle, FALSE);
+  }
+  log_async_report_drops();
+  log_sink_flush();
+  return NULL;
+}
+
+
+int log_async_push(const struct log_channel * ch, enum log_level ll,
+                   const struct log_field * fields, size_t count, const char * format, va_list ap)
+{
+  struct log_record * rec;
+
+  atomic_fetch_add(&las.users, 1);
+  if (!atomic_load(&las.active))
+  {
+    atomic_fetch_sub(&las.users, 1);
+    return FALSE;
+  }
+
+  rec = ring_reserve(las.ring);
+  while (rec == NULL)
+  {
+    switch (las.policy)
+    {
+      case LO_DROP_NEWEST:
+        atomic_fetch_add_explicit(&las.dropped_newest, 1, memory_order_relaxed);
+        atomic_fetch_sub(&las.users, 1);
+        return TRUE;
+      case LO_DROP_OLDEST:
+        if ((rec = ring_acquire(las.ring)) != NULL)
+        {
+          ring_release(las.ring, rec);
+          atomic_fetch_add_explicit(&las.dropped_oldest, 1, memory_order_relaxed);
+          atomic_fetch_add_explicit(&las.completed, 1, memory_order_release);
+        }
+        rec = ring_reserve(las.ring);
+        break;
+      case LO_BLOCK:
+      default:
+        rec = log_async_wait_space();
+        break;
+    }
+  }
+
+  log_record_format(rec, ch, ll, fields, count, format, ap);
+  ring_commit(las.ring, rec);
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&las.idle, memory_order_relaxed))
+    log_async_wake();
+  atomic_fetch_sub(&las.users, 1);
+  return TRUE;
+}
+
+
+int log_async_start(size_t capacity, enum log_overflow policy)
+{
+  static int atexit_registered = FALSE;
+  size_t size;
+
+  if (atomic_load(&las.active))
+    return FALSE;
+
+  if (capacity < 2)
+    capacity = 2;
+  size = ring_mem_size(capacity, sizeof(struct log_record));
+  las.mem = aligned_alloc(64, (size + 63) & ~(size_t) 63);
+  if (las.mem == NULL)
+    return FALSE;
+
+  las.ring   = ring_init(las.mem, capacity, sizeof(struct log_record));
+  las.policy = policy;
+  las.reported = 0;
+  atomic_store(&las.completed, 0);
+  atomic_store(&las.dropped_newest, 0);
+  atomic_store(&las.dropped_oldest, 0);
+  atomic_store(&las.running, TRUE);
+
+  if (pthread_create(&las.writer, NULL, log_async_writer, NULL) != 0)
+  {
+    free(las.mem);
+    las.mem  = NULL;
+    las.ring = NULL;
+    return FALSE;
+  }
+
+  if (!atexit_registered)
+    atexit_registered = atexit(log_async_stop) == 0;
+
+  atomic_store_explicit(&las.active, TRUE, memory_order_release);
+  return TRUE;
+}
+
+void log_async_stop(void)
+{
+  if (!atomic_exchange(&las.active, FALSE))
+    return;
+
+  /* let producers that got past the active check finish their commit */
+  while (atomic_load(&las.users))
+    sched_yield();
+
+  atomic_store(&las.running, FALSE);
+  log_async_wake();
+  pthread_join(las.writer, NULL);
+
+  free(las.mem);
+  las.mem  = NULL;
+  las.ring = NULL;
+}
+
+void log_flush(void)
+{
+  uint64_t target;
+  struct timespec pause = { 0, 200000 };
+
+  if (atomic_load_explicit(&las.active, memory_order_acquire))
+  {
+    target = ring_head(las.ring);
+    while (atomic_load_explicit(&las.completed, memory_order_acquire) < target && atomic_load(&las.active))
+    {
+      log_async_wake();
+      nanosleep(&pause, NULL);
+    }
+  }
+  log_sink_flush();
+}
+
+void log_get_async_drops(unsigned long * dropped_newest, unsigned long * dropped_oldest)
+{
+  if (dropped_newest)
+    *dropped_newest = atomic_load_explicit(&las.dropped_newest, memory_order_relaxed);
+  if (dropped_oldest)
+    *dropped_oldest = atomic_load_explicit(&las.dropped_oldest, memory_order_relaxed);
+}
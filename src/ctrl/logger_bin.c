@@ -0,0 +1,508 @@
+#include <errno.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "logger.h"
+#include "logger_bin.h"
+#include "logger_priv.h"
+
+#define LOG_BIN_SEEN_LEN 4096  /* format strings remembered as already defined */
+
+enum log_bin_len
+{
+  LBL_NONE,
+  LBL_HH,
+  LBL_H,
+  LBL_L,
+  LBL_LL,
+  LBL_J,
+  LBL_Z,
+  LBL_T,
+  LBL_LD
+};
+
+struct log_bin_spec
+{
+  const char *     start;   /* points to '%' */
+  size_t           len;     /* length of the whole conversion spec */
+  char             conv;
+  enum log_bin_len lmod;
+  int              star_width;
+  int              star_prec;
+  int              prec;    /* -1: none, taken from the argument list with star_prec */
+};
+
+static struct log_bin_state
+{
+  FILE *        fp;
+  int           users;  /* producers between the fp check and the end of their write */
+  const char *  seen[LOG_BIN_SEEN_LEN];
+  size_t        seen_cnt;
+} lbs;
+
+
+/* returns the position behind the next conversion spec or NULL if there is none left */
+static const char * log_bin_next_spec(const char * fmt, struct log_bin_spec * spec)
+{
+  const char * p;
+
+  for (;;)
+  {
+    fmt = strchr(fmt, '%');
+    if (fmt == NULL)
+      return NULL;
+    if (fmt[1] != '%')
+      break;
+    fmt += 2;
+  }
+
+  memset(spec, 0, sizeof(*spec));
+  spec->start = fmt;
+  spec->prec  = -1;
+  p = fmt + 1;
+
+  while (*p && strchr("-+ #0'I", *p))
+    ++p;
+  if (*p == '*')
+  {
+    spec->star_width = 1;
+    ++p;
+  }
+  else
+    while (*p >= '0' && *p <= '9')
+      ++p;
+  if (*p == '.')
+  {
+    ++p;
+    if (*p == '*')
+    {
+      spec->star_prec = 1;
+      ++p;
+    }
+    else
+      for (spec->prec = 0; *p >= '0' && *p <= '9'; ++p)
+        spec->prec = spec->prec < 100000 ? spec->prec * 10 + (*p - '0') : spec->prec;
+  }
+
+  switch (*p)
+  {
+    case 'h': spec->lmod = p[1] == 'h' ? LBL_HH : LBL_H; p += spec->lmod == LBL_HH ? 2 : 1; break;
+    case 'l': spec->lmod = p[1] == 'l' ? LBL_LL : LBL_L; p += spec->lmod == LBL_LL ? 2 : 1; break;
+    case 'q': spec->lmod = LBL_LL; ++p; break;
+    case 'j': spec->lmod = LBL_J;  ++p; break;
+    case 'z': spec->lmod = LBL_Z;  ++p; break;
+    case 't': spec->lmod = LBL_T;  ++p; break;
+    case 'L': spec->lmod = LBL_LD; ++p; break;
+    default : break;
+  }
+
+  if (*p == '\0')
+    return NULL;
+  spec->conv = *p++;
+  spec->len = p - fmt;
+  return p;
+}
+
+static int log_bin_put(unsigned char ** pos, unsigned char * end, const void * val, size_t len)
+{
+  if (*pos + len > end)
+    return FALSE;
+  memcpy(*pos, val, len);
+  *pos += len;
+  return TRUE;
+}
+
+/* max: precision of the spec - the string does not need to be terminated within */
+static int log_bin_put_str(unsigned char ** pos, unsigned char * end, const char * str, size_t max)
+{
+  size_t avail;
+  uint16_t len;
+
+  if (str == NULL)
+    str = "(null)";
+  if (*pos + sizeof(len) > end)
+    return FALSE;
+  avail = end - *pos - sizeof(len);
+  if (avail > UINT16_MAX)
+    avail = UINT16_MAX;
+  len = (uint16_t) strnlen(str, max < avail ? max : avail);
+  log_bin_put(pos, end, &len, sizeof(len));
+  return log_bin_put(pos, end, str, len);
+}
+
+static int log_bin_get(const unsigned char ** pos, const unsigned char * end, void * val, size_t len)
+{
+  if (*pos + len > end)
+    return FALSE;
+  memcpy(val, *pos, len);
+  *pos += len;
+  return TRUE;
+}
+
+
+size_t log_bin_pack(const char * format, va_list ap, unsigned char * out, size_t outlen)
+{
+  unsigned char * pos = out;
+  unsigned char * end = out + outlen;
+  struct log_bin_spec spec;
+  int saved_errno = errno;
+  int64_t  i;
+  uint64_t u;
+  double   d;
+  int      ok = TRUE;
+
+  while (ok && (format = log_bin_next_spec(format, &spec)) != NULL)
+  {
+    if (spec.star_width)
+    {
+      i = va_arg(ap, int);
+      ok = ok && log_bin_put(&pos, end, &i, sizeof(i));
+    }
+    if (spec.star_prec)
+    {
+      i = va_arg(ap, int);
+      spec.prec = i >= 0 ? (int) i : -1;
+      ok = ok && log_bin_put(&pos, end, &i, sizeof(i));
+    }
+
+    switch (spec.conv)
+    {
+      case 'd':
+      case 'i':
+        switch (spec.lmod)
+        {
+          case LBL_HH: i = (signed char) va_arg(ap, int); break;
+          case LBL_H : i = (short) va_arg(ap, int);       break;
+          case LBL_L : i = va_arg(ap, long);              break;
+          case LBL_LL: i = va_arg(ap, long long);         break;
+          case LBL_J : i = va_arg(ap, intmax_t);          break;
+          case LBL_Z : i = va_arg(ap, ssize_t);           break;
+          case LBL_T : i = va_arg(ap, ptrdiff_t);         break;
+          default    : i = va_arg(ap, int);               break;
+        }
+        ok = ok && log_bin_put(&pos, end, &i, sizeof(i));
+        break;
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        switch (spec.lmod)
+        {
+          case LBL_HH: u = (unsigned char) va_arg(ap, unsigned int);  break;
+          case LBL_H : u = (unsigned short) va_arg(ap, unsigned int); break;
+          case LBL_L : u = va_arg(ap, unsigned long);                 break;
+          case LBL_LL: u = va_arg(ap, unsigned long long);            break;
+          case LBL_J : u = va_arg(ap, uintmax_t);                     break;
+          case LBL_Z : u = va_arg(ap, size_t);                        break;
+          case LBL_T : u = va_arg(ap, ptrdiff_t);                     break;
+          default    : u = va_arg(ap, unsigned int);                  break;
+        }
+        ok = ok && log_bin_put(&pos, end, &u, sizeof(u));
+        break;
+      case 'c':
+      case 'C':  /* wint_t, promoted like int */
+        i = va_arg(ap, int);
+        ok = ok && log_bin_put(&pos, end, &i, sizeof(i));
+        break;
+      case 'e': case 'E':
+      case 'f': case 'F':
+      case 'g': case 'G':
+      case 'a': case 'A':
+        d = spec.lmod == LBL_LD ? (double) va_arg(ap, long double) : va_arg(ap, double);
+        ok = ok && log_bin_put(&pos, end, &d, sizeof(d));
+        break;
+      case 's':
+      case 'S':
+        if (spec.lmod == LBL_L || spec.conv == 'S')
+        {
+          (void) va_arg(ap, void *);
+          ok = ok && log_bin_put_str(&pos, end, "(wide)", SIZE_MAX);
+        }
+        else
+          ok = ok && log_bin_put_str(&pos, end, va_arg(ap, const char *), spec.prec >= 0 ? (size_t) spec.prec : SIZE_MAX);
+        break;
+      case 'm':
+        ok = ok && log_bin_put_str(&pos, end, strerror(saved_errno), SIZE_MAX);
+        break;
+      case 'p':
+        u = (uintptr_t) va_arg(ap, void *);
+        ok = ok && log_bin_put(&pos, end, &u, sizeof(u));
+        break;
+      case 'n':
+        (void) va_arg(ap, void *);
+        break;
+      default:
+        break;
+    }
+  }
+  return pos - out;
+}
+
+size_t log_bin_render(const char * format, const unsigned char * args, size_t argslen, char * out, size_t outlen)
+{
+  const unsigned char * pos = args;
+  const unsigned char * end = args + argslen;
+  struct log_bin_spec spec;
+  const char * next;
+  char spec_fmt[32];
+  size_t len = 0;
+  int64_t star[2];
+  int64_t v;
+  double d;
+  uint16_t slen;
+  char str[LOG_BIN_MAX_LEN];
+  int n;
+
+#define LOG_BIN_EMIT(...) \
+  do { \
+    n = snprintf(out + len, outlen - len, __VA_ARGS__); \
+    if (n > 0) \
+      len += (size_t) n < outlen - len ? (size_t) n : outlen - len - 1; \
+  } while (0)
+
+  if (outlen == 0)
+    return 0;
+  out[0] = '\0';
+
+  while ((next = log_bin_next_spec(format, &spec)) != NULL)
+  {
+    const char * lit = format;
+    size_t speclen;
+
+    /* literal text up to the spec, with "%%" collapsed */
+    while (lit < spec.start)
+    {
+      if (lit[0] == '%' && lit[1] == '%')
+        ++lit;
+      if (len + 1 < outlen)
+        out[len++] = *lit;
+      ++lit;
+    }
+    out[len] = '\0';
+    format = next;
+
+    if ((spec.star_width && !log_bin_get(&pos, end, &star[0], sizeof(star[0]))) ||
+        (spec.star_prec && !log_bin_get(&pos, end, &star[1], sizeof(star[1]))))
+      break;
+
+    /* rebuild the spec without length modifier, stars resolved below */
+    speclen = 0;
+    for (const char * c = spec.start; c < spec.start + spec.len - 1 && speclen < sizeof(spec_fmt) - 4; c++)
+      if (!strchr("hlqjztL", *c))
+        spec_fmt[speclen++] = *c;
+    spec_fmt[speclen] = '\0';
+
+    switch (spec.conv)
+    {
+      case 'd': case 'i':
+      case 'o': case 'u':
+      case 'x': case 'X':
+      case 'p':
+        if (!log_bin_get(&pos, end, &v, sizeof(v)))
+          goto render_end;
+        if (spec.conv == 'p')
+        {
+          LOG_BIN_EMIT("%#llx", (unsigned long long) v);
+          break;
+        }
+        strcat(spec_fmt, "ll");
+        spec_fmt[speclen + 2] = spec.conv;
+        spec_fmt[speclen + 3] = '\0';
+        if (spec.star_width && spec.star_prec)
+          LOG_BIN_EMIT(spec_fmt, (int) star[0], (int) star[1], (long long) v);
+        else if (spec.star_width || spec.star_prec)
+          LOG_BIN_EMIT(spec_fmt, (int) star[spec.star_width ? 0 : 1], (long long) v);
+        else
+          LOG_BIN_EMIT(spec_fmt, (long long) v);
+        break;
+      case 'c':
+      case 'C':
+        if (!log_bin_get(&pos, end, &v, sizeof(v)))
+          goto render_end;
+        spec_fmt[speclen] = 'c';
+        spec_fmt[speclen + 1] = '\0';
+        LOG_BIN_EMIT(spec_fmt, spec.conv == 'C' && (v < 0 || v > 0x7f) ? '?' : (int) v);
+        break;
+      case 'e': case 'E':
+      case 'f': case 'F':
+      case 'g': case 'G':
+      case 'a': case 'A':
+        if (!log_bin_get(&pos, end, &d, sizeof(d)))
+          goto render_end;
+        spec_fmt[speclen] = spec.conv;
+        spec_fmt[speclen + 1] = '\0';
+        if (spec.star_width && spec.star_prec)
+          LOG_BIN_EMIT(spec_fmt, (int) star[0], (int) star[1], d);
+        else if (spec.star_width || spec.star_prec)
+          LOG_BIN_EMIT(spec_fmt, (int) star[spec.star_width ? 0 : 1], d);
+        else
+          LOG_BIN_EMIT(spec_fmt, d);
+        break;
+      case 's':
+      case 'S':
+      case 'm':
+        if (!log_bin_get(&pos, end, &slen, sizeof(slen)) || slen >= sizeof(str) || !log_bin_get(&pos, end, str, slen))
+          goto render_end;
+        str[slen] = '\0';
+        spec_fmt[speclen] = 's';
+        spec_fmt[speclen + 1] = '\0';
+        if (spec.conv == 'm')
+          LOG_BIN_EMIT("%s", str);
+        else if (spec.star_width && spec.star_prec)
+          LOG_BIN_EMIT(spec_fmt, (int) star[0], (int) star[1], str);
+        else if (spec.star_width || spec.star_prec)
+          LOG_BIN_EMIT(spec_fmt, (int) star[spec.star_width ? 0 : 1], str);
+        else
+          LOG_BIN_EMIT(spec_fmt, str);
+        break;
+      default:
+        break;
+    }
+  }
+
+  /* trailing literal text */
+  for (; *format; format++)
+  {
+    if (format[0] == '%' && format[1] == '%')
+      ++format;
+    if (len + 1 < outlen)
+      out[len++] = *format;
+  }
+
+render_end:
+  out[len] = '\0';
+  return len;
+#undef LOG_BIN_EMIT
+}
+
+
+static int log_bin_seen(const char * format)
+{
+  size_t idx = ((uintptr_t) format >> 3) % LOG_BIN_SEEN_LEN;
+
+  for (size_t i = 0; i < LOG_BIN_SEEN_LEN; i++, idx = (idx + 1) % LOG_BIN_SEEN_LEN)
+  {
+    if (lbs.seen[idx] == format)
+      return TRUE;
+    if (lbs.seen[idx] == NULL)
+    {
+      if (lbs.seen_cnt < LOG_BIN_SEEN_LEN * 3 / 4)
+      {
+        lbs.seen[idx] = format;
+        ++lbs.seen_cnt;
+      }
+      return FALSE;
+    }
+  }
+  return FALSE;
+}
+
+/* writes the definition record for a string once, caller holds the stream lock */
+static void log_bin_define(FILE * fp, const char * str)
+{
+  struct log_bin_head def = { 0 };
+  size_t len;
+
+  if (log_bin_seen(str))
+    return;
+
+  len = strnlen(str, LOG_BIN_MAX_LEN - sizeof(def) - 1);
+  def.len  = (uint16_t) (sizeof(def) + len + 1);
+  def.type = LOG_BIN_DEF;
+  def.id   = (uintptr_t) str;
+  fwrite_unlocked(&def, sizeof(def), 1, fp);
+  fwrite_unlocked(str, 1, len, fp);
+  fputc_unlocked('\0', fp);
+}
+
+int log_bin_push(const struct log_channel * ch, enum log_level ll, const char * format, va_list ap)
+{
+  unsigned char buf[LOG_BIN_MAX_LEN];
+  struct log_bin_head * head = (struct log_bin_head *) buf;
+  const char * channel = ch && ch != &log_channel_global ? ch->name : NULL;
+  struct timespec ts;
+  FILE * fp;
+  va_list cp;
+  size_t len;
+
+  if (__atomic_load_n(&lbs.fp, __ATOMIC_RELAXED) == NULL)
+    return FALSE;
+  __atomic_add_fetch(&lbs.users, 1, __ATOMIC_SEQ_CST);
+  fp = __atomic_load_n(&lbs.fp, __ATOMIC_SEQ_CST);
+  if (fp == NULL)
+  {
+    __atomic_sub_fetch(&lbs.users, 1, __ATOMIC_RELEASE);
+    return FALSE;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  va_copy(cp, ap);
+  len = sizeof(*head) + log_bin_pack(format, cp, buf + sizeof(*head), sizeof(buf) - sizeof(*head));
+  va_end(cp);
+
+  head->len  = (uint16_t) len;
+  head->type = LOG_BIN_REC;
+  head->ll   = (uint8_t) ll;
+  head->pad  = 0;
+  head->id   = (uintptr_t) format;
+  head->ch   = (uintptr_t) channel;
+  head->ts   = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+  flockfile(fp);
+  log_bin_define(fp, format);
+  if (channel)
+    log_bin_define(fp, channel);
+  fwrite_unlocked(buf, len, 1, fp);
+  funlockfile(fp);
+  __atomic_sub_fetch(&lbs.users, 1, __ATOMIC_RELEASE);
+  log_stats_record(ll, len - sizeof(*head));
+  return TRUE;
+}
+
+int log_binary_open(const char * path)
+{
+  FILE * fp;
+
+  log_binary_close();
+  fp = fopen(path, "ab");
+  if (fp == NULL)
+    return FALSE;
+  setvbuf(fp, NULL, _IOFBF, 1 << 16);
+  if (ftell(fp) == 0)
+    fwrite(LOG_BIN_MAGIC, 1, LOG_BIN_MAGIC_LEN, fp);
+
+  memset(lbs.seen, 0, sizeof(lbs.seen));
+  lbs.seen_cnt = 0;
+  __atomic_store_n(&lbs.fp, fp, __ATOMIC_SEQ_CST);
+  return TRUE;
+}
+
+void log_binary_close(void)
+{
+  FILE * fp = __atomic_exchange_n(&lbs.fp, NULL, __ATOMIC_SEQ_CST);
+
+  if (fp == NULL)
+    return;
+  /* producers that got past the fp check finish their write first */
+  while (__atomic_load_n(&lbs.users, __ATOMIC_ACQUIRE))
+    sched_yield();
+  fclose(fp);
+}
+
+void log_bin_flush(void)
+{
+  FILE * fp;
+
+  if (__atomic_load_n(&lbs.fp, __ATOMIC_RELAXED) == NULL)
+    return;
+  __atomic_add_fetch(&lbs.users, 1, __ATOMIC_SEQ_CST);
+  fp = __atomic_load_n(&lbs.fp, __ATOMIC_SEQ_CST);
+  if (fp)
+    fflush(fp);
+  __atomic_sub_fetch(&lbs.users, 1, __ATOMIC_RELEASE);
+}
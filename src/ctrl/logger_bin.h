@@ -0,0 +1,50 @@
+#ifndef _H_LINUXTOOLS_TOOL_LOGGER_BIN
+#define _H_LINUXTOOLS_TOOL_LOGGER_BIN
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary log format: a file starts with LOG_BIN_MAGIC, followed by records.
+ * Each record starts with a struct log_bin_head. LOG_BIN_DEF records carry the
+ * text of a format string or channel name (NUL terminated) and are written
+ * once before the first LOG_BIN_REC referring to it. LOG_BIN_REC records carry
+ * the packed printf arguments of one log call. Values are stored in host byte
+ * order.
+ */
+
+#define LOG_BIN_MAGIC     "LTLOGB2\n"
+#define LOG_BIN_MAGIC_LEN 8
+#define LOG_BIN_MAX_LEN   1024
+
+enum log_bin_type
+{
+  LOG_BIN_DEF = 'D',
+  LOG_BIN_REC = 'R'
+};
+
+struct log_bin_head
+{
+  uint16_t len;  /* record length including this head */
+  uint8_t  type; /* enum log_bin_type */
+  uint8_t  ll;   /* enum log_level */
+  uint32_t pad;
+  uint64_t id;   /* address of the format string */
+  uint64_t ch;   /* address of the channel name, 0 for the global channel */
+  uint64_t ts;   /* CLOCK_REALTIME in ns */
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  size_t log_bin_pack(const char * format, va_list ap, unsigned char * out, size_t outlen);
+  size_t log_bin_render(const char * format, const unsigned char * args, size_t argslen, char * out, size_t outlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _H_LINUXTOOLS_TOOL_LOGGER_BIN */
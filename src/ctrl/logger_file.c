@@ -0,0 +1,373 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "logger_priv.h"
+
+#define LOG_FILE_BUFFER_LEN (64 * 1024)
+#define LOG_FILE_FLUSH_MS   1000
+#define LOG_FILE_PATH_LEN   256
+#define LOG_FILE_RETRY_S    1     /* reopen attempts after a failed rotation */
+
+static struct log_file_state
+{
+  pthread_mutex_t        lock;
+  struct log_file_config cfg;
+  char                   path[LOG_FILE_PATH_LEN];
+  int                    fd;
+  char *                 buf;
+  size_t                 len;
+  size_t                 size;         /* bytes in the current file */
+  time_t                 opened;       /* CLOCK_MONOTONIC seconds */
+  time_t                 synced;
+  struct timespec        oldest;       /* first line in buf */
+  int                    failed;       /* reopen after rotation failed, retried on write */
+  time_t                 retried;
+  unsigned long          lost;         /* lines dropped while failed */
+  pthread_cond_t         wake;         /* flusher: CLOCK_MONOTONIC */
+  pthread_t              flusher;
+  int                    flushing;
+} lfs = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+
+static time_t log_file_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+static int log_file_reopen(void)
+{
+  struct stat st;
+
+  lfs.fd = open(lfs.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (lfs.fd < 0)
+    return FALSE;
+  lfs.size   = fstat(lfs.fd, &st) == 0 ? (size_t) st.st_size : 0;
+  lfs.opened = log_file_now();
+  lfs.synced = lfs.opened;
+  return TRUE;
+}
+
+static void log_file_sync(void)
+{
+  if (lfs.fd >= 0 && lfs.cfg.fsync != LFS_NONE)
+  {
+    fdatasync(lfs.fd);
+    lfs.synced = log_file_now();
+  }
+}
+
+/* writes buffered lines plus an optional extra line with one syscall */
+static void log_file_writev(const char * extra, size_t extra_len)
+{
+  struct iovec iov[2];
+  int cnt = 0;
+  ssize_t res;
+  size_t total;
+  size_t written;
+
+  if (lfs.len)
+  {
+    iov[cnt].iov_base = lfs.buf;
+    iov[cnt++].iov_len = lfs.len;
+  }
+  if (extra_len)
+  {
+    iov[cnt].iov_base = (void *) extra;
+    iov[cnt++].iov_len = extra_len;
+  }
+  if (cnt == 0 || lfs.fd < 0)
+    return;
+
+  total = lfs.len + extra_len;
+  do {
+    res = writev(lfs.fd, iov, cnt);
+  } while (res < 0 && errno == EINTR);
+  written = res > 0 ? (size_t) res : 0;
+
+  /* short writes are rare on regular files - finish them with plain writes */
+  if (res >= 0 && (size_t) res < total)
+  {
+    size_t done = res;
+    for (int i = 0; i < cnt; i++)
+    {
+      if (done >= iov[i].iov_len)
+      {
+        done -= iov[i].iov_len;
+        continue;
+      }
+      const char * p = (const char *) iov[i].iov_base + done;
+      size_t left = iov[i].iov_len - done;
+      done = 0;
+      while (left)
+      {
+        res = write(lfs.fd, p, left);
+        if (res < 0 && errno == EINTR)
+          continue;
+        if (res <= 0)
+          break;
+        p += res;
+        left -= res;
+        written += res;
+      }
+    }
+  }
+
+  lfs.size += written;  /* lines not written are lost, they do not count for rotation */
+  lfs.len = 0;
+
+  if (lfs.cfg.fsync == LFS_INTERVAL && log_file_now() - lfs.synced >= (time_t) lfs.cfg.fsync_interval)
+    log_file_sync();
+}
+
+static void log_file_rotate(void)
+{
+  char from[LOG_FILE_PATH_LEN + 16];
+  char to[LOG_FILE_PATH_LEN + 16];
+
+  log_file_writev(NULL, 0);
+  log_file_sync();
+  close(lfs.fd);
+  lfs.fd = -1;
+
+  if (lfs.cfg.keep == 0)
+    unlink(lfs.path);
+  else
+  {
+    for (unsigned int i = lfs.cfg.keep; i > 1; i--)
+    {
+      snprintf(from, sizeof(from), "%s.%u", lfs.path, i - 1);
+      snprintf(to, sizeof(to), "%s.%u", lfs.path, i);
+      rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", lfs.path);
+    rename(lfs.path, to);
+  }
+  if (!log_file_reopen())
+  {
+    /* the logger itself would end up here again - straight to stderr */
+    fprintf(stderr, "LOG - Could not reopen %s after rotation (%s), retrying.\n", lfs.path, strerror(errno));
+    lfs.failed  = TRUE;
+    lfs.retried = log_file_now();
+    lfs.lost    = 0;
+  }
+}
+
+/* caller holds lfs.lock */
+static int log_file_retry(void)
+{
+  struct log_record rec;
+  char line[LOG_LINE_LEN];
+
+  if (!lfs.failed || log_file_now() - lfs.retried < LOG_FILE_RETRY_S)
+    return FALSE;
+  lfs.retried = log_file_now();
+  if (!log_file_reopen())
+    return FALSE;
+
+  lfs.failed = FALSE;
+  fprintf(stderr, "LOG - %s reopened, %lu line(s) lost.\n", lfs.path, lfs.lost);
+  clock_gettime(CLOCK_REALTIME, &rec.ts);
+  rec.ll      = LL_WARN;
+  rec.channel = NULL;
+  rec.sdlen   = 0;
+  rec.sd[0]   = '\0';
+  rec.len = snprintf(rec.msg, sizeof(rec.msg), "LOG - Log file could not be reopened after rotation, %lu line(s) lost.", lfs.lost);
+  if (rec.len >= sizeof(rec.msg))
+    rec.len = sizeof(rec.msg) - 1;
+  log_file_writev(line, log_format_line(&rec, line));
+  return TRUE;
+}
+
+static int log_file_due(void)
+{
+  struct timespec now;
+  long age_ms;
+
+  if (lfs.len == 0)
+    return FALSE;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  age_ms = (now.tv_sec - lfs.oldest.tv_sec) * 1000 + (now.tv_nsec - lfs.oldest.tv_nsec) / 1000000;
+  return age_ms >= (long) lfs.cfg.flush_ms;
+}
+
+/* writes lines older than flush_ms of processes that stopped logging */
+static void * log_file_flusher(void * arg)
+{
+  struct timespec to;
+  (void) arg;
+
+  pthread_mutex_lock(&lfs.lock);
+  while (lfs.flushing)
+  {
+    /* nothing buffered: the first line wakes us */
+    if (lfs.len == 0)
+    {
+      pthread_cond_wait(&lfs.wake, &lfs.lock);
+      continue;
+    }
+    to = lfs.oldest;
+    to.tv_sec  += lfs.cfg.flush_ms / 1000;
+    to.tv_nsec += (long) (lfs.cfg.flush_ms % 1000) * 1000000L;
+    if (to.tv_nsec >= 1000000000L)
+    {
+      to.tv_sec  += 1;
+      to.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&lfs.wake, &lfs.lock, &to);
+    if (log_file_due())
+      log_file_writev(NULL, 0);
+  }
+  pthread_mutex_unlock(&lfs.lock);
+  return NULL;
+}
+
+static int log_file_flusher_start(void)
+{
+  static int cond_ready = FALSE;
+  pthread_condattr_t attr;
+
+  if (!cond_ready)
+  {
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&lfs.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    cond_ready = TRUE;
+  }
+  lfs.flushing = TRUE;
+  if (pthread_create(&lfs.flusher, NULL, log_file_flusher, NULL) != 0)
+  {
+    lfs.flushing = FALSE;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+void log_set_file_config(const struct log_file_config * cfg)
+{
+  pthread_mutex_lock(&lfs.lock);
+  if (cfg)
+    lfs.cfg = *cfg;
+  else
+    memset(&lfs.cfg, 0, sizeof(lfs.cfg));
+  pthread_mutex_unlock(&lfs.lock);
+}
+
+static void log_file_close(void)
+{
+  pthread_mutex_lock(&lfs.lock);
+  if (lfs.flushing)
+  {
+    lfs.flushing = FALSE;
+    pthread_cond_signal(&lfs.wake);
+    pthread_mutex_unlock(&lfs.lock);
+    pthread_join(lfs.flusher, NULL);
+    pthread_mutex_lock(&lfs.lock);
+  }
+  lfs.failed = FALSE;
+  if (lfs.fd >= 0)
+  {
+    log_file_writev(NULL, 0);
+    log_file_sync();
+    close(lfs.fd);
+    lfs.fd = -1;
+  }
+  pthread_mutex_unlock(&lfs.lock);
+}
+
+int log_file_open(const char * ident)
+{
+  static int atexit_registered = FALSE;
+  int ok;
+
+  log_file_close();
+
+  pthread_mutex_lock(&lfs.lock);
+  if (lfs.cfg.path)
+    snprintf(lfs.path, sizeof(lfs.path), "%s", lfs.cfg.path);
+  else
+    snprintf(lfs.path, sizeof(lfs.path), "%s.log", ident ? ident : "linuxtools");
+  if (lfs.cfg.buffer_size < LOG_LINE_LEN)
+    lfs.cfg.buffer_size = lfs.cfg.buffer_size ? LOG_LINE_LEN : LOG_FILE_BUFFER_LEN;
+  if (lfs.cfg.flush_ms == 0)
+    lfs.cfg.flush_ms = LOG_FILE_FLUSH_MS;
+  if (lfs.cfg.fsync >= LFS_COUNT)
+    lfs.cfg.fsync = LFS_NONE;
+
+  free(lfs.buf);
+  lfs.len = 0;
+  lfs.buf = malloc(lfs.cfg.buffer_size);
+  ok = lfs.buf != NULL && log_file_reopen();
+  pthread_mutex_unlock(&lfs.lock);
+
+  if (ok && !log_file_flusher_start())
+    fprintf(stderr, "LOG - No flush thread for %s, buffered lines are written on the next record.\n", lfs.path);
+
+  if (ok && !atexit_registered)
+    atexit_registered = atexit(log_file_close) == 0;
+  return ok;
+}
+
+void log_file_write(const struct log_record * rec)
+{
+  char line[LOG_LINE_LEN];
+  size_t len = log_format_line(rec, line);
+
+  pthread_mutex_lock(&lfs.lock);
+  if (lfs.fd < 0 && !log_file_retry())
+  {
+    lfs.lost += lfs.failed;
+    goto write_end;
+  }
+
+  if ((lfs.cfg.max_size && lfs.size + lfs.len + len > lfs.cfg.max_size && lfs.size + lfs.len > 0) ||
+      (lfs.cfg.max_age && log_file_now() - lfs.opened >= (time_t) lfs.cfg.max_age))
+    log_file_rotate();
+
+  if (lfs.len + len > lfs.cfg.buffer_size)
+    log_file_writev(line, len);
+  else
+  {
+    if (lfs.len == 0)
+    {
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &lfs.oldest);
+      if (lfs.flushing)
+        pthread_cond_signal(&lfs.wake);
+    }
+    memcpy(lfs.buf + lfs.len, line, len);
+    lfs.len += len;
+    /* do not keep problems in the buffer */
+    if (rec->ll <= LL_ERROR && rec->ll != LL_NONE)
+      log_file_writev(NULL, 0);
+  }
+
+write_end:
+  pthread_mutex_unlock(&lfs.lock);
+}
+
+void log_file_commit(void)
+{
+  pthread_mutex_lock(&lfs.lock);
+  if (log_file_due())
+    log_file_writev(NULL, 0);
+  pthread_mutex_unlock(&lfs.lock);
+}
+
+void log_file_flush(void)
+{
+  pthread_mutex_lock(&lfs.lock);
+  log_file_writev(NULL, 0);
+  pthread_mutex_unlock(&lfs.lock);
+}
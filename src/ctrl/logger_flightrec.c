@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "logger_bin.h"
+#include "logger_priv.h"
+
+/*
+ * Flight recorder: every record of every level is packed into a fixed-size
+ * in-memory ring (binary log format, no formatting). The ring is dumped on
+ * SIGSEGV/SIGABRT/SIGUSR1 with async-signal-safe calls only - the dump is a
+ * binary log, render it with linuxtools_logdecode. The handlers run on an
+ * alternate signal stack, so a stack overflow still gets its dump - the
+ * thread calling log_flightrec_start gets one, other threads call
+ * log_flightrec_altstack.
+ */
+
+#define LOG_FR_SLOT_LEN     256
+#define LOG_FR_PATH_LEN     256
+#define LOG_FR_ALTSTACK_LEN (64 * 1024)
+
+struct log_fr_slot
+{
+  _Atomic uint64_t seq;    /* 2 * pos + 1 while written, 2 * pos + 2 when complete */
+  unsigned char    data[LOG_FR_SLOT_LEN];
+};
+
+static const int log_fr_signals[] = { SIGSEGV, SIGABRT, SIGUSR1 };
+
+static struct log_fr_state
+{
+  struct log_fr_slot * slots;
+  size_t               capacity;
+  _Atomic uint64_t     head;
+  atomic_int           active;
+  char                 path[LOG_FR_PATH_LEN];
+  struct sigaction     old[ARRLEN(log_fr_signals)];
+} lfr;
+
+
+void log_flightrec_push(const struct log_channel * ch, enum log_level ll, const char * format, va_list ap)
+{
+  struct log_bin_head * head;
+  struct log_fr_slot * slot;
+  struct timespec ts;
+  uint64_t pos;
+  va_list cp;
+  size_t len;
+
+  if (!atomic_load_explicit(&lfr.active, memory_order_relaxed))
+    return;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  pos  = atomic_fetch_add_explicit(&lfr.head, 1, memory_order_relaxed);
+  slot = &lfr.slots[pos & (lfr.capacity - 1)];
+  head = (struct log_bin_head *) slot->data;
+
+  atomic_store_explicit(&slot->seq, 2 * pos + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  va_copy(cp, ap);
+  len = sizeof(*head) + log_bin_pack(format, cp, slot->data + sizeof(*head), sizeof(slot->data) - sizeof(*head));
+  va_end(cp);
+
+  head->len  = (uint16_t) len;
+  head->type = LOG_BIN_REC;
+  head->ll   = (uint8_t) ll;
+  head->pad  = 0;
+  head->id   = (uintptr_t) format;
+  head->ch   = (uintptr_t) (ch && ch != &log_channel_global ? ch->name : NULL);
+  head->ts   = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+  atomic_store_explicit(&slot->seq, 2 * pos + 2, memory_order_release);
+}
+
+
+static void log_fr_write(int fd, const void * buf, size_t len)
+{
+  const char * p = buf;
+  ssize_t res;
+
+  while (len)
+  {
+    res = write(fd, p, len);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return;
+    p   += res;
+    len -= res;
+  }
+}
+
+static void log_fr_define(int fd, uint64_t id)
+{
+  struct log_bin_head def = { 0 };
+  const char * str = (const char *) (uintptr_t) id;
+  size_t len;
+
+  if (str == NULL)
+    return;
+  len = strnlen(str, LOG_BIN_MAX_LEN - sizeof(def) - 1);
+  def.len  = (uint16_t) (sizeof(def) + len + 1);
+  def.type = LOG_BIN_DEF;
+  def.id   = id;
+  log_fr_write(fd, &def, sizeof(def));
+  log_fr_write(fd, str, len + 1);
+}
+
+/* async-signal-safe */
+void log_flightrec_dump(int fd)
+{
+  unsigned char buf[LOG_FR_SLOT_LEN];
+  struct log_bin_head * head = (struct log_bin_head *) buf;
+  struct log_fr_slot * slot;
+  uint64_t end, pos, seq;
+
+  if (lfr.slots == NULL)
+    return;
+
+  end = atomic_load_explicit(&lfr.head, memory_order_acquire);
+  pos = end > lfr.capacity ? end - lfr.capacity : 0;
+
+  log_fr_write(fd, LOG_BIN_MAGIC, LOG_BIN_MAGIC_LEN);
+  for (; pos < end; pos++)
+  {
+    slot = &lfr.slots[pos & (lfr.capacity - 1)];
+    seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != 2 * pos + 2)
+      continue;
+    memcpy(buf, slot->data, sizeof(buf));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq ||
+        head->len < sizeof(*head) || head->len > sizeof(buf))
+      continue;
+
+    log_fr_define(fd, head->id);
+    log_fr_define(fd, head->ch);
+    log_fr_write(fd, buf, head->len);
+  }
+}
+
+static void log_fr_signal(int sig)
+{
+  int saved_errno = errno;
+  int fd = STDERR_FILENO;
+
+  if (lfr.path[0])
+    fd = open(lfr.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd >= 0)
+  {
+    log_flightrec_dump(fd);
+    if (fd != STDERR_FILENO)
+      close(fd);
+  }
+  errno = saved_errno;
+
+  /* fatal signals: handler was reset to default by SA_RESETHAND */
+  if (sig != SIGUSR1)
+    raise(sig);
+}
+
+
+/* the stack stays with the thread, it is not freed when the thread exits */
+int log_flightrec_altstack(void)
+{
+  stack_t ss;
+
+  if (sigaltstack(NULL, &ss) == 0 && !(ss.ss_flags & SS_DISABLE))
+    return TRUE;
+
+  ss.ss_size  = SIGSTKSZ > LOG_FR_ALTSTACK_LEN ? SIGSTKSZ : LOG_FR_ALTSTACK_LEN;
+  ss.ss_sp    = malloc(ss.ss_size);
+  ss.ss_flags = 0;
+  if (ss.ss_sp == NULL)
+    return FALSE;
+  if (sigaltstack(&ss, NULL) != 0)
+  {
+    free(ss.ss_sp);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+int log_flightrec_start(size_t records, const char * dump_path)
+{
+  struct sigaction sa;
+  size_t capacity = 2;
+
+  if (atomic_load(&lfr.active))
+    return FALSE;
+
+  while (capacity < records)
+    capacity <<= 1;
+
+  /*
+   * producers may still be inside log_flightrec_push after a stop, so a ring
+   * is never freed - a later start reuses it if it is large enough
+   */
+  if (lfr.slots == NULL || lfr.capacity < capacity)
+  {
+    struct log_fr_slot * slots = calloc(capacity, sizeof(*slots));
+    if (slots == NULL)
+      return FALSE;
+    lfr.slots    = slots;
+    lfr.capacity = capacity;
+  }
+  atomic_store(&lfr.head, 0);
+  for (size_t i = 0; i < lfr.capacity; i++)
+    atomic_store_explicit(&lfr.slots[i].seq, 0, memory_order_relaxed);
+
+  snprintf(lfr.path, sizeof(lfr.path), "%s", dump_path ? dump_path : "");
+  if (!log_flightrec_altstack())
+    log_push(LL_WARN, "LOG - No alternate signal stack, a stack overflow will not be dumped.");
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = log_fr_signal;
+  sigemptyset(&sa.sa_mask);
+  for (size_t i = 0; i < ARRLEN(log_fr_signals); i++)
+  {
+    sa.sa_flags = SA_ONSTACK | (log_fr_signals[i] == SIGUSR1 ? SA_RESTART : SA_RESETHAND);
+    sigaction(log_fr_signals[i], &sa, &lfr.old[i]);
+  }
+
+  atomic_store(&lfr.active, TRUE);
+  log_set_capture_levels((1u << LL_COUNT) - 1);
+  return TRUE;
+}
+
+void log_flightrec_stop(void)
+{
+  if (!atomic_exchange(&lfr.active, FALSE))
+    return;
+
+  log_set_capture_levels(0);
+  for (size_t i = 0; i < ARRLEN(log_fr_signals); i++)
+    sigaction(log_fr_signals[i], &lfr.old[i], NULL);
+}
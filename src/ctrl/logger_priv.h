@@ -0,0 +1,86 @@
+#ifndef _H_LINUXTOOLS_TOOL_LOGGER_PRIV
+#define _H_LINUXTOOLS_TOOL_LOGGER_PRIV
+
+/* logger internals shared between the logger translation units - not part of the API */
+
+#include <stdarg.h>
+#include <time.h>
+
+#include "logger.h"
+#include "../stathelp.h"
+
+#define LOG_TIME_LEN    48
+#define LOG_CHANNEL_LEN 24   /* channel names are cut in text output */
+#define LOG_SD_LEN      256  /* rendered structured data of a record */
+#define LOG_LINE_LEN    (LOG_TIME_LEN + LOG_CHANNEL_LEN + MAX_LOG_LEN + LOG_SD_LEN + 16)
+
+struct log_record
+{
+  struct timespec ts;
+  enum log_level  ll;
+  const char *    channel;  /* NULL for the global channel */
+  unsigned int    len;
+  unsigned int    sdlen;
+  char            msg[MAX_LOG_LEN];
+  char            sd[LOG_SD_LEN];  /* RFC5424 params: key="value" key2="value2" */
+};
+
+extern const int ll_translation[LL_COUNT];
+extern const int lf_translation[LF_COUNT];
+
+void log_record_format(struct log_record * rec, const struct log_channel * ch, enum log_level ll,
+                       const struct log_field * fields, size_t count, const char * format, va_list ap);
+
+#define log_channel_output(CH, LL) (__atomic_load_n(&(CH)->levels, __ATOMIC_RELAXED) & (1u << (LL)))
+
+void log_set_capture_levels(unsigned int levels);
+
+extern struct log_stats log_stats_live;
+extern int              log_stats_timed;
+
+static inline void log_stats_record(enum log_level ll, size_t bytes)
+{
+  __atomic_add_fetch(&log_stats_live.records[ll], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&log_stats_live.bytes[ll], bytes, __ATOMIC_RELAXED);
+}
+
+/* start of a measurement, 0 if latencies are not taken */
+static inline uint64_t log_stats_clock(void)
+{
+  return __atomic_load_n(&log_stats_timed, __ATOMIC_RELAXED) ? stat_now_ns() : 0;
+}
+
+static inline void log_stats_time(struct stat_hist * hist, uint64_t start)
+{
+  if (start)
+    stat_hist_add(hist, stat_now_ns() - start);
+}
+
+size_t log_format_line(const struct log_record * rec, char * out);  /* out holds LOG_LINE_LEN */
+
+void log_sink_write(const struct log_record * rec);   /* hand a record to the active sink */
+void log_sink_commit(void);                           /* end of a batch of records */
+void log_sink_flush(void);                            /* push buffered output to the OS */
+
+int  log_async_push(const struct log_channel * ch, enum log_level ll,
+                    const struct log_field * fields, size_t count, const char * format, va_list ap);
+
+int  log_file_open(const char * ident);
+void log_file_write(const struct log_record * rec);
+void log_file_commit(void);
+void log_file_flush(void);
+
+int  log_syslog_open(const char * ident, int facility);
+void log_syslog_write(const struct log_record * rec);
+void log_syslog_commit(void);
+
+int  log_shm_open(const char * ident);
+void log_shm_write(const struct log_record * rec);
+unsigned long long log_shm_dropped(void);
+
+void log_flightrec_push(const struct log_channel * ch, enum log_level ll, const char * format, va_list ap);
+
+int  log_bin_push(const struct log_channel * ch, enum log_level ll, const char * format, va_list ap);
+void log_bin_flush(void);
+
+#endif  /* _H_LINUXTOOLS_TOOL_LOGGER_PRIV */
@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <time.h>
+
+#include "logger.h"
+#include "logger_priv.h"
+
+#define LOG_RL_TOKEN_BITS 16
+#define LOG_RL_TOKEN_MASK ((1ull << LOG_RL_TOKEN_BITS) - 1)
+
+/*
+ * Lock-free token bucket: tokens and the time of the last refill share one
+ * 64 bit word, updated by CAS. The refill time only advances by whole
+ * intervals so fractions are not lost between calls.
+ */
+int log_ratelimit_pass(struct log_ratelimit * rl, unsigned int burst, unsigned int interval_ms, unsigned int * suppressed)
+{
+  struct timespec ts;
+  uint64_t now, old, upd, last, tokens, add;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  now = ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) & (UINT64_MAX >> LOG_RL_TOKEN_BITS);
+  if (burst > LOG_RL_TOKEN_MASK)
+    burst = LOG_RL_TOKEN_MASK;
+  if (interval_ms == 0)
+    interval_ms = 1;
+
+  old = __atomic_load_n(&rl->state, __ATOMIC_RELAXED);
+  do {
+    last   = old >> LOG_RL_TOKEN_BITS;
+    tokens = old & LOG_RL_TOKEN_MASK;
+
+    if (last == 0 || now < last)
+    {
+      tokens = burst;
+      last   = now;
+    }
+    else if ((add = (now - last) / interval_ms) > 0)
+    {
+      if (tokens + add >= burst)
+      {
+        tokens = burst;
+        last   = now;
+      }
+      else
+      {
+        tokens += add;
+        last   += add * interval_ms;
+      }
+    }
+
+    if (tokens == 0)
+    {
+      __atomic_add_fetch(&rl->suppressed, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&log_stats_live.suppressed, 1, __ATOMIC_RELAXED);
+      return FALSE;
+    }
+    upd = (last << LOG_RL_TOKEN_BITS) | (tokens - 1);
+  } while (!__atomic_compare_exchange_n(&rl->state, &old, upd, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  *suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+  return TRUE;
+}
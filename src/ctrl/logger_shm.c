@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "logger_priv.h"
+#include "../ringhelp.h"
+
+/*
+ * Shared memory transport: processes logging to LF_SHM put their records
+ * into a ring in a POSIX shm segment, a collector (linuxtools_logcollect)
+ * drains it into its own sink. The segment is
+ *
+ *   struct log_shm_head - layout, process table
+ *   ring of struct log_shm_rec slots (ringhelp)
+ *
+ * and created by whoever maps it first - producer or collector. A producer
+ * claims an entry of the process table with its pid, a record costs one
+ * reserve, a memcpy and one commit. A full ring never blocks: the record is
+ * counted as dropped in the process entry and discarded. Processes not
+ * fitting into the table count into orphan_dropped. A forked child calls
+ * log_init again to get an entry of its own.
+ *
+ * A producer holds a POSIX record lock on its process table entry for as
+ * long as it lives - the kernel drops it with the process, it is not
+ * inherited by fork and works across pid namespaces, unlike pid numbers.
+ * Entries whose lock is free belong to exited processes.
+ *
+ * A producer killed between reserve and commit leaves a slot the collector
+ * would wait for forever. The producer stores its table entry into the slot
+ * first, marked by its pid, the collector clears the mark on release: a
+ * stalled slot whose entry is not locked is skipped at once. One still
+ * without a mark - the producer died right after the reserve - or of a
+ * process without table entry is given up after LOG_SHM_STALE_S. The record
+ * is lost and reported by a warning of the collector.
+ *
+ * The segment fd stays open for the locks: closing any fd of the segment
+ * drops all of them in that process, a process is either producer or
+ * collector.
+ */
+
+#define LOG_SHM_MAGIC        0x4d48534cu  /* "LSHM" */
+#define LOG_SHM_VERSION      1
+#define LOG_SHM_SLOTS        4096
+#define LOG_SHM_ATTACH_MS    500         /* wait for the creator to finish the layout */
+#define LOG_SHM_NAME_LEN     64
+#define LOG_SHM_STALE_S      5           /* a stalled slot of unknown owner is given up after that long */
+
+struct log_shm_proc
+{
+  _Alignas(64) uint32_t pid;  /* 0: free */
+  uint32_t                  pad;
+  uint64_t                  written;
+  uint64_t                  dropped;
+  char                      ident[LOG_SHM_IDENT_LEN];
+};
+
+struct log_shm_head
+{
+  uint32_t            magic;    /* set last by the creator */
+  uint32_t            version;
+  uint32_t            slot_size;
+  uint32_t            pad;
+  uint64_t            size;     /* of the segment */
+  uint64_t            orphan_dropped;
+  struct log_shm_proc procs[LOG_SHM_PROCS];
+  _Alignas(64) unsigned char ring[];
+};
+
+struct log_shm_rec
+{
+  int64_t  sec;
+  int32_t  nsec;
+  uint32_t pid;
+  uint32_t proc;     /* index into procs, LOG_SHM_PROCS: none */
+  uint32_t ll;
+  uint32_t len;
+  uint32_t sdlen;
+  char     channel[LOG_CHANNEL_LEN];  /* "": global channel */
+  char     msg[MAX_LOG_LEN];
+  char     sd[LOG_SD_LEN];
+};
+
+struct log_shm_map
+{
+  struct log_shm_head * head;
+  struct ring *         ring;
+  size_t                size;
+  int                   fd;    /* kept open for the entry locks */
+};
+
+static struct log_shm_state
+{
+  char                  name[LOG_SHM_NAME_LEN];
+  size_t                slots;
+  struct log_shm_map    map;
+  struct log_shm_proc * proc;     /* NULL: no table entry */
+  uint32_t              idx;
+  uint32_t              pid;
+  uint64_t              dropped;  /* this process, with or without table entry */
+} lshm;
+
+static struct log_shm_coll
+{
+  char               name[LOG_SHM_NAME_LEN];
+  struct log_shm_map map;
+  time_t             stall;  /* CLOCK_MONOTONIC since when the oldest slot is not committed, 0: not */
+} lshc;
+
+
+void log_set_shm_config(const char * name, size_t slots)
+{
+  snprintf(lshm.name, sizeof(lshm.name), "%s", name ? name : "");
+  lshm.slots = slots;
+}
+
+static int log_shm_wait(struct log_shm_head * head)
+{
+  struct timespec ms = { 0, 1000000L };
+
+  for (int i = 0; i < LOG_SHM_ATTACH_MS; i++)
+  {
+    if (__atomic_load_n(&head->magic, __ATOMIC_ACQUIRE) == LOG_SHM_MAGIC)
+      return TRUE;
+    nanosleep(&ms, NULL);
+  }
+  return FALSE;
+}
+
+/* creates the segment or attaches to an existing one of the same layout */
+static int log_shm_map(struct log_shm_map * map, const char * name, size_t slots)
+{
+  struct timespec ms = { 0, 1000000L };
+  struct log_shm_head * head;
+  struct stat st;
+  size_t size;
+  int created = TRUE;
+  int fd;
+
+  if (name == NULL || name[0] == '\0')
+    name = LOG_SHM_NAME;
+  if (slots == 0)
+    slots = LOG_SHM_SLOTS;
+  size = sizeof(struct log_shm_head) + ring_mem_size(slots, sizeof(struct log_shm_rec));
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+  if (fd < 0 && errno == EEXIST)
+  {
+    created = FALSE;
+    fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+  }
+  if (fd < 0)
+    return FALSE;
+
+  if (created)
+  {
+    if (ftruncate(fd, (off_t) size) != 0)
+    {
+      close(fd);
+      shm_unlink(name);
+      return FALSE;
+    }
+  }
+  else
+  {
+    for (int i = 0; fstat(fd, &st) == 0 && st.st_size == 0 && i < LOG_SHM_ATTACH_MS; i++)
+      nanosleep(&ms, NULL);
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct log_shm_head))
+    {
+      close(fd);
+      return FALSE;
+    }
+    size = (size_t) st.st_size;
+  }
+
+  head = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (head == MAP_FAILED)
+  {
+    close(fd);
+    return FALSE;
+  }
+
+  if (created)
+  {
+    head->version   = LOG_SHM_VERSION;
+    head->slot_size = sizeof(struct log_shm_rec);
+    head->size      = size;
+    map->ring = ring_init(head->ring, slots, sizeof(struct log_shm_rec));
+    __atomic_store_n(&head->magic, LOG_SHM_MAGIC, __ATOMIC_RELEASE);
+  }
+  else if (!log_shm_wait(head) || head->version != LOG_SHM_VERSION ||
+           head->slot_size != sizeof(struct log_shm_rec) || head->size != size)
+    map->ring = NULL;  /* other layout, e.g. another MAX_LOG_LEN */
+  else
+    map->ring = ring_attach(head->ring);
+
+  if (map->ring == NULL)
+  {
+    munmap(head, size);
+    close(fd);
+    return FALSE;
+  }
+  map->head = head;
+  map->size = size;
+  map->fd   = fd;
+  return TRUE;
+}
+
+static void log_shm_unmap(struct log_shm_map * map)
+{
+  if (map->head)
+  {
+    munmap(map->head, map->size);
+    close(map->fd);
+  }
+  memset(map, 0, sizeof(*map));
+}
+
+/* the byte of process table entry idx a producer keeps locked */
+static void log_shm_range(struct flock * fl, uint32_t idx, short type)
+{
+  memset(fl, 0, sizeof(*fl));
+  fl->l_type   = type;
+  fl->l_whence = SEEK_SET;
+  fl->l_start  = (off_t) (offsetof(struct log_shm_head, procs) + idx * sizeof(struct log_shm_proc));
+  fl->l_len    = 1;
+}
+
+
+/* F_SETLK on a process table entry - FALSE: held by another process */
+static int log_shm_lock(const struct log_shm_map * map, uint32_t idx, short type)
+{
+  struct flock fl;
+
+  log_shm_range(&fl, idx, type);
+  return fcntl(map->fd, F_SETLK, &fl) == 0;
+}
+
+
+/* producer side: log_init(.., LF_SHM, ..) */
+int log_shm_open(const char * ident)
+{
+  struct log_shm_head * head;
+  uint32_t pid = (uint32_t) getpid();
+  uint32_t idx;
+
+  if (lshm.map.head == NULL && !log_shm_map(&lshm.map, lshm.name, lshm.slots))
+    return FALSE;
+  head = lshm.map.head;
+
+  /* log_init again - a forked child gets an entry of its own, the lock tells a namesake of another pid namespace */
+  for (idx = 0; idx < LOG_SHM_PROCS; idx++)
+    if (__atomic_load_n(&head->procs[idx].pid, __ATOMIC_RELAXED) == pid && log_shm_lock(&lshm.map, idx, F_WRLCK))
+      break;
+  for (uint32_t i = 0; idx == LOG_SHM_PROCS && i < LOG_SHM_PROCS; i++)
+  {
+    uint32_t free_pid = 0;
+    if (__atomic_load_n(&head->procs[i].pid, __ATOMIC_RELAXED) != 0 || !log_shm_lock(&lshm.map, i, F_WRLCK))
+      continue;
+    if (__atomic_compare_exchange_n(&head->procs[i].pid, &free_pid, pid, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+      __atomic_store_n(&head->procs[i].written, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&head->procs[i].dropped, 0, __ATOMIC_RELAXED);
+      idx = i;
+    }
+    else
+      log_shm_lock(&lshm.map, i, F_UNLCK);
+  }
+
+  lshm.pid = pid;
+  lshm.idx = idx;
+  lshm.proc = idx < LOG_SHM_PROCS ? &head->procs[idx] : NULL;
+  if (lshm.proc)
+    snprintf(lshm.proc->ident, sizeof(lshm.proc->ident), "%s", ident ? ident : "");
+  return TRUE;
+}
+
+void log_shm_write(const struct log_record * rec)
+{
+  struct log_shm_rec * slot = ring_reserve(lshm.map.ring);
+  const char * channel = rec->channel ? rec->channel : "";
+  size_t len;
+
+  if (slot == NULL)
+  {
+    __atomic_add_fetch(&lshm.dropped, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(lshm.proc ? &lshm.proc->dropped : &lshm.map.head->orphan_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  /* first - the collector tells a dead writer by the lock of its entry, the pid marks it as set */
+  slot->proc = lshm.idx;
+  __atomic_store_n(&slot->pid, lshm.pid, __ATOMIC_RELEASE);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  slot->sec   = rec->ts.tv_sec;
+  slot->nsec  = (int32_t) rec->ts.tv_nsec;
+  slot->ll    = rec->ll;
+  slot->len   = rec->len;
+  slot->sdlen = rec->sdlen;
+  len = strnlen(channel, sizeof(slot->channel) - 1);
+  memcpy(slot->channel, channel, len);
+  slot->channel[len] = '\0';
+  memcpy(slot->msg, rec->msg, rec->len);
+  memcpy(slot->sd, rec->sd, rec->sdlen);
+  ring_commit(lshm.map.ring, slot);
+
+  if (lshm.proc)
+    __atomic_add_fetch(&lshm.proc->written, 1, __ATOMIC_RELAXED);
+}
+
+unsigned long long log_shm_dropped(void)
+{
+  return __atomic_load_n(&lshm.dropped, __ATOMIC_RELAXED);
+}
+
+
+/* collector side - records go to the sink of log_init */
+int log_shm_collect_open(const char * name, size_t slots)
+{
+  log_shm_unmap(&lshc.map);
+  snprintf(lshc.name, sizeof(lshc.name), "%s", name && name[0] ? name : LOG_SHM_NAME);
+  return log_shm_map(&lshc.map, lshc.name, slots);
+}
+
+void log_shm_collect_close(int unlink)
+{
+  if (unlink && lshc.map.head)
+    shm_unlink(lshc.name);
+  log_shm_unmap(&lshc.map);
+}
+
+/* origin "ident[pid]: " in front of the message */
+static void log_shm_record(const struct log_shm_rec * slot, struct log_record * rec, char * channel)
+{
+  const struct log_shm_proc * proc = slot->proc < LOG_SHM_PROCS ? &lshc.map.head->procs[slot->proc] : NULL;
+  char ident[LOG_SHM_IDENT_LEN];
+  int len;
+
+  ident[0] = '\0';
+  if (proc && __atomic_load_n(&proc->pid, __ATOMIC_RELAXED) == slot->pid)
+    snprintf(ident, sizeof(ident), "%s", proc->ident);
+
+  rec->ts.tv_sec  = (time_t) slot->sec;
+  rec->ts.tv_nsec = slot->nsec;
+  rec->ll         = slot->ll < LL_COUNT ? (enum log_level) slot->ll : LL_NONE;
+  memcpy(channel, slot->channel, LOG_CHANNEL_LEN);
+  channel[LOG_CHANNEL_LEN - 1] = '\0';
+  rec->channel    = channel[0] ? channel : NULL;
+
+  len = snprintf(rec->msg, sizeof(rec->msg), "%s[%u]: %.*s", ident, (unsigned int) slot->pid,
+                 (int) (slot->len < sizeof(slot->msg) ? slot->len : sizeof(slot->msg) - 1), slot->msg);
+  rec->len = len < 0 ? 0 : len < ssizeof(rec->msg) ? (unsigned int) len : sizeof(rec->msg) - 1;
+  rec->sdlen = slot->sdlen < sizeof(slot->sd) ? slot->sdlen : 0;
+  memcpy(rec->sd, slot->sd, rec->sdlen);
+  rec->sd[rec->sdlen] = '\0';
+}
+
+/* the process of table entry idx still runs - in doubt it does */
+static int log_shm_alive(uint32_t idx)
+{
+  struct flock fl;
+
+  log_shm_range(&fl, idx, F_WRLCK);
+  return fcntl(lshc.map.fd, F_GETLK, &fl) != 0 || fl.l_type != F_UNLCK;
+}
+
+/* oldest slot reserved by a producer that is gone: committed for it, the next acquire returns it */
+static int log_shm_stale(int progress)
+{
+  struct log_shm_rec * slot = ring_stalled(lshc.map.ring);
+  struct timespec now;
+  uint32_t pid, proc;
+
+  if (slot == NULL || progress)
+  {
+    lshc.stall = 0;
+    return FALSE;
+  }
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  if (lshc.stall == 0)
+    lshc.stall = now.tv_sec;
+
+  /* no table entry (or not yet in the slot): nothing to tell by - time */
+  pid  = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+  proc = pid ? slot->proc : LOG_SHM_PROCS;
+  if (proc < LOG_SHM_PROCS ? log_shm_alive(proc) : now.tv_sec - lshc.stall < LOG_SHM_STALE_S)
+    return FALSE;
+  lshc.stall = 0;
+  return ring_skip(lshc.map.ring, slot);
+}
+
+static void log_shm_lost(uint32_t pid)
+{
+  struct log_record rec;
+
+  clock_gettime(CLOCK_REALTIME, &rec.ts);
+  rec.ll      = LL_WARN;
+  rec.channel = NULL;
+  rec.sdlen   = 0;
+  rec.sd[0]   = '\0';
+  if (pid)
+    rec.len = snprintf(rec.msg, sizeof(rec.msg), "LOG - [%u] died while writing a record, it is lost.", (unsigned int) pid);
+  else
+    rec.len = snprintf(rec.msg, sizeof(rec.msg), "LOG - a process died while writing a record, it is lost.");
+  log_stats_record(rec.ll, rec.len);
+  log_sink_write(&rec);
+}
+
+size_t log_shm_collect(size_t max)
+{
+  struct log_record rec;
+  char channel[LOG_CHANNEL_LEN];
+  struct log_shm_rec * slot;
+  size_t count = 0;
+
+  if (lshc.map.ring == NULL)
+    return 0;
+
+  while (count < max && (slot = ring_acquire(lshc.map.ring)) != NULL)
+  {
+    log_shm_record(slot, &rec, channel);
+    __atomic_store_n(&slot->pid, 0, __ATOMIC_RELAXED);
+    ring_release(lshc.map.ring, slot);
+    log_stats_record(rec.ll, rec.len + rec.sdlen);
+    log_sink_write(&rec);
+    ++count;
+  }
+
+  if (count < max && log_shm_stale(count != 0) && (slot = ring_acquire(lshc.map.ring)) != NULL)
+  {
+    log_shm_lost(__atomic_load_n(&slot->pid, __ATOMIC_RELAXED));
+    __atomic_store_n(&slot->pid, 0, __ATOMIC_RELAXED);
+    ring_release(lshc.map.ring, slot);
+    ++count;
+  }
+  if (count)
+    log_sink_commit();
+  return count;
+}
+
+size_t log_shm_get_procs(struct log_shm_proc_stats * procs, size_t count, unsigned long long * orphan_dropped)
+{
+  struct log_shm_head * head = lshc.map.head;
+  size_t n = 0;
+
+  if (head == NULL)
+    return 0;
+  if (orphan_dropped)
+    *orphan_dropped = __atomic_load_n(&head->orphan_dropped, __ATOMIC_RELAXED);
+
+  for (unsigned int i = 0; i < LOG_SHM_PROCS && n < count; i++)
+  {
+    struct log_shm_proc * p = &head->procs[i];
+    uint32_t pid = __atomic_load_n(&p->pid, __ATOMIC_ACQUIRE);
+
+    if (pid == 0)
+      continue;
+    procs[n].slot    = i;
+    procs[n].pid     = (int) pid;
+    procs[n].alive   = log_shm_alive(i);
+    procs[n].written = __atomic_load_n(&p->written, __ATOMIC_RELAXED);
+    procs[n].dropped = __atomic_load_n(&p->dropped, __ATOMIC_RELAXED);
+    snprintf(procs[n].ident, sizeof(procs[n].ident), "%s", p->ident);
+    ++n;
+  }
+  return n;
+}
+
+/* frees table entries of exited processes - only with an empty ring, no record may refer to them */
+size_t log_shm_reap(void)
+{
+  struct log_shm_head * head = lshc.map.head;
+  size_t count = 0;
+
+  if (head == NULL || ring_used(lshc.map.ring))
+    return 0;
+
+  for (unsigned int i = 0; i < LOG_SHM_PROCS; i++)
+  {
+    uint32_t pid = __atomic_load_n(&head->procs[i].pid, __ATOMIC_RELAXED);
+
+    /* holding the lock keeps a namesake of the pid from taking the entry over meanwhile */
+    if (pid == 0 || !log_shm_lock(&lshc.map, i, F_WRLCK))
+      continue;
+    if (__atomic_compare_exchange_n(&head->procs[i].pid, &pid, 0, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      ++count;
+    log_shm_lock(&lshc.map, i, F_UNLCK);
+  }
+  return count;
+}
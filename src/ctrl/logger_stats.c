@@ -0,0 +1,53 @@
+#include "logger.h"
+#include "logger_priv.h"
+
+/*
+ * Logger self-instrumentation. Counters are relaxed atomics bumped on the
+ * paths that already exist, latencies cost two clock reads per measurement
+ * and are off by default.
+ */
+
+struct log_stats log_stats_live;
+int              log_stats_timed;
+
+
+void log_set_stats_latency(int active)
+{
+  __atomic_store_n(&log_stats_timed, active ? TRUE : FALSE, __ATOMIC_RELAXED);
+}
+
+void log_get_stats(struct log_stats * stats)
+{
+  unsigned long dropped_newest, dropped_oldest;
+
+  if (stats == NULL)
+    return;
+
+  for (size_t i = 0; i < LL_COUNT; i++)
+  {
+    stats->records[i] = __atomic_load_n(&log_stats_live.records[i], __ATOMIC_RELAXED);
+    stats->bytes[i]   = __atomic_load_n(&log_stats_live.bytes[i], __ATOMIC_RELAXED);
+  }
+  log_get_async_drops(&dropped_newest, &dropped_oldest);
+  stats->dropped_newest = dropped_newest;
+  stats->dropped_oldest = dropped_oldest;
+  stats->suppressed     = __atomic_load_n(&log_stats_live.suppressed, __ATOMIC_RELAXED);
+  stats->dropped_shm    = log_shm_dropped();
+  stat_hist_snapshot(&stats->call_ns, &log_stats_live.call_ns);
+  stat_hist_snapshot(&stats->write_ns, &log_stats_live.write_ns);
+  stat_hist_snapshot(&stats->commit_ns, &log_stats_live.commit_ns);
+}
+
+/* async and shm drop counters are not reset - they belong to the ring */
+void log_reset_stats(void)
+{
+  for (size_t i = 0; i < LL_COUNT; i++)
+  {
+    __atomic_store_n(&log_stats_live.records[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&log_stats_live.bytes[i], 0, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&log_stats_live.suppressed, 0, __ATOMIC_RELAXED);
+  stat_hist_reset(&log_stats_live.call_ns);
+  stat_hist_reset(&log_stats_live.write_ns);
+  stat_hist_reset(&log_stats_live.commit_ns);
+}
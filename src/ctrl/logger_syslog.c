@@ -0,0 +1,160 @@
+#define _GNU_SOURCE  /* sendmmsg */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "logger.h"
+#include "logger_priv.h"
+#include "../timehelp.h"
+
+/*
+ * Native syslog sink: RFC5424 records are built in a per-thread batch and sent
+ * to /dev/log over an unconnected datagram socket, one sendmmsg per batch. In
+ * async mode a batch is what the writer drained in one go, in sync mode every
+ * record is sent on its own. An unconnected socket survives a restart of the
+ * syslog daemon; records sent while it is away are lost.
+ *
+ *   <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID [SD-ELEMENT] MSG
+ */
+
+#define LOG_SL_PATH     "/dev/log"
+#define LOG_SL_SDID     "fields@32473"   /* 32473: enterprise number reserved for documentation (RFC5612) */
+#define LOG_SL_BATCH    16
+#define LOG_SL_HEAD_LEN (1 + 64 + 1 + 48 + 1 + 10 + 1)   /* " HOSTNAME APP-NAME PROCID " */
+#define LOG_SL_MSG_LEN  (8 + LOG_TIME_LEN + LOG_SL_HEAD_LEN + 33 + sizeof(LOG_SL_SDID) + LOG_SD_LEN + 3 + MAX_LOG_LEN)
+
+static struct log_sl_state
+{
+  int                fd;
+  int                facility;
+  struct sockaddr_un addr;
+  socklen_t          addrlen;
+  char               path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+  char               head[LOG_SL_HEAD_LEN + 1];
+  size_t             head_len;
+} lsl = { .fd = -1 };
+
+static __thread struct log_sl_batch
+{
+  unsigned int   count;
+  struct mmsghdr msg[LOG_SL_BATCH];
+  struct iovec   iov[LOG_SL_BATCH];
+  char           buf[LOG_SL_BATCH][LOG_SL_MSG_LEN];
+} lsl_batch;
+
+
+/* header fields are printable US-ASCII without spaces, "-" if empty */
+static size_t log_sl_token(char * out, const char * str, size_t max)
+{
+  size_t len = 0;
+
+  for (; str && *str && len < max; str++)
+    if (*str > ' ' && *str < 0x7f)
+      out[len++] = *str;
+  if (len == 0)
+    out[len++] = '-';
+  return len;
+}
+
+void log_set_syslog_socket(const char * path)
+{
+  snprintf(lsl.path, sizeof(lsl.path), "%s", path ? path : "");
+}
+
+int log_syslog_open(const char * ident, int facility)
+{
+  char host[256];
+  size_t pos = 0;
+
+  if (lsl.fd >= 0)
+    close(lsl.fd);
+
+  lsl.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (lsl.fd < 0)
+    return FALSE;
+
+  memset(&lsl.addr, 0, sizeof(lsl.addr));
+  lsl.addr.sun_family = AF_UNIX;
+  snprintf(lsl.addr.sun_path, sizeof(lsl.addr.sun_path), "%s", lsl.path[0] ? lsl.path : LOG_SL_PATH);
+  lsl.addrlen  = sizeof(lsl.addr);
+  lsl.facility = facility;
+
+  if (gethostname(host, sizeof(host)) != 0)
+    host[0] = '\0';
+  host[sizeof(host) - 1] = '\0';
+
+  lsl.head[pos++] = ' ';
+  pos += log_sl_token(lsl.head + pos, host, 64);
+  lsl.head[pos++] = ' ';
+  pos += log_sl_token(lsl.head + pos, ident, 48);
+  pos += snprintf(lsl.head + pos, sizeof(lsl.head) - pos, " %d ", (int) getpid());
+  lsl.head_len = pos;
+  return TRUE;
+}
+
+void log_syslog_write(const struct log_record * rec)
+{
+  char * out;
+  size_t pos;
+
+  if (lsl_batch.count == LOG_SL_BATCH)
+    log_syslog_commit();
+
+  out = lsl_batch.buf[lsl_batch.count];
+  pos = snprintf(out, 8, "<%d>1 ", lsl.facility | ll_translation[rec->ll]);
+  pos += ts_format(&rec->ts, TS_RFC3339, out + pos, LOG_TIME_LEN);
+  memcpy(out + pos, lsl.head, lsl.head_len);
+  pos += lsl.head_len;
+  pos += log_sl_token(out + pos, rec->channel, 32);
+  out[pos++] = ' ';
+  if (rec->sdlen)
+  {
+    out[pos++] = '[';
+    memcpy(out + pos, LOG_SL_SDID, sizeof(LOG_SL_SDID) - 1);
+    pos += sizeof(LOG_SL_SDID) - 1;
+    out[pos++] = ' ';
+    memcpy(out + pos, rec->sd, rec->sdlen);
+    pos += rec->sdlen;
+    out[pos++] = ']';
+  }
+  else
+    out[pos++] = '-';
+  out[pos++] = ' ';
+  memcpy(out + pos, rec->msg, rec->len);
+  pos += rec->len;
+
+  lsl_batch.iov[lsl_batch.count].iov_base = out;
+  lsl_batch.iov[lsl_batch.count].iov_len  = pos;
+  memset(&lsl_batch.msg[lsl_batch.count], 0, sizeof(lsl_batch.msg[0]));
+  lsl_batch.msg[lsl_batch.count].msg_hdr.msg_name    = &lsl.addr;
+  lsl_batch.msg[lsl_batch.count].msg_hdr.msg_namelen = lsl.addrlen;
+  lsl_batch.msg[lsl_batch.count].msg_hdr.msg_iov     = &lsl_batch.iov[lsl_batch.count];
+  lsl_batch.msg[lsl_batch.count].msg_hdr.msg_iovlen  = 1;
+  ++lsl_batch.count;
+}
+
+void log_syslog_commit(void)
+{
+  unsigned int sent = 0;
+  int res;
+
+  while (sent < lsl_batch.count)
+  {
+    res = sendmmsg(lsl.fd, lsl_batch.msg + sent, lsl_batch.count - sent, MSG_NOSIGNAL);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res < 0 && errno == EMSGSIZE)
+    {
+      ++sent;  /* skip the record the daemon does not take */
+      continue;
+    }
+    if (res <= 0)
+      break;   /* no syslog daemon listening - records are lost */
+    sent += res;
+  }
+  lsl_batch.count = 0;
+}
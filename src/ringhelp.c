@@ -0,0 +1,183 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ringhelp.h"
+
+#define RING_MAGIC     0x474e4952u /* "RING" */
+#define RING_CACHELINE 64
+
+struct ring_slot
+{
+  _Atomic uint64_t seq;
+  uint64_t         pos;
+  /* payload follows, 16 byte aligned */
+};
+
+struct ring
+{
+  _Alignas(RING_CACHELINE) _Atomic uint64_t head;  /* next position to reserve */
+  _Alignas(RING_CACHELINE) _Atomic uint64_t tail;  /* next position to acquire */
+  _Alignas(RING_CACHELINE) uint32_t magic;
+  uint32_t                 stride;
+  uint64_t                 mask;
+  _Alignas(RING_CACHELINE) unsigned char slots[];
+};
+
+static size_t ring_stride(size_t slot_size)
+{
+  return (sizeof(struct ring_slot) + slot_size + 15) & ~(size_t) 15;
+}
+
+static size_t ring_round_slots(size_t slots)
+{
+  size_t n = 2;
+  while (n < slots)
+    n <<= 1;
+  return n;
+}
+
+static inline struct ring_slot * ring_slot_at(struct ring * r, uint64_t pos)
+{
+  return (struct ring_slot *) (r->slots + (pos & r->mask) * r->stride);
+}
+
+size_t ring_mem_size(size_t slots, size_t slot_size)
+{
+  return sizeof(struct ring) + ring_round_slots(slots) * ring_stride(slot_size);
+}
+
+struct ring * ring_init(void * mem, size_t slots, size_t slot_size)
+{
+  struct ring * r = (struct ring *) mem;
+
+  if (r == NULL || slot_size == 0 || ring_stride(slot_size) > UINT32_MAX)
+    return NULL;
+
+  slots = ring_round_slots(slots);
+  memset(r, 0, sizeof(*r));
+  r->stride = (uint32_t) ring_stride(slot_size);
+  r->mask   = slots - 1;
+  for (uint64_t i = 0; i < slots; i++)
+    atomic_init(&ring_slot_at(r, i)->seq, i);
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  atomic_thread_fence(memory_order_release);
+  r->magic  = RING_MAGIC;
+  return r;
+}
+
+struct ring * ring_attach(void * mem)
+{
+  struct ring * r = (struct ring *) mem;
+  if (r == NULL || r->magic != RING_MAGIC)
+    return NULL;
+  atomic_thread_fence(memory_order_acquire);
+  return r;
+}
+
+void * ring_reserve(struct ring * r)
+{
+  uint64_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+  struct ring_slot * slot;
+
+  for (;;)
+  {
+    slot = ring_slot_at(r, pos);
+    int64_t dif = (int64_t) (atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+    if (dif == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (dif < 0)
+      return NULL;  /* full */
+    else
+      pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+  }
+  slot->pos = pos;
+  return slot + 1;
+}
+
+void ring_commit(struct ring * r, void * payload)
+{
+  struct ring_slot * slot = (struct ring_slot *) payload - 1;
+  (void) r;
+  atomic_store_explicit(&slot->seq, slot->pos + 1, memory_order_release);
+}
+
+void * ring_acquire(struct ring * r)
+{
+  uint64_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  struct ring_slot * slot;
+
+  for (;;)
+  {
+    slot = ring_slot_at(r, pos);
+    int64_t dif = (int64_t) (atomic_load_explicit(&slot->seq, memory_order_acquire) - (pos + 1));
+    if (dif == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (dif < 0)
+      return NULL;  /* empty or oldest slot still being written */
+    else
+      pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  }
+  slot->pos = pos;
+  return slot + 1;
+}
+
+void ring_release(struct ring * r, void * payload)
+{
+  struct ring_slot * slot = (struct ring_slot *) payload - 1;
+  atomic_store_explicit(&slot->seq, slot->pos + r->mask + 1, memory_order_release);
+}
+
+void * ring_stalled(struct ring * r)
+{
+  uint64_t pos = atomic_load_explicit(&r->tail, memory_order_acquire);
+  struct ring_slot * slot = ring_slot_at(r, pos);
+
+  /* slot->pos is written after the reserve, the dead producer may not have got there */
+  if (atomic_load_explicit(&r->head, memory_order_acquire) == pos ||
+      atomic_load_explicit(&slot->seq, memory_order_acquire) != pos)
+    return NULL;
+  return slot + 1;
+}
+
+int ring_skip(struct ring * r, void * payload)
+{
+  struct ring_slot * slot = (struct ring_slot *) payload - 1;
+  uint64_t pos = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+  if (ring_slot_at(r, pos) != slot)
+    return 0;
+  slot->pos = pos;
+  return atomic_compare_exchange_strong_explicit(&slot->seq, &pos, pos + 1, memory_order_release, memory_order_relaxed);
+}
+
+size_t ring_capacity(const struct ring * r)
+{
+  return (size_t) r->mask + 1;
+}
+
+size_t ring_slot_size(const struct ring * r)
+{
+  return r->stride - sizeof(struct ring_slot);
+}
+
+uint64_t ring_head(const struct ring * r)
+{
+  return atomic_load_explicit(&((struct ring *) r)->head, memory_order_acquire);
+}
+
+size_t ring_used(const struct ring * r)
+{
+  struct ring * rw = (struct ring *) r;
+  uint64_t tail = atomic_load_explicit(&rw->tail, memory_order_acquire);
+  uint64_t head = atomic_load_explicit(&rw->head, memory_order_acquire);
+  return head > tail ? (size_t) (head - tail) : 0;
+}
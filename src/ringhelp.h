@@ -0,0 +1,49 @@
+#ifndef _H_LINUXTOOLS_RINGHELP
+#define _H_LINUXTOOLS_RINGHELP
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded lock-free ring of fixed-size slots (sequence-per-slot scheme after
+ * D. Vyukov). Any number of threads may reserve/commit and acquire/release
+ * concurrently. The ring holds offsets only, no pointers, so it may be placed
+ * in memory shared between processes.
+ *
+ * producer: slot = ring_reserve(r); fill slot; ring_commit(r, slot);
+ * consumer: slot = ring_acquire(r); read slot; ring_release(r, slot);
+ *
+ * A producer dying between reserve and commit blocks the consumers at its
+ * slot. ring_stalled returns that slot, ring_skip commits it on behalf of
+ * the producer - only once the producer is known to be gone, a late commit
+ * would corrupt the ring. The next ring_acquire returns the skipped slot.
+ */
+
+struct ring;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  size_t        ring_mem_size(size_t slots, size_t slot_size);
+  struct ring * ring_init(void * mem, size_t slots, size_t slot_size);
+  struct ring * ring_attach(void * mem);
+
+  void *   ring_reserve(struct ring * r);
+  void     ring_commit(struct ring * r, void * slot);
+  void *   ring_acquire(struct ring * r);
+  void     ring_release(struct ring * r, void * slot);
+  void *   ring_stalled(struct ring * r);  /* oldest slot, if reserved but not committed */
+  int      ring_skip(struct ring * r, void * slot);
+
+  size_t   ring_capacity(const struct ring * r);
+  size_t   ring_slot_size(const struct ring * r);
+  uint64_t ring_head(const struct ring * r);
+  size_t   ring_used(const struct ring * r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // _H_LINUXTOOLS_RINGHELP
@@ -0,0 +1,71 @@
+#include <time.h>
+
+#include "stathelp.h"
+
+static unsigned int stat_hist_index(uint64_t val)
+{
+  unsigned int idx = val ? 64 - __builtin_clzll(val) : 0;
+  return idx < STAT_HIST_BUCKETS ? idx : STAT_HIST_BUCKETS - 1;
+}
+
+void stat_hist_add(struct stat_hist * h, uint64_t val)
+{
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+  __atomic_add_fetch(&h->bucket[stat_hist_index(val)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum, val, __ATOMIC_RELAXED);
+  while (val > max && !__atomic_compare_exchange_n(&h->max, &max, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+void stat_hist_snapshot(struct stat_hist * dst, const struct stat_hist * src)
+{
+  dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+  dst->sum   = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+  dst->max   = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+  for (unsigned int i = 0; i < STAT_HIST_BUCKETS; i++)
+    dst->bucket[i] = __atomic_load_n(&src->bucket[i], __ATOMIC_RELAXED);
+}
+
+void stat_hist_reset(struct stat_hist * h)
+{
+  __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+  for (unsigned int i = 0; i < STAT_HIST_BUCKETS; i++)
+    __atomic_store_n(&h->bucket[i], 0, __ATOMIC_RELAXED);
+}
+
+uint64_t stat_hist_percentile(const struct stat_hist * h, double p)
+{
+  uint64_t total = 0, rank, seen = 0;
+  unsigned int i;
+
+  for (i = 0; i < STAT_HIST_BUCKETS; i++)
+    total += h->bucket[i];
+  if (total == 0)
+    return 0;
+
+  rank = (uint64_t) (p * total + 0.5);
+  if (rank == 0)
+    rank = 1;
+  for (i = 0; i < STAT_HIST_BUCKETS; i++)
+  {
+    seen += h->bucket[i];
+    if (seen >= rank)
+      break;
+  }
+  if (i == 0)
+    return 0;
+  if (i >= STAT_HIST_BUCKETS - 1 || ((1ull << i) - 1) > h->max)
+    return h->max;
+  return (1ull << i) - 1;
+}
+
+uint64_t stat_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,39 @@
+#ifndef _H_LINUXTOOLS_STATHELP
+#define _H_LINUXTOOLS_STATHELP
+
+#include <stdint.h>
+
+/*
+ * Log2 histogram, e.g. of latencies in ns. Bucket 0 counts zeros, bucket i
+ * values in [2^(i-1), 2^i). Any number of threads may add concurrently
+ * (relaxed atomics), a snapshot may be taken at any time - its fields are
+ * consistent each on its own, not with each other.
+ */
+
+#define STAT_HIST_BUCKETS 64
+
+struct stat_hist
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t bucket[STAT_HIST_BUCKETS];
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  void     stat_hist_add(struct stat_hist * h, uint64_t val);
+  void     stat_hist_snapshot(struct stat_hist * dst, const struct stat_hist * src);
+  void     stat_hist_reset(struct stat_hist * h);
+  uint64_t stat_hist_percentile(const struct stat_hist * h, double p);  /* p in [0, 1], upper bucket bound */
+
+  uint64_t stat_now_ns(void);  /* CLOCK_MONOTONIC */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // _H_LINUXTOOLS_STATHELP
@@ -1,21 +1,350 @@
-#include <ctype.h>
+#include <math.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "stringhelp.h"
 
+static const char str_digit_pairs[] =
+  "00010203040506070809" "10111213141516171819" "20212223242526272829" "30313233343536373839" "40414243444546474849"
+  "50515253545556575859" "60616263646566676869" "70717273747576777879" "80818283848586878889" "90919293949596979899";
+
+static const uint64_t str_pow10[STR_FIXED_PREC_MAX + 1] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull
+};
+
+
+/*
+ * String kernels: 8 bytes per step in a 64 bit word (SWAR), 16 with SSE2 or
+ * NEON, a byte loop for the rest. Loads may read past the terminating '\0',
+ * but only within the page of the string - they never fault. ASan does not
+ * know that, the kernels are exempt from its checks.
+ */
+
+#define STR_ONES  0x0101010101010101ull
+#define STR_LOW7  0x7f7f7f7f7f7f7f7full
+#define STR_HIGHS 0x8080808080808080ull
+#define STR_PAGE  4096
+
+#if defined(__GNUC__)
+#define STR_OVERREAD __attribute__((no_sanitize_address))
+#else
+#define STR_OVERREAD
+#endif
+
+typedef uint64_t str_word __attribute__((aligned(1), may_alias));
+
+static inline int str_page_safe(const void * p, size_t n)
+{
+  return ((uintptr_t) p & (STR_PAGE - 1)) <= STR_PAGE - n;
+}
+
+static inline uint64_t str_load(const char * p)
+{
+  return *(const str_word *) p;
+}
+
+/* high bit of every byte that is 0 - exact, no false positives */
+static inline uint64_t str_zero_bytes(uint64_t w)
+{
+  return ~(((w & STR_LOW7) + STR_LOW7) | w | STR_LOW7);
+}
+
+/* index of the first flagged byte in memory order */
+static inline unsigned int str_first_byte(uint64_t flags)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (unsigned int) __builtin_clzll(flags) / 8;
+#else
+  return (unsigned int) __builtin_ctzll(flags) / 8;
+#endif
+}
+
+/* 'a'..'z' -> 'A'..'Z' in every byte, other bytes (non-ASCII too) unchanged */
+static inline uint64_t str_upper_word(uint64_t w)
+{
+  uint64_t low7 = w & STR_LOW7;
+  uint64_t ge_a = low7 + (0x80 - 'a') * STR_ONES;
+  uint64_t gt_z = low7 + (0x7f - 'z') * STR_ONES;
+
+  return w ^ (((ge_a ^ gt_z) & ~w & STR_HIGHS) >> 2);
+}
+
+static inline int str_upper(unsigned char c)
+{
+  return (unsigned int) (c - 'a') < 26u ? c - ('a' - 'A') : c;
+}
+
+#if defined(__SSE2__)
+static inline __m128i str_upper_vec(__m128i x)
+{
+  __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('z' + 1)));
+  return _mm_xor_si128(x, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static inline uint8x16_t str_upper_vec(uint8x16_t x)
+{
+  uint8x16_t lower = vcltq_u8(vsubq_u8(x, vdupq_n_u8('a')), vdupq_n_u8(26));
+  return veorq_u8(x, vandq_u8(lower, vdupq_n_u8(0x20)));
+}
+#endif
+
+
 int stricmp(const char * str1, const char * str2)
 {
   return strincmp(str1, str2, SIZE_MAX);
 }
 
-int strincmp(const char * str1, const char * str2, size_t len)
+/* ASCII only, no locale: compares at most len chars, difference of the first unequal ones upper case */
+STR_OVERREAD int strincmp(const char * str1, const char * str2, size_t len)
 {
-  int idx;
-  for (;*str1 != '\0' && *str2 != '\0' && len > 1; ++str1, ++str2, --len)
+  const unsigned char * a = (const unsigned char *) str1;
+  const unsigned char * b = (const unsigned char *) str2;
+  size_t i = 0, end;
+  int ca, cb;
+
+  for (;;)
   {
-    idx = toupper(*str1) - toupper(*str2);
-    if (idx)
-      return idx;
+#if defined(__SSE2__)
+    while (len - i >= 16 && str_page_safe(a + i, 16) && str_page_safe(b + i, 16))
+    {
+      __m128i x = _mm_loadu_si128((const __m128i *) (a + i));
+      __m128i y = _mm_loadu_si128((const __m128i *) (b + i));
+      __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_setzero_si128()),
+                                  _mm_xor_si128(_mm_cmpeq_epi8(str_upper_vec(x), str_upper_vec(y)), _mm_set1_epi8(-1)));
+      unsigned int mask = (unsigned int) _mm_movemask_epi8(stop);
+      if (mask)
+      {
+        i += (size_t) __builtin_ctz(mask);
+        return str_upper(a[i]) - str_upper(b[i]);
+      }
+      i += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    while (len - i >= 16 && str_page_safe(a + i, 16) && str_page_safe(b + i, 16))
+    {
+      uint8x16_t x = vld1q_u8(a + i);
+      uint8x16_t y = vld1q_u8(b + i);
+      uint8x16_t stop = vorrq_u8(vceqq_u8(x, vdupq_n_u8(0)), vmvnq_u8(vceqq_u8(str_upper_vec(x), str_upper_vec(y))));
+      if (vmaxvq_u8(stop))
+        break;
+      i += 16;
+    }
+#endif
+    while (len - i >= 8 && str_page_safe(a + i, 8) && str_page_safe(b + i, 8))
+    {
+      uint64_t x = str_load((const char *) a + i);
+      uint64_t stop = str_zero_bytes(x) | (~str_zero_bytes(str_upper_word(x) ^ str_upper_word(str_load((const char *) b + i))) & STR_HIGHS);
+      if (stop)
+      {
+        i += str_first_byte(stop);
+        return str_upper(a[i]) - str_upper(b[i]);
+      }
+      i += 8;
+    }
+
+    /* the end or a page boundary is within the next 8 bytes */
+    end = len - i > 8 ? i + 8 : len;
+    for (; i < end; i++)
+    {
+      ca = str_upper(a[i]);
+      cb = str_upper(b[i]);
+      if (ca != cb || ca == 0)
+        return ca - cb;
+    }
+    if (i == len)
+      return 0;
   }
-  return toupper(*str1) - toupper(*str2);
 }
 
+/* aligned loads never cross a page, bytes in front of str are masked */
+STR_OVERREAD size_t str_nlen(const char * str, size_t max)
+{
+  size_t off, i, pos;
+
+#if defined(__SSE2__)
+  const char * base = (const char *) ((uintptr_t) str & ~(uintptr_t) 15);
+  unsigned int mask;
+
+  off  = (size_t) (str - base);
+  mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *) base), _mm_setzero_si128())) >> off;
+  for (i = 0; mask == 0; i += 16)
+  {
+    if (16 - off + i >= max)
+      return max;
+    mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *) (base + 16 + i)), _mm_setzero_si128()));
+    if (mask)
+    {
+      pos = 16 - off + i + (size_t) __builtin_ctz(mask);
+      return pos < max ? pos : max;
+    }
+  }
+  pos = (size_t) __builtin_ctz(mask);
+  return pos < max ? pos : max;
+#else
+  const char * base = (const char *) ((uintptr_t) str & ~(uintptr_t) 7);
+  uint64_t flags;
+
+  off = (size_t) (str - base);
+  flags = str_zero_bytes(str_load(base));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  flags &= off ? ~0ull >> (8 * off) : ~0ull;
+#else
+  flags &= ~0ull << (8 * off);
+#endif
+  for (i = 0; flags == 0; i += 8)
+  {
+    if (8 - off + i >= max)
+      return max;
+    flags = str_zero_bytes(str_load(base + 8 + i));
+    if (flags)
+    {
+      pos = 8 - off + i + str_first_byte(flags);
+      return pos < max ? pos : max;
+    }
+  }
+  pos = str_first_byte(flags) - off;
+  return pos < max ? pos : max;
+#endif
+}
+
+/* bytes up to the next '/' or the end, e.g. to split MQTT topics in levels */
+STR_OVERREAD size_t str_level_len(const char * topic)
+{
+  const char * p = topic;
+  uint64_t w, flags;
+
+#if defined(__SSE2__)
+  while (str_page_safe(p, 16))
+  {
+    __m128i x = _mm_loadu_si128((const __m128i *) p);
+    unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_setzero_si128()),
+                                                                      _mm_cmpeq_epi8(x, _mm_set1_epi8('/'))));
+    if (mask)
+      return (size_t) (p - topic) + (unsigned int) __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  for (;;)
+  {
+    if (str_page_safe(p, 8))
+    {
+      w = str_load(p);
+      flags = str_zero_bytes(w) | str_zero_bytes(w ^ ('/' * STR_ONES));
+      if (flags)
+        return (size_t) (p - topic) + str_first_byte(flags);
+      p += 8;
+      continue;
+    }
+    for (size_t n = 0; n < 8; n++, p++)  /* across the page boundary */
+      if (*p == '\0' || *p == '/')
+        return (size_t) (p - topic);
+  }
+}
+
+static inline uint64_t str_mix(uint64_t h)
+{
+  h *= 0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 29);
+}
+
+/* a word per step; equal for strings differing in ASCII case only - not stable across byte orders */
+STR_OVERREAD uint64_t str_ihash(const char * str, size_t len)
+{
+  uint64_t h = 0x243f6a8885a308d3ull ^ len;
+  uint64_t w = 0;
+  size_t i, rest;
+
+  for (i = 0; len - i >= 8; i += 8)
+    h = str_mix(h ^ str_upper_word(str_load(str + i)));
+  rest = len - i;
+  if (rest)
+  {
+    if (str_page_safe(str + i, 8))
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      w = str_load(str + i) & ~0ull << (64 - 8 * rest);
+#else
+      w = str_load(str + i) & ~(~0ull << (8 * rest));
+#endif
+    else
+      memcpy(&w, str + i, rest);
+    h = str_mix(h ^ str_upper_word(w));
+  }
+  return str_mix(h);
+}
+
+
+/* writes value backwards, two digits per division - returns the first char */
+static char * str_put_u64(char * end, uint64_t value)
+{
+  while (value >= 100)
+  {
+    unsigned int pair = (unsigned int) (value % 100) * 2;
+    value /= 100;
+    *--end = str_digit_pairs[pair + 1];
+    *--end = str_digit_pairs[pair];
+  }
+  if (value >= 10)
+  {
+    *--end = str_digit_pairs[value * 2 + 1];
+    *--end = str_digit_pairs[value * 2];
+  }
+  else
+    *--end = (char) ('0' + value);
+  return end;
+}
+
+size_t str_u64(char * out, uint64_t value)
+{
+  char tmp[20];
+  char * start = str_put_u64(tmp + sizeof(tmp), value);
+  size_t len = (size_t) (tmp + sizeof(tmp) - start);
+
+  memcpy(out, start, len);
+  out[len] = '\0';
+  return len;
+}
+
+size_t str_i64(char * out, int64_t value)
+{
+  if (value >= 0)
+    return str_u64(out, (uint64_t) value);
+  out[0] = '-';
+  return 1 + str_u64(out + 1, 0 - (uint64_t) value);  /* INT64_MIN safe */
+}
+
+size_t str_fixed(char * out, double value, unsigned int prec)
+{
+  double abs = value < 0 ? -value : value;
+  uint64_t scaled, frac;
+  char * pos = out;
+  char tmp[STR_FIXED_PREC_MAX];
+
+  if (prec > STR_FIXED_PREC_MAX)
+    prec = STR_FIXED_PREC_MAX;
+
+  if (isnan(value))
+    return (size_t) snprintf(out, STR_NUM_LEN, "nan");
+  if (abs * (double) str_pow10[prec] >= 18446744073709549568.0)  /* largest double below 2^64 */
+    return (size_t) snprintf(out, STR_NUM_LEN, "%.*e", (int) prec, value);  /* also inf */
+
+  scaled = (uint64_t) (abs * (double) str_pow10[prec] + 0.5);
+  if (value < 0 && scaled)
+    *pos++ = '-';
+  pos += str_u64(pos, scaled / str_pow10[prec]);
+  if (prec)
+  {
+    frac = scaled % str_pow10[prec];
+    memset(tmp, '0', prec);
+    str_put_u64(tmp + prec, frac);
+    *pos++ = '.';
+    memcpy(pos, tmp, prec);
+    pos += prec;
+  }
+  *pos = '\0';
+  return (size_t) (pos - out);
+}
@@ -2,14 +2,35 @@
 #define _H_LINUXTOOLS_STRINGHELP
 
 #include <stddef.h>
+#include <stdint.h>
+
+#define STR_NUM_LEN        32  // buffer size for str_u64/str_i64/str_fixed, '\0' included
+#define STR_FIXED_PREC_MAX 9
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-  int stricmp(const char * str1, const char * str2);
-  int strincmp(const char * str1, const char * str2, size_t len);
+  /*
+   * string kernels - word at a time, SSE2/NEON where available. Case is
+   * ASCII case, independent of the locale.
+   */
+  int      stricmp(const char * str1, const char * str2);
+  int      strincmp(const char * str1, const char * str2, size_t len);  // at most len chars
+  size_t   str_nlen(const char * str, size_t max);   // as strnlen
+  size_t   str_level_len(const char * topic);        // chars up to the next '/' or '\0'
+  uint64_t str_ihash(const char * str, size_t len);  // case-insensitive hash
+
+  /*
+   * printf-free number formatting into a buffer of STR_NUM_LEN bytes. Return
+   * the length written (without '\0'). str_fixed rounds to prec decimals (at
+   * most STR_FIXED_PREC_MAX) and keeps trailing zeros, values beyond the
+   * 64 bit range come in exponent notation.
+   */
+  size_t str_u64(char * out, uint64_t value);
+  size_t str_i64(char * out, int64_t value);
+  size_t str_fixed(char * out, double value, unsigned int prec);
 
 #ifdef __cplusplus
 }
@@ -1,7 +1,11 @@
 #include <errno.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 
 #include "ctrl/com/mqtt.h"
 #include "ctrl/logger.h"
@@ -10,10 +14,33 @@
 #define DEFAULT_LOG_FAC LF_STDOUT
 #define DEFAULT_LOG_LEVEL LL_INFO
 
+#define SELFTEST_TOPIC "linuxtools/selftest"
+#define SELFTEST_MS    5000
+#define SELFTEST_SKIP  77   /* ctest SKIP_RETURN_CODE */
+
 void receive_test(const char * topic, const char * payload) {
   LG_INFO("received %s -> %s.", topic, payload);
 }
 
+void state_test(enum mqtt_state state, const char * reason) {
+  LG_INFO("MQTT connection %s (%s).", mqtt_get_state_name(state), reason ? reason : "-");
+}
+
+/* selftest: the message published once connected has to come back within SELFTEST_MS */
+static char selftest_payload[64];
+static volatile int selftest_done = FALSE;
+
+static void receive_selftest(const char * topic, const char * payload) {
+  LG_INFO("received %s -> %s.", topic, payload);
+  if (strcmp(payload, selftest_payload) == 0)
+    selftest_done = TRUE;
+}
+
+static struct mqtt_sub selftest_subs[] = {
+                                           { SELFTEST_TOPIC, receive_selftest},
+                                           { NULL          , NULL            }
+                                         };
+
 struct mqtt_sub subs[] = {
                            { "MTDC"            , receive_test},
                            { "grafana/circ1_on", receive_test},
@@ -22,32 +49,27 @@ struct mqtt_sub subs[] = {
 
 
 struct mqtt_config cfg = {
-    "localhost",
-    1883,
-    "linuxtools",
-    "test",
-    2,
-    subs
+    .remote_address = "localhost",
+    .remote_port    = 1883,
+    .client_id      = "linuxtools",
+    .topic          = "test",
+    .qos            = 2,
+    .subs           = subs,
+    .overflow       = MQTT_OVF_BLOCK,
+    .spool_evict    = MQTT_OVF_DROP_OLDEST,
+    .on_state       = state_test,
+    .stats_topic    = "linuxtools/stats",
+    .stats_s        = 60,
 };
 
 
-int abort_rx_loop = FALSE;
+volatile int abort_rx_loop = FALSE;
 
 int read_loop()
 {
   struct mqtt_handle * mqtt = NULL;
-  int do_log = TRUE;
 
-  while(!abort_rx_loop && mqtt_init(&mqtt, &cfg) == MQTT_RET_RETRY)
-  {
-    if (do_log)
-    {
-      LG_WARN("MQTT - Could not connect to broker. Syscall returned '%s'. Retry every 5 sec.", strerror(errno));
-      do_log = FALSE;
-    }
-    sleep(5);
-  }
-  if (mqtt == NULL)
+  if (mqtt_connect_async(&mqtt, &cfg) != MQTT_RET_OK)
   {
     LG_CRITICAL("Could not initialize mqtt API.");
     goto END;
@@ -56,8 +78,8 @@ int read_loop()
 
   LG_INFO("Starting test.");
 
-  while(!abort_rx_loop)
-     mqtt_loop(mqtt, 0);
+  if (!mqtt_epoll_run(mqtt, &abort_rx_loop))
+    LG_ERROR("MQTT event loop failed.");
 
 END:
   if (mqtt) {
@@ -67,6 +89,79 @@ END:
   return -1;
 }
 
+static long long now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* bounded round trip against the broker of cfg: connect, subscribe, publish, receive - 0: passed, SELFTEST_SKIP: no broker */
+static int selftest(void)
+{
+  struct mqtt_handle * mqtt = NULL;
+  struct epoll_event ev;
+  long long deadline = now_ms() + SELFTEST_MS;
+  int published = FALSE;
+  int result = 1;
+  int epfd, n, wait;
+
+  cfg.subs        = selftest_subs;
+  cfg.stats_topic = NULL;
+  snprintf(selftest_payload, sizeof(selftest_payload), "selftest %d %lld", (int) getpid(), deadline);
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0 || mqtt_connect_async(&mqtt, &cfg) != MQTT_RET_OK)
+  {
+    LG_CRITICAL("Selftest - could not initialize.");
+    goto SELFTEST_END;
+  }
+
+  while (!selftest_done && !abort_rx_loop && now_ms() < deadline)
+  {
+    if (mqtt_next_timeout(mqtt) == 0)
+      mqtt_on_timeout(mqtt);
+    /* on_connect subscribes after reporting CONNECTED - the publish has to go behind it */
+    if (!published && mqtt_get_state(mqtt) == MQTT_STATE_CONNECTED)
+    {
+      mqtt_publish_raw(mqtt, SELFTEST_TOPIC, selftest_payload);
+      published = TRUE;
+    }
+    if (!mqtt_epoll_update(mqtt, epfd))
+      goto SELFTEST_END;
+    wait = mqtt_next_timeout(mqtt);
+    if (deadline - now_ms() < wait)
+      wait = (int) (deadline - now_ms());
+    n = epoll_wait(epfd, &ev, 1, wait > 0 ? wait : 0);
+    if (n < 0 && errno != EINTR)
+      goto SELFTEST_END;
+    if (n > 0)
+      mqtt_epoll_dispatch(ev.data.ptr, ev.events);
+  }
+
+  if (selftest_done)
+    result = 0;
+  else if (!published)
+  {
+    LG_WARN("Selftest - no connection to %s:%d within %d ms, skipped.", cfg.remote_address, cfg.remote_port, SELFTEST_MS);
+    result = SELFTEST_SKIP;
+  }
+  else
+    LG_ERROR("Selftest - message not received back within %d ms.", SELFTEST_MS);
+
+SELFTEST_END:
+  if (mqtt)
+  {
+    mqtt_close(mqtt);
+    free(mqtt);
+  }
+  if (epfd >= 0)
+    close(epfd);
+  LG_INFO("Selftest %s.", result == 0 ? "passed" : result == SELFTEST_SKIP ? "skipped" : "failed");
+  return result;
+}
+
 void sig_stop() {
   abort_rx_loop = TRUE;
 }
@@ -82,7 +177,7 @@ int main(int argc, char *argv[]) {
            argv[0], log_get_facility_name(DEFAULT_LOG_FAC), log_get_level_name(DEFAULT_LOG_LEVEL, TRUE));
   log_push(LL_NONE, "############################################################################################");
 
-  if (argc > 1)
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "selftest") != 0))
     LG_WARN("Ignoring exceding cli parameters.");
   // Set signal handler
   signal_action.sa_handler = sig_stop;
@@ -92,5 +187,7 @@ int main(int argc, char *argv[]) {
   sigaction(SIGHUP, &signal_action, NULL);
   sigaction(SIGTERM, &signal_action, NULL);
 
+  if (argc == 2 && strcmp(argv[1], "selftest") == 0)
+    return selftest();
   return read_loop();
 }
@@ -1,17 +1,176 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 
-char tmbuf[128];
+#include "timehelp.h"
+#include "stuff.h"
 
-char outbuf[128];
+#define TS_CACHE_LEN   4
+#define TS_FORMAT_LEN  32   /* longer formats are not cached */
+#define TS_PREFIX_LEN  128
+
+struct ts_cache
+{
+  char     format[TS_FORMAT_LEN];
+  int      with_offset;  /* part of the key along with format - the suffix depends on it */
+  time_t   sec;
+  unsigned tz_gen;
+  size_t   prefix_len;
+  size_t   suffix_len;
+  char     prefix[TS_PREFIX_LEN];
+  char     suffix[8];
+};
+
+static const char * ts_style_format[] = {
+  "%d.%m.%y %H:%M:%S",    /* TS_LOGGER   */
+  "%Y-%m-%dT%H:%M:%S",    /* TS_RFC3339  */
+  NULL                    /* TS_EPOCH_NS */
+};
+
+static unsigned ts_tz_gen;
+
+static __thread struct ts_cache ts_cache[TS_CACHE_LEN];
+static __thread struct ts_cache ts_uncached;
+static __thread unsigned        ts_cache_next;
+static __thread char            outbuf[128];
+
+
+void ts_tz_changed(void)
+{
+  tzset();
+  __atomic_add_fetch(&ts_tz_gen, 1, __ATOMIC_RELEASE);
+}
+
+static struct ts_cache * ts_lookup(time_t sec, const char * format, int with_offset)
+{
+  unsigned tz_gen = __atomic_load_n(&ts_tz_gen, __ATOMIC_ACQUIRE);
+  struct ts_cache * c = NULL;
+  struct tm tm;
+
+  size_t len = strnlen(format, TS_FORMAT_LEN);
+
+  if (len == TS_FORMAT_LEN)
+    c = &ts_uncached;
+  else
+    for (size_t i = 0; i < TS_CACHE_LEN; i++)
+    {
+      if (ts_cache[i].with_offset == with_offset && strcmp(ts_cache[i].format, format) == 0)
+      {
+        c = &ts_cache[i];
+        if (c->sec == sec && c->tz_gen == tz_gen && c->prefix_len)
+          return c;
+        break;
+      }
+    }
+
+  if (c == NULL)
+  {
+    c = &ts_cache[ts_cache_next++ % TS_CACHE_LEN];
+    memcpy(c->format, format, len + 1);
+    c->with_offset = with_offset;
+  }
+
+  localtime_r(&sec, &tm);
+  c->sec        = sec;
+  c->tz_gen     = tz_gen;
+  c->prefix_len = strftime(c->prefix, sizeof(c->prefix), format, &tm);
+  c->suffix_len = 0;
+  if (with_offset)
+  {
+    long off = tm.tm_gmtoff / 60;
+    if (off == 0)
+      c->suffix_len = snprintf(c->suffix, sizeof(c->suffix), "Z");
+    else
+      c->suffix_len = snprintf(c->suffix, sizeof(c->suffix), "%c%02ld:%02ld", off < 0 ? '-' : '+', labs(off) / 60, labs(off) % 60);
+  }
+  return c;
+}
+
+static size_t ts_put_digits(char * buf, uint64_t val, int digits)
+{
+  for (int i = digits - 1; i >= 0; i--)
+  {
+    buf[i] = (char) ('0' + val % 10);
+    val /= 10;
+  }
+  return digits;
+}
+
+static size_t ts_compose(const struct timespec * ts, const char * format, int digits, int with_offset, char * buf, size_t buflen)
+{
+  static const uint32_t scale[] = { 1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1 };
+  struct ts_cache * c;
+  size_t len;
+
+  if (digits < 0)
+    digits = 0;
+  else if (digits > 9)
+    digits = 9;
+
+  c = ts_lookup(ts->tv_sec, format, with_offset);
+  len = c->prefix_len + (digits ? digits + 1 : 0) + c->suffix_len;
+  if (len >= buflen)
+  {
+    if (buflen)
+      buf[0] = '\0';
+    return 0;
+  }
+
+  memcpy(buf, c->prefix, c->prefix_len);
+  len = c->prefix_len;
+  if (digits)
+  {
+    buf[len++] = '.';
+    len += ts_put_digits(buf + len, (uint64_t) ts->tv_nsec / scale[digits], digits);
+  }
+  memcpy(buf + len, c->suffix, c->suffix_len);
+  len += c->suffix_len;
+  buf[len] = '\0';
+  return len;
+}
+
+size_t ts_format(const struct timespec * ts, enum ts_style style, char * buf, size_t buflen)
+{
+  char tmp[24];
+  uint64_t ns;
+  size_t len = 0;
+
+  switch (style)
+  {
+    case TS_LOGGER : return ts_compose(ts, ts_style_format[style], 6, FALSE, buf, buflen);
+    case TS_RFC3339: return ts_compose(ts, ts_style_format[style], 6, TRUE, buf, buflen);
+    case TS_EPOCH_NS:
+      ns = (uint64_t) ts->tv_sec * 1000000000ull + (uint64_t) ts->tv_nsec;
+      do {
+        tmp[sizeof(tmp) - ++len] = (char) ('0' + ns % 10);
+        ns /= 10;
+      } while (ns);
+      if (len >= buflen)
+        break;
+      memcpy(buf, tmp + sizeof(tmp) - len, len);
+      buf[len] = '\0';
+      return len;
+    default:
+      break;
+  }
+  if (buflen)
+    buf[0] = '\0';
+  return 0;
+}
+
+size_t ts_format_custom(const struct timespec * ts, const char * format, int digits, char * buf, size_t buflen)
+{
+  return ts_compose(ts, format, digits, FALSE, buf, buflen);
+}
 
 
 const char * getTimeValString(struct timeval tv, const char * format, char * buf, size_t buflen)
 {
-  time_t nowtime = tv.tv_sec;
-  struct tm * nowtm = localtime(&nowtime);
+  struct timespec ts = { tv.tv_sec, tv.tv_usec * 1000L };
 
   if (format == NULL)
     format = "%Y-%m-%d %H:%M:%S";
@@ -22,7 +181,6 @@ const char * getTimeValString(struct timeval tv, const char * format, char * buf
     buflen = sizeof(outbuf);
   }
 
-  strftime(tmbuf, sizeof(tmbuf), format, nowtm);
-  snprintf(buf, buflen, "%s.%06ld", tmbuf, tv.tv_usec);
+  ts_format_custom(&ts, format, 6, buf, buflen);
   return buf;
 }
@@ -2,12 +2,32 @@
 #define _H_LINUXTOOLS_TIMEHELP
 
 #include <stddef.h>
+#include <time.h>
+#include <sys/time.h>
+
+enum ts_style
+{
+  TS_LOGGER,    /* 17.10.26 12:34:56.123456            */
+  TS_RFC3339,   /* 2026-10-17T12:34:56.123456+02:00    */
+  TS_EPOCH_NS,  /* 1792232096123456789                 */
+
+  TS_COUNT
+};
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+  /*
+   * The date/second part of a timestamp is cached per thread and only rebuilt
+   * when the second or the timezone changes. After changing TZ call
+   * ts_tz_changed(). Return the length written (without '\0').
+   */
+  size_t ts_format(const struct timespec * ts, enum ts_style style, char * buf, size_t buflen);
+  size_t ts_format_custom(const struct timespec * ts, const char * format, int digits, char * buf, size_t buflen);
+  void   ts_tz_changed(void);
+
   const char * getTimeValString(struct timeval tv, const char * format, char * buf, size_t buflen);
 
 #ifdef __cplusplus
@@ -0,0 +1,179 @@
+/*
+ * linuxtools_logcollect - drains the shared memory log ring of LF_SHM processes
+ *
+ * usage: linuxtools_logcollect [-n name] [-s slots] [-f facility] [-N] [-o file] [-i ident]
+ *                              [-p poll_ms] [-r report_s] [-u]
+ *
+ *   -n  shm name (default /linuxtools-log), -s ring slots if the ring is created here
+ *   -f  stdout (default), file, user, local0 .. local7 - the sink records are written to
+ *   -N  syslog facilities as RFC5424 datagrams to /dev/log instead of syslog(3)
+ *   -o  log file for -f file (default <ident>.log)
+ *   -p  pause when the ring is empty, -r interval of drop reports (0: off)
+ *   -u  remove the shm segment on exit
+ *
+ * Records keep time, level and channel of the producer, the message is
+ * prefixed by "<ident>[<pid>]: ". Producers never wait for the collector -
+ * records not fitting into the ring are counted per process, increases are
+ * reported as warnings of the collector.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctrl/logger.h"
+
+#define COLLECT_BATCH 256
+
+static volatile sig_atomic_t stop;
+
+static struct collect_seen
+{
+  int                pid;
+  int                exited;
+  unsigned long long dropped;
+} seen[LOG_SHM_PROCS];
+
+static unsigned long long orphan_seen;
+
+
+static void collect_stop(int sig)
+{
+  (void) sig;
+  stop = TRUE;
+}
+
+static void collect_report(void)
+{
+  struct log_shm_proc_stats procs[LOG_SHM_PROCS];
+  unsigned long long orphan;
+  size_t count = log_shm_get_procs(procs, LOG_SHM_PROCS, &orphan);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    struct collect_seen * s = &seen[procs[i].slot];
+
+    if (s->pid != procs[i].pid)
+    {
+      s->pid     = procs[i].pid;
+      s->exited  = FALSE;
+      s->dropped = 0;
+    }
+    if (procs[i].dropped > s->dropped)
+      log_push(LL_WARN, "%s[%d]: %llu record(s) dropped, ring full (%llu written, %llu dropped in total).",
+               procs[i].ident, procs[i].pid, procs[i].dropped - s->dropped, procs[i].written, procs[i].dropped);
+    s->dropped = procs[i].dropped;
+    if (!procs[i].alive && !s->exited)
+    {
+      s->exited = TRUE;
+      log_push(LL_DEBUG, "%s[%d]: exited (%llu written, %llu dropped).", procs[i].ident, procs[i].pid, procs[i].written, procs[i].dropped);
+    }
+  }
+  if (orphan > orphan_seen)
+    log_push(LL_WARN, "%llu record(s) of processes beyond %d dropped, ring full.", orphan - orphan_seen, LOG_SHM_PROCS);
+  orphan_seen = orphan;
+
+  log_shm_reap();  /* a new process in a freed entry shows up with another pid */
+}
+
+static void collect_usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [-n name] [-s slots] [-f facility] [-N] [-o file] [-i ident] [-p poll_ms] [-r report_s] [-u]\n", name);
+}
+
+int main(int argc, char * argv[])
+{
+  struct log_file_config file = { 0 };
+  struct sigaction sa;
+  struct timespec idle_pause;
+  const char * name = NULL;
+  const char * ident = "logcollect";
+  enum log_facility facility = LF_STDOUT;
+  unsigned long slots = 0;
+  unsigned long poll_ms = 10;
+  unsigned long report_s = 10;
+  int native = FALSE;
+  int remove_shm = FALSE;
+  int idle = TRUE;
+  time_t report = 0;
+  struct timespec now;
+  size_t count;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:s:f:No:i:p:r:u")) != -1)
+  {
+    switch (c)
+    {
+      case 'n': name     = optarg;                        break;
+      case 's': slots    = strtoul(optarg, NULL, 10);     break;
+      case 'f': facility = log_get_facility(optarg);      break;
+      case 'N': native   = TRUE;                          break;
+      case 'o': file.path = optarg;                       break;
+      case 'i': ident    = optarg;                        break;
+      case 'p': poll_ms  = strtoul(optarg, NULL, 10);     break;
+      case 'r': report_s = strtoul(optarg, NULL, 10);     break;
+      case 'u': remove_shm = TRUE;                        break;
+      default:
+        collect_usage(argv[0]);
+        return 2;
+    }
+  }
+  if (facility >= LF_COUNT || facility == LF_SHM)
+  {
+    collect_usage(argv[0]);
+    return 2;
+  }
+
+  log_set_file_config(&file);
+  log_init(ident, native ? (enum log_facility) (facility | LF_NATIVE) : facility, LL_DEBUG_MAX);
+  if (!log_shm_collect_open(name, slots))
+  {
+    log_push(LL_CRITICAL, "Could not map shared memory log ring %s.", name ? name : LOG_SHM_NAME);
+    log_flush();
+    return 1;
+  }
+
+  sa.sa_handler = collect_stop;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  idle_pause.tv_sec  = (time_t) (poll_ms / 1000);
+  idle_pause.tv_nsec = (long) (poll_ms % 1000) * 1000000L;
+
+  while (!stop)
+  {
+    count = log_shm_collect(COLLECT_BATCH);
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (report_s && now.tv_sec >= report)
+    {
+      report = now.tv_sec + (time_t) report_s;
+      collect_report();
+    }
+
+    if (count)
+    {
+      idle = FALSE;
+      continue;
+    }
+    if (!idle)
+    {
+      log_flush();
+      idle = TRUE;
+    }
+    nanosleep(&idle_pause, NULL);
+  }
+
+  while (log_shm_collect(COLLECT_BATCH))
+    ;
+  if (report_s)
+    collect_report();
+  log_flush();
+  log_shm_collect_close(remove_shm);
+  return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * linuxtools_logdecode - turns binary log files (see log_binary_open) back into text
+ *
+ * usage: linuxtools_logdecode [file ...]   (reads stdin if no file is given)
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ctrl/logger.h"
+#include "ctrl/logger_bin.h"
+#include "timehelp.h"
+
+struct fmt_entry
+{
+  uint64_t id;
+  char *   text;
+};
+
+static struct fmt_table
+{
+  struct fmt_entry * entries;
+  size_t             size;
+  size_t             used;
+} fmts;
+
+static struct fmt_entry * fmt_slot(uint64_t id)
+{
+  size_t idx = (id >> 3) & (fmts.size - 1);
+  while (fmts.entries[idx].text && fmts.entries[idx].id != id)
+    idx = (idx + 1) & (fmts.size - 1);
+  return &fmts.entries[idx];
+}
+
+static void fmt_define(uint64_t id, const char * text)
+{
+  struct fmt_entry * e;
+
+  if (fmts.used * 2 >= fmts.size)
+  {
+    struct fmt_table old = fmts;
+    fmts.size    = old.size ? old.size * 2 : 256;
+    fmts.used    = 0;
+    fmts.entries = calloc(fmts.size, sizeof(*fmts.entries));
+    if (fmts.entries == NULL)
+    {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    for (size_t i = 0; i < old.size; i++)
+      if (old.entries[i].text)
+      {
+        *fmt_slot(old.entries[i].id) = old.entries[i];
+        ++fmts.used;
+      }
+    free(old.entries);
+  }
+
+  e = fmt_slot(id);
+  if (e->text == NULL)
+    ++fmts.used;
+  free(e->text);
+  e->id   = id;
+  e->text = strdup(text);
+}
+
+static const char * fmt_lookup(uint64_t id)
+{
+  return fmts.size ? fmt_slot(id)->text : NULL;
+}
+
+
+static void print_record(const struct log_bin_head * head)
+{
+  char msg[LOG_BIN_MAX_LEN * 2];
+  char tim[64];
+  const char * fmt;
+  const char * lvl;
+  const char * ch;
+  struct timespec ts;
+
+  fmt = fmt_lookup(head->id);
+  if (fmt)
+    log_bin_render(fmt, (const unsigned char *) (head + 1), head->len - sizeof(*head), msg, sizeof(msg));
+  else
+    snprintf(msg, sizeof(msg), "<unknown format %#llx>", (unsigned long long) head->id);
+
+  ts.tv_sec  = (time_t) (head->ts / 1000000000ull);
+  ts.tv_nsec = (long) (head->ts % 1000000000ull);
+  ts_format(&ts, TS_LOGGER, tim, sizeof(tim));
+  lvl = log_get_level_name((enum log_level) head->ll, FALSE);
+  ch  = head->ch ? fmt_lookup(head->ch) : NULL;
+  if (ch)
+    printf("[%s][%s][%s] %s\n", tim, lvl ? lvl : "NONE", ch, msg);
+  else
+    printf("[%s][%s] %s\n", tim, lvl ? lvl : "NONE", msg);
+}
+
+/*
+ * Binary logs may be concatenated (several flight recorder dumps) or mixed
+ * with text on stderr, so anything that is neither a magic nor a plausible
+ * record is skipped byte by byte until the stream is in sync again.
+ */
+static int decode(FILE * in, const char * name)
+{
+  unsigned char * data = NULL;
+  size_t len = 0, cap = 0, pos = 0, skipped = 0;
+  struct log_bin_head head;
+  int in_sync = FALSE;
+
+  for (;;)
+  {
+    if (len == cap)
+    {
+      unsigned char * tmp = realloc(data, cap = cap ? cap * 2 : 1 << 16);
+      if (tmp == NULL)
+      {
+        fprintf(stderr, "%s: out of memory.\n", name);
+        free(data);
+        return -1;
+      }
+      data = tmp;
+    }
+    size_t n = fread(data + len, 1, cap - len, in);
+    if (n == 0)
+      break;
+    len += n;
+  }
+
+  while (pos < len)
+  {
+    if (len - pos >= LOG_BIN_MAGIC_LEN && memcmp(data + pos, LOG_BIN_MAGIC, LOG_BIN_MAGIC_LEN) == 0)
+    {
+      pos += LOG_BIN_MAGIC_LEN;
+      in_sync = TRUE;
+      continue;
+    }
+    if (in_sync && len - pos >= sizeof(head))
+    {
+      memcpy(&head, data + pos, sizeof(head));
+      if (head.len >= sizeof(head) && head.len <= LOG_BIN_MAX_LEN && head.len <= len - pos &&
+          (head.type == LOG_BIN_DEF || (head.type == LOG_BIN_REC && head.ll < LL_COUNT)))
+      {
+        unsigned char rec[LOG_BIN_MAX_LEN];
+        memcpy(rec, data + pos, head.len);
+        if (head.type == LOG_BIN_DEF)
+        {
+          rec[head.len - 1] = '\0';
+          fmt_define(head.id, (const char *) rec + sizeof(head));
+        }
+        else
+          print_record((const struct log_bin_head *) rec);
+        pos += head.len;
+        continue;
+      }
+    }
+    in_sync = FALSE;
+    ++skipped;
+    ++pos;
+  }
+
+  free(data);
+  if (skipped)
+    fprintf(stderr, "%s: skipped %zu byte(s) not belonging to a binary log.\n", name, skipped);
+  return 0;
+}
+
+int main(int argc, char * argv[])
+{
+  int rc = 0;
+
+  if (argc < 2)
+    return decode(stdin, "stdin") ? 1 : 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    FILE * in = fopen(argv[i], "rb");
+    if (in == NULL)
+    {
+      perror(argv[i]);
+      rc = 1;
+      continue;
+    }
+    if (decode(in, argv[i]))
+      rc = 1;
+    fclose(in);
+  }
+  return rc;
+}
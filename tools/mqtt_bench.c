@@ -0,0 +1,351 @@
+/*
+ * linuxtools_mqtt_bench - throughput and latency of the MQTT API against a broker
+ *
+ * usage: linuxtools_mqtt_bench [-B] [-h host] [-p port] [-P publishers] [-S subscribers]
+ *                              [-n messages] [-s payload] [-q qos] [-r rate] [-f] [-t timeout] [-o file]
+ *
+ *   -B  start a local mosquitto on the port for the run
+ *   -n  messages per publisher, -r messages per second per publisher (0: as fast as possible)
+ *   -s  payload bytes (raw mode), -f publish line protocol via mqtt_publish_formatted instead
+ *   -t  seconds to wait for outstanding messages after the last publish
+ *
+ * Every publisher and subscriber is a threaded handle of its own. Payloads carry
+ * the send time (CLOCK_MONOTONIC), the subscription callback takes the end to
+ * end latency. The result goes to stdout (or -o file) as one JSON object,
+ * latencies are upper bounds of log2 buckets.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "ctrl/com/mqtt.h"
+#include "ctrl/logger.h"
+#include "stathelp.h"
+#include "version.h"
+
+#define BENCH_TOPIC_RAW  "bench/raw"
+#define BENCH_TOPIC_LP   "bench/lp"
+#define BENCH_TS_LEN     20
+
+static struct bench_opts
+{
+  const char * host;
+  int          port;
+  int          spawn;
+  unsigned int publishers;
+  unsigned int subscribers;
+  unsigned int messages;
+  size_t       payload;
+  int          qos;
+  unsigned int rate;
+  int          formatted;
+  unsigned int timeout;
+  const char * out;
+} opt = { "localhost", 1883, FALSE, 1, 1, 100000, 64, 0, 0, FALSE, 10, NULL };
+
+static struct bench_state
+{
+  uint64_t         received;
+  uint64_t         bytes;
+  uint64_t         last_ns;
+  uint64_t         sent;
+  struct stat_hist latency;
+} st;
+
+struct bench_client
+{
+  struct mqtt_config   cfg;
+  struct mqtt_handle * hnd;
+  char                 id[32];
+  pthread_t            thread;
+  unsigned int         idx;
+};
+
+
+static void bench_receive(const char * topic, const char * payload)
+{
+  const char * ts = payload;
+  uint64_t now = stat_now_ns();
+  uint64_t sent;
+
+  (void) topic;
+  if (opt.formatted && (ts = strstr(payload, "value=")) != NULL)
+    ts += 6;
+  sent = ts ? strtoull(ts, NULL, 10) : 0;
+  if (sent && sent <= now)
+    stat_hist_add(&st.latency, now - sent);
+  __atomic_add_fetch(&st.received, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&st.bytes, strlen(payload), __ATOMIC_RELAXED);
+  __atomic_store_n(&st.last_ns, now, __ATOMIC_RELAXED);
+}
+
+static struct mqtt_sub bench_subs[] = {
+  { "bench/#", bench_receive },
+  { NULL     , NULL          }
+};
+
+
+static int bench_client_open(struct bench_client * c, const char * role, unsigned int idx, struct mqtt_sub * subs)
+{
+  snprintf(c->id, sizeof(c->id), "bench-%s-%u-%d", role, idx, (int) getpid());
+  memset(&c->cfg, 0, sizeof(c->cfg));
+  c->cfg.remote_address = opt.host;
+  c->cfg.remote_port    = opt.port;
+  c->cfg.client_id      = c->id;
+  c->cfg.topic          = BENCH_TOPIC_LP;
+  c->cfg.qos            = opt.qos;
+  c->cfg.subs           = subs;
+  c->cfg.queue_len      = 4096;
+  c->idx                = idx;
+  return mqtt_connect_async(&c->hnd, &c->cfg) == MQTT_RET_OK && mqtt_start(c->hnd) == MQTT_RET_OK;
+}
+
+static void * bench_publisher(void * arg)
+{
+  struct bench_client * c = arg;
+  size_t len = opt.payload > BENCH_TS_LEN ? opt.payload : BENCH_TS_LEN;
+  char * payload = malloc(len + 1);
+  char topic[64];
+  char entity[32];
+  uint64_t start = stat_now_ns();
+  uint64_t due;
+  struct timespec pause;
+
+  if (payload == NULL)
+    return NULL;
+  memset(payload, 'x', len);
+  payload[len] = '\0';
+  snprintf(topic, sizeof(topic), BENCH_TOPIC_RAW "/%u", c->idx);
+  snprintf(entity, sizeof(entity), "bench%u", c->idx);
+
+  for (unsigned int i = 0; i < opt.messages; i++)
+  {
+    if (opt.rate)
+    {
+      due = start + (uint64_t) i * 1000000000ull / opt.rate;
+      if (due > stat_now_ns())
+      {
+        pause.tv_sec  = (time_t) ((due - stat_now_ns()) / 1000000000ull);
+        pause.tv_nsec = (long) ((due - stat_now_ns()) % 1000000000ull);
+        nanosleep(&pause, NULL);
+      }
+    }
+    if (opt.formatted)
+      mqtt_publish_formatted(c->hnd, "lat", entity, "%" PRIu64, stat_now_ns());
+    else
+    {
+      char ts[BENCH_TS_LEN + 1];
+      snprintf(ts, sizeof(ts), "%0*" PRIu64, BENCH_TS_LEN, stat_now_ns());
+      memcpy(payload, ts, BENCH_TS_LEN);
+      mqtt_publish_raw(c->hnd, topic, payload);
+    }
+    __atomic_add_fetch(&st.sent, 1, __ATOMIC_RELAXED);
+  }
+  mqtt_flush(c->hnd);
+  free(payload);
+  return NULL;
+}
+
+
+static pid_t bench_spawn_broker(void)
+{
+  char port[16];
+  pid_t pid;
+  int fd;
+
+  snprintf(port, sizeof(port), "%d", opt.port);
+  pid = fork();
+  if (pid == 0)
+  {
+    fd = open("/dev/null", O_WRONLY);
+    if (fd >= 0)
+    {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+    }
+    execlp("mosquitto", "mosquitto", "-p", port, (char *) NULL);
+    _exit(127);
+  }
+  if (pid < 0)
+    fprintf(stderr, "could not start mosquitto: %s\n", strerror(errno));
+  else
+    usleep(300000);
+  return pid;
+}
+
+static int bench_wait_connected(struct bench_client * c, unsigned int count)
+{
+  uint64_t until = stat_now_ns() + 5000000000ull;
+
+  for (unsigned int i = 0; i < count; i++)
+    while (mqtt_get_state(c[i].hnd) != MQTT_STATE_CONNECTED)
+    {
+      if (stat_now_ns() > until)
+        return FALSE;
+      usleep(10000);
+    }
+  return TRUE;
+}
+
+static uint64_t bench_cpu_ns(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ((uint64_t) ru.ru_utime.tv_sec + (uint64_t) ru.ru_stime.tv_sec) * 1000000000ull +
+         ((uint64_t) ru.ru_utime.tv_usec + (uint64_t) ru.ru_stime.tv_usec) * 1000ull;
+}
+
+static void usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [-B] [-h host] [-p port] [-P publishers] [-S subscribers] [-n messages]\n"
+                  "       [-s payload] [-q qos] [-r rate] [-f] [-t timeout] [-o file]\n", name);
+}
+
+int main(int argc, char * argv[])
+{
+  struct bench_client * pubs, * subs;
+  struct stat_hist lat;
+  uint64_t expected, start, pub_end, end, cpu, last, received;
+  double secs, pub_secs;
+  pid_t broker = -1;
+  FILE * out = stdout;
+  int c, rc = 0;
+
+  while ((c = getopt(argc, argv, "Bh:p:P:S:n:s:q:r:ft:o:")) != -1)
+    switch (c)
+    {
+      case 'B': opt.spawn       = TRUE;                          break;
+      case 'h': opt.host        = optarg;                        break;
+      case 'p': opt.port        = atoi(optarg);                  break;
+      case 'P': opt.publishers  = (unsigned int) atoi(optarg);   break;
+      case 'S': opt.subscribers = (unsigned int) atoi(optarg);   break;
+      case 'n': opt.messages    = (unsigned int) atoi(optarg);   break;
+      case 's': opt.payload     = (size_t) atol(optarg);         break;
+      case 'q': opt.qos         = atoi(optarg);                  break;
+      case 'r': opt.rate        = (unsigned int) atoi(optarg);   break;
+      case 'f': opt.formatted   = TRUE;                          break;
+      case 't': opt.timeout     = (unsigned int) atoi(optarg);   break;
+      case 'o': opt.out         = optarg;                        break;
+      default : usage(argv[0]); return 2;
+    }
+  if (opt.publishers == 0 || opt.qos < 0 || opt.qos > 2)
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  log_init("mqtt_bench", LF_STDOUT, LL_WARN);  /* warnings and worse go to stderr */
+  if (opt.spawn && (broker = bench_spawn_broker()) < 0)
+    return 1;
+
+  pubs = calloc(opt.publishers, sizeof(*pubs));
+  subs = calloc(opt.subscribers ? opt.subscribers : 1, sizeof(*subs));
+  if (pubs == NULL || subs == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    rc = 1;
+    goto END;
+  }
+  for (unsigned int i = 0; i < opt.subscribers; i++)
+    if (!bench_client_open(&subs[i], "sub", i, bench_subs))
+    {
+      rc = 1;
+      goto END;
+    }
+  for (unsigned int i = 0; i < opt.publishers; i++)
+    if (!bench_client_open(&pubs[i], "pub", i, NULL))
+    {
+      rc = 1;
+      goto END;
+    }
+  if (!bench_wait_connected(subs, opt.subscribers) || !bench_wait_connected(pubs, opt.publishers))
+  {
+    fprintf(stderr, "could not connect to %s:%d\n", opt.host, opt.port);
+    rc = 1;
+    goto END;
+  }
+  usleep(200000);  /* subscriptions acknowledged */
+
+  expected = (uint64_t) opt.publishers * opt.messages * opt.subscribers;
+  cpu      = bench_cpu_ns();
+  start    = stat_now_ns();
+  for (unsigned int i = 0; i < opt.publishers; i++)
+    pthread_create(&pubs[i].thread, NULL, bench_publisher, &pubs[i]);
+  for (unsigned int i = 0; i < opt.publishers; i++)
+    pthread_join(pubs[i].thread, NULL);
+  pub_end = stat_now_ns();
+
+  /* wait for the rest as long as messages keep coming in */
+  last = 0;
+  end  = pub_end;
+  while ((received = __atomic_load_n(&st.received, __ATOMIC_RELAXED)) < expected)
+  {
+    if (received != last)
+    {
+      last = received;
+      end  = stat_now_ns();
+    }
+    else if (stat_now_ns() - end > (uint64_t) opt.timeout * 1000000000ull)
+      break;
+    usleep(1000);
+  }
+  end = __atomic_load_n(&st.last_ns, __ATOMIC_RELAXED);
+  if (end < pub_end)
+    end = pub_end;
+  cpu = bench_cpu_ns() - cpu;
+
+  stat_hist_snapshot(&lat, &st.latency);
+  secs     = (double) (end - start) / 1e9;
+  pub_secs = (double) (pub_end - start) / 1e9;
+  received = st.received;
+
+  if (opt.out && (out = fopen(opt.out, "w")) == NULL)
+  {
+    perror(opt.out);
+    out = stdout;
+  }
+  fprintf(out, "{\"version\":\"%s\",\"mode\":\"%s\",\"publishers\":%u,\"subscribers\":%u,\"messages\":%u,"
+               "\"payload\":%zu,\"qos\":%d,\"rate\":%u,",
+          APP_VERSION, opt.formatted ? "formatted" : "raw", opt.publishers, opt.subscribers, opt.messages,
+          opt.payload, opt.qos, opt.rate);
+  fprintf(out, "\"sent\":%" PRIu64 ",\"received\":%" PRIu64 ",\"expected\":%" PRIu64 ",\"seconds\":%.3f,"
+               "\"publish_msgs_per_s\":%.0f,\"msgs_per_s\":%.0f,\"mb_per_s\":%.3f,\"cpu_ns_per_msg\":%.0f,",
+          st.sent, received, expected, secs, pub_secs > 0 ? (double) st.sent / pub_secs : 0,
+          secs > 0 ? (double) received / secs : 0, secs > 0 ? (double) st.bytes / secs / 1e6 : 0,
+          st.sent + received ? (double) cpu / (double) (st.sent + received) : 0);
+  fprintf(out, "\"latency_ns\":{\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64 ",\"max\":%" PRIu64
+               ",\"mean\":%" PRIu64 "}}\n",
+          stat_hist_percentile(&lat, 0.5), stat_hist_percentile(&lat, 0.99), stat_hist_percentile(&lat, 0.999), lat.max,
+          lat.count ? lat.sum / lat.count : 0);
+  if (out != stdout)
+    fclose(out);
+  if (opt.subscribers && received < expected)
+    rc = 3;
+
+END:
+  for (unsigned int i = 0; pubs && i < opt.publishers; i++)
+    if (pubs[i].hnd)
+      mqtt_close(pubs[i].hnd);
+  for (unsigned int i = 0; subs && i < opt.subscribers; i++)
+    if (subs[i].hnd)
+      mqtt_close(subs[i].hnd);
+  free(pubs);
+  free(subs);
+  if (broker > 0)
+  {
+    kill(broker, SIGTERM);
+    waitpid(broker, NULL, 0);
+  }
+  return rc;
+}
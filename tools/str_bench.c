@@ -0,0 +1,121 @@
+/*
+ * linuxtools_str_bench - stringhelp kernels against the byte loops they replace
+ *
+ * usage: linuxtools_str_bench [iterations]   (default 2000000 per case)
+ *
+ * Prints ns per call of kernel and reference for a few string lengths. The
+ * reference of stricmp is its former toupper() loop, of str_level_len the
+ * former level scan of the MQTT subscription trie.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stathelp.h"
+#include "stringhelp.h"
+
+#define BENCH_MAX_LEN 512
+
+static volatile uint64_t sink;
+
+static char str_a[BENCH_MAX_LEN + 1];
+static char str_b[BENCH_MAX_LEN + 1];
+
+
+static int ref_strincmp(const char * str1, const char * str2, size_t len)
+{
+  int idx;
+  for (;*str1 != '\0' && *str2 != '\0' && len > 1; ++str1, ++str2, --len)
+  {
+    idx = toupper(*str1) - toupper(*str2);
+    if (idx)
+      return idx;
+  }
+  return toupper(*str1) - toupper(*str2);
+}
+
+static size_t ref_level_len(const char * level)
+{
+  const char * end = level;
+  while (*end && *end != '/')
+    ++end;
+  return end - level;
+}
+
+static uint64_t ref_ihash(const char * str, size_t len)
+{
+  uint64_t hash = 14695981039346656037ull;
+
+  while (len--)
+  {
+    hash ^= (unsigned char) toupper((unsigned char) *str++);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+
+/* ns per call, the operation is picked by op */
+static double bench_run(int op, size_t len, unsigned long iterations)
+{
+  uint64_t start = stat_now_ns();
+  uint64_t acc = 0;
+
+  for (unsigned long i = 0; i < iterations; i++)
+  {
+    switch (op)
+    {
+      case 0: acc += (uint64_t) stricmp(str_a, str_b);             break;
+      case 1: acc += (uint64_t) ref_strincmp(str_a, str_b, SIZE_MAX); break;
+      case 2: acc += str_nlen(str_a, len + 1);                     break;
+      case 3: acc += strnlen(str_a, len + 1);                      break;
+      case 4: acc += str_level_len(str_a);                         break;
+      case 5: acc += ref_level_len(str_a);                         break;
+      case 6: acc += str_ihash(str_a, len);                        break;
+      case 7: acc += ref_ihash(str_a, len);                        break;
+    }
+    __asm__ volatile("" ::: "memory");  /* no hoisting out of the loop */
+  }
+  sink = acc;
+  return (double) (stat_now_ns() - start) / (double) iterations;
+}
+
+static void bench_strings(size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    str_a[i] = (char) ('a' + i % 26);
+    str_b[i] = (char) ('A' + i % 26);
+  }
+  str_a[len] = '\0';
+  str_b[len] = '\0';
+}
+
+int main(int argc, char * argv[])
+{
+  static const size_t lengths[] = { 7, 16, 40, 128, BENCH_MAX_LEN };
+  static const char * names[] = { "stricmp", "str_nlen", "str_level_len", "str_ihash" };
+  static const char * refs[]  = { "toupper loop", "strnlen", "byte loop", "FNV-1a toupper" };
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+  double kernel, ref;
+
+  if (iterations == 0)
+  {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 2;
+  }
+
+  printf("%-14s %6s %12s %12s %-15s %8s\n", "kernel", "len", "ns/call", "ref ns/call", "reference", "speedup");
+  for (int k = 0; k < 4; k++)
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+      bench_strings(lengths[l]);
+      kernel = bench_run(2 * k, lengths[l], iterations);
+      ref    = bench_run(2 * k + 1, lengths[l], iterations);
+      printf("%-14s %6zu %12.2f %12.2f %-15s %7.2fx\n", names[k], lengths[l], kernel, ref, refs[k], kernel > 0 ? ref / kernel : 0);
+    }
+  return 0;
+}